@@ -6,6 +6,7 @@ Library for Lustre file system management
 """
 # pylint: disable=too-many-lines,too-many-return-statements,invalid-name
 import os
+import pipes
 import re
 import time
 
@@ -3777,114 +3778,80 @@ def fid_path(fid, fsname_rootpath):
     return "%s/.lustre/fid/%s" % (fsname_rootpath, fid)
 
 
-def lfs_hsm_archive(log, fpath, archive_id, host=None):
+# Max number of files in one lond_hsm_request command, it sends them in
+# batches of HSM requests
+LFS_HSM_BATCH_SIZE = 1000
+
+
+def lfs_hsm_command(log, action, fpaths, archive_id=None, host=None):
     """
-    HSM archive
+    Send HSM requests of one path or a list of paths through
+    lond_hsm_request. Paths are passed in batches, so that each batch is
+    sent as a few HSM requests instead of running one process for each
+    file. Each path is quoted since the command is run by a shell.
     """
-    command = ("lfs hsm_archive --archive %s %s" % (archive_id, fpath))
+    if isinstance(fpaths, str):
+        fpaths = [fpaths]
     extra_string = ""
-    if host is None:
-        retval = utils.run(command)
-    else:
-        retval = host.sh_run(log, command)
+    if host is not None:
         extra_string = (" on host [%s]" % host.sh_hostname)
-    if retval.cr_exit_status != 0:
-        log.cl_error("failed to run command [%s]%s, "
-                     "ret = [%d], stdout = [%s], stderr = [%s]",
-                     command, extra_string,
-                     retval.cr_exit_status, retval.cr_stdout,
-                     retval.cr_stderr)
-        return -1
+    option_string = ""
+    if archive_id is not None:
+        option_string = " --archive %s" % archive_id
+    for start in range(0, len(fpaths), LFS_HSM_BATCH_SIZE):
+        batch = fpaths[start:start + LFS_HSM_BATCH_SIZE]
+        command = ("lond_hsm_request%s %s %s" %
+                   (option_string, action,
+                    " ".join([pipes.quote(fpath) for fpath in batch])))
+        if host is None:
+            retval = utils.run(command)
+        else:
+            retval = host.sh_run(log, command)
+        if retval.cr_exit_status != 0:
+            log.cl_error("failed to run command [%s]%s, "
+                         "ret = [%d], stdout = [%s], stderr = [%s]",
+                         command, extra_string,
+                         retval.cr_exit_status, retval.cr_stdout,
+                         retval.cr_stderr)
+            return -1
 
     return 0
 
 
-def lfs_hsm_restore(log, fpath, host=None):
+def lfs_hsm_archive(log, fpaths, archive_id, host=None):
     """
-    HSM restore
+    HSM archive
     """
-    command = ("lfs hsm_restore %s" % (fpath))
-    extra_string = ""
-    if host is None:
-        retval = utils.run(command)
-    else:
-        retval = host.sh_run(log, command)
-        extra_string = ("on host [%s]" % host.sh_hostname)
-    if retval.cr_exit_status != 0:
-        log.cl_error("failed to run command [%s]%s, "
-                     "ret = [%d], stdout = [%s], stderr = [%s]",
-                     command, extra_string,
-                     retval.cr_exit_status, retval.cr_stdout,
-                     retval.cr_stderr)
-        return -1
+    return lfs_hsm_command(log, "archive", fpaths, archive_id=archive_id,
+                           host=host)
 
-    return 0
+
+def lfs_hsm_restore(log, fpaths, host=None):
+    """
+    HSM restore
+    """
+    return lfs_hsm_command(log, "restore", fpaths, host=host)
 
 
-def lfs_hsm_release(log, fpath, host=None):
+def lfs_hsm_release(log, fpaths, host=None):
     """
     HSM release
     """
-    command = ("lfs hsm_release %s" % (fpath))
-    extra_string = ""
-    if host is None:
-        retval = utils.run(command)
-    else:
-        retval = host.sh_run(log, command)
-        extra_string = ("on host [%s]" % host.sh_hostname)
-    if retval.cr_exit_status != 0:
-        log.cl_error("failed to run command [%s]%s, "
-                     "ret = [%d], stdout = [%s], stderr = [%s]",
-                     command, extra_string,
-                     retval.cr_exit_status, retval.cr_stdout,
-                     retval.cr_stderr)
-        return -1
-
-    return 0
+    return lfs_hsm_command(log, "release", fpaths, host=host)
 
 
-def lfs_hsm_remove(log, fpath, host=None):
+def lfs_hsm_remove(log, fpaths, host=None):
     """
     HSM remove
     """
-    command = ("lfs hsm_remove %s" % (fpath))
-    extra_string = ""
-    if host is None:
-        retval = utils.run(command)
-    else:
-        retval = host.sh_run(log, command)
-        extra_string = ("on host [%s]" % host.sh_hostname)
-    if retval.cr_exit_status != 0:
-        log.cl_error("failed to run command [%s]%s, "
-                     "ret = [%d], stdout = [%s], stderr = [%s]",
-                     command, extra_string,
-                     retval.cr_exit_status, retval.cr_stdout,
-                     retval.cr_stderr)
-        return -1
-
-    return 0
+    return lfs_hsm_command(log, "remove", fpaths, host=host)
 
 
-def lfs_hsm_cancel(log, fpath, host=None):
+def lfs_hsm_cancel(log, fpaths, host=None):
     """
-    HSM remove
+    HSM cancel
     """
-    command = ("lfs hsm_cancel %s" % (fpath))
-    extra_string = ""
-    if host is None:
-        retval = utils.run(command)
-    else:
-        retval = host.sh_run(log, command)
-        extra_string = ("on host [%s]" % host.sh_hostname)
-    if retval.cr_exit_status != 0:
-        log.cl_error("failed to run command [%s]%s, "
-                     "ret = [%d], stdout = [%s], stderr = [%s]",
-                     command, extra_string,
-                     retval.cr_exit_status, retval.cr_stdout,
-                     retval.cr_stderr)
-        return -1
-
-    return 0
+    return lfs_hsm_command(log, "cancel", fpaths, host=host)
 
 
 def lustre_unlink(log, path, host=None):
@@ -119,6 +119,56 @@ class CopytooldClient(object):
             log.cl_stderr("failed to send start request")
         return ret
 
+    def cc_send_get_config_request(self, log):
+        """
+        Get the configs of the copytool, return a dict of name to value, or
+        None on failure
+        """
+        message = CopytooldClientMessage(copytoold_pb2.CopytooldMessage.CMT_GET_CONFIG_REQUEST,
+                                         copytoold_pb2.CopytooldMessage.CMT_GET_CONFIG_REPLY)
+        message.ccm_request.cm_get_config_request.SetInParent()
+        ret = message.ccm_communicate(log, self.cc_poll, self.cc_client,
+                                      COPYTOOLD_CLIENT_TIMEOUT)
+        if ret:
+            log.cl_stderr("failed to send get config request")
+            return None
+        configs = {}
+        for item in message.ccm_reply.cm_get_config_reply.cgcr_items:
+            configs[item.cci_name] = item.cci_value
+        return configs
+
+    def cc_send_set_config_request(self, log, configs):
+        """
+        Change the configs of the running copytool, e.g. the bandwidth, the
+        threads or the priority policy, configs is a dict of name to value
+        """
+        message = CopytooldClientMessage(copytoold_pb2.CopytooldMessage.CMT_SET_CONFIG_REQUEST,
+                                         copytoold_pb2.CopytooldMessage.CMT_SET_CONFIG_REPLY)
+        message.ccm_request.cm_set_config_request.SetInParent()
+        for name, value in configs.items():
+            item = message.ccm_request.cm_set_config_request.cscr_items.add()
+            item.cci_name = name
+            item.cci_value = value
+        ret = message.ccm_communicate(log, self.cc_poll, self.cc_client,
+                                      COPYTOOLD_CLIENT_TIMEOUT)
+        if ret:
+            log.cl_stderr("failed to send set config request")
+        return ret
+
+    def cc_send_stats_request(self, log):
+        """
+        Get the metrics of the copytool in JSON, None on failure
+        """
+        message = CopytooldClientMessage(copytoold_pb2.CopytooldMessage.CMT_STATS_REQUEST,
+                                         copytoold_pb2.CopytooldMessage.CMT_STATS_REPLY)
+        message.ccm_request.cm_stats_request.SetInParent()
+        ret = message.ccm_communicate(log, self.cc_poll, self.cc_client,
+                                      COPYTOOLD_CLIENT_TIMEOUT)
+        if ret:
+            log.cl_stderr("failed to send stats request")
+            return None
+        return message.ccm_reply.cm_stats_reply.cstr_json
+
     def cc_fini(self):
         """
         Finish the connection to the server
@@ -25,6 +25,7 @@ def simple_usage():
     """
     utils.eprint("  commands:\n"
                  "    fetch     fetch dirs from global Lustre to local Lustre\n"
+                 "    prefetch  restore fetched files in advance\n"
                  "    stat      show the lond status of dirs or files\n"
                  "    sync      sync dirs from local Lustre to global Lustre\n"
                  "    unlock    unlock global Lustre dirs or files\n")
@@ -107,14 +108,22 @@ def lond_command_fetch(interact, log, args):
     start_copytool = True
     sources = []
     dest = None
-    real_args = args[1:]
-    for arg_index, arg in enumerate(real_args):
+    paths = []
+    skip_next = False
+    for arg in args[1:]:
+        if skip_next:
+            skip_next = False
+            continue
         if arg == "-h" or arg == "--help":
             start_copytool = False
-        if arg_index == len(real_args) - 1:
-            dest = arg
-        else:
-            sources.append(arg)
+        elif arg == "-t" or arg == "--threads":
+            # The next argument is the thread number
+            skip_next = True
+        elif not arg.startswith("-"):
+            paths.append(arg)
+    if paths:
+        dest = paths[-1]
+        sources = paths[:-1]
 
     if start_copytool:
         if dest is None:
@@ -176,6 +185,22 @@ LOND_COMMANDS[LOND_COMMNAD_FETCH] = \
                 definition.LOND_FETCH_OPTIONS)
 
 
+LOND_COMMNAD_PREFETCH = "prefetch"
+
+
+def lond_command_prefetch(interact, log, args):
+    # pylint: disable=unused-argument
+    """
+    Restore the fetched files on on demand Lustre in advance
+    """
+    return lond_command_common(LOND_COMMNAD_PREFETCH, interact, log, args)
+
+
+LOND_COMMANDS[LOND_COMMNAD_PREFETCH] = \
+    LondCommand(LOND_COMMNAD_PREFETCH, lond_command_prefetch,
+                definition.LOND_PREFETCH_OPTIONS)
+
+
 LOND_COMMNAD_UNLOCK = "unlock"
 
 
@@ -4,8 +4,12 @@
 """
 Copytool manager daemon
 """
+import errno
 import os
+import re
 import sys
+import time
+import threading
 import traceback
 import socket
 import zmq
@@ -24,23 +28,64 @@ COPYTOOLD_CONFIG = "/etc/lond_copytoold.conf"
 COPYTOOLD_LOG_DIR = "/var/log/lond/copytoold"
 COPYTOOLD_PORT_STR = "port"
 COPYTOOL_COMMAND = "lond_copytool"
+COPYTOOL_CONTROL_SOCKET = "/var/run/lond_copytool.sock"
+# Seconds to wait for the control socket of a started copytool
+COPYTOOL_START_TIMEOUT = 10
+# Seconds to wait for the reply to a command of the copytool
+COPYTOOL_CONTROL_TIMEOUT = 10
+# Only one copytool is started by the worker threads
+COPYTOOL_START_LOCK = threading.Lock()
 
 
-def start_copytool(log, host, source, dest):
+def copytool_control(log, command):
     """
-    Start a copytool from source to dest
-    """
-    command = "%s %s %s --daemon" % (COPYTOOL_COMMAND, source, dest)
-    pgrep_command = "pgrep -f -x '%s'" % command
-    retval = host.sh_run(log, pgrep_command)
-    if retval.cr_exit_status == 0:
-        copytool_processes = retval.cr_stdout.splitlines()
-        if copytool_processes:
-            log.cl_info("copytool from [%s] to [%s] is already running as "
-                        "process %s",
-                        source, dest, copytool_processes)
-            return 0
+    Send a command to the copytool over its control socket. Return
+    (0, reply) on success, (-errno.ENOENT, None) if the copytool is not
+    running, or (-1, None) on other failures, including timeout.
+    """
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.settimeout(COPYTOOL_CONTROL_TIMEOUT)
+    try:
+        try:
+            sock.connect(COPYTOOL_CONTROL_SOCKET)
+        except socket.timeout:
+            log.cl_error("timeout when connecting to control socket [%s] "
+                         "of copytool", COPYTOOL_CONTROL_SOCKET)
+            return -1, None
+        except socket.error as error:
+            if error.errno in (errno.ENOENT, errno.ECONNREFUSED):
+                return -errno.ENOENT, None
+            log.cl_error("failed to connect to control socket [%s] of "
+                         "copytool: %s", COPYTOOL_CONTROL_SOCKET, error)
+            return -1, None
+
+        sock.sendall((command + "\n").encode())
+        sock.shutdown(socket.SHUT_WR)
+        reply = b""
+        while True:
+            data = sock.recv(4096)
+            if not data:
+                break
+            reply += data
+    except socket.timeout:
+        log.cl_error("timeout when running command [%s] of copytool",
+                     command)
+        return -1, None
+    except socket.error as error:
+        log.cl_error("failed to run command [%s] of copytool: %s",
+                     command, error)
+        return -1, None
+    finally:
+        sock.close()
+    return 0, reply.decode()
 
+
+def start_copytool_process(log, host, source, dest):
+    """
+    Start the copytool process with the first pair of source and dest
+    """
+    command = ("%s --daemon --control-socket %s %s %s" %
+               (COPYTOOL_COMMAND, COPYTOOL_CONTROL_SOCKET, source, dest))
     retval = host.sh_run(log, command)
     if retval.cr_exit_status != 0:
         log.cl_error("failed to run command, command = [%s], "
@@ -51,30 +96,132 @@ def start_copytool(log, host, source, dest):
                      retval.cr_stderr)
         return -1
 
-    retval = host.sh_run(log, pgrep_command)
-    if retval.cr_exit_status == 0:
-        copytool_processes = retval.cr_stdout.splitlines()
-        if copytool_processes:
-            log.cl_info("copytool from [%s] to [%s] is started as process %s",
-                        source, dest, copytool_processes)
+    for _ in range(COPYTOOL_START_TIMEOUT):
+        ret, _ = copytool_control(log, "metrics")
+        if ret == 0:
+            log.cl_info("copytool from [%s] to [%s] is started",
+                        source, dest)
             return 0
-        else:
-            log.cl_error("unexpected output of command, command = [%s], "
-                         "ret = [%d], stdout = [%s], stderr = [%s]",
-                         pgrep_command,
-                         retval.cr_exit_status,
-                         retval.cr_stdout,
-                         retval.cr_stderr)
-    else:
-        log.cl_error("failed to run command, command = [%s], "
-                     "ret = [%d], stdout = [%s], stderr = [%s]",
-                     pgrep_command,
-                     retval.cr_exit_status,
-                     retval.cr_stdout,
-                     retval.cr_stderr)
+        time.sleep(1)
+    log.cl_error("control socket [%s] of copytool is not ready after "
+                 "[%d] seconds", COPYTOOL_CONTROL_SOCKET,
+                 COPYTOOL_START_TIMEOUT)
+    return -1
+
+
+def start_copytool(log, host, source, dest):
+    """
+    Start a copytool from source to dest. All the pairs of source and dest
+    are served by one copytool process, which shares the threads, buffers
+    and bandwidth limits among them.
+    """
+    with COPYTOOL_START_LOCK:
+        ret, reply = copytool_control(log, "add-pair %s %s" % (source, dest))
+        if ret == -errno.ENOENT:
+            return start_copytool_process(log, host, source, dest)
+    if ret:
+        log.cl_error("failed to add copytool from [%s] to [%s]",
+                     source, dest)
+        return -1
+
+    if reply.startswith("added"):
+        log.cl_info("copytool from [%s] to [%s] is added", source, dest)
+        return 0
+    # The same pair is running already
+    if reply.startswith("error: %s" % os.strerror(errno.EALREADY)):
+        log.cl_info("copytool from [%s] to [%s] is already running",
+                    source, dest)
+        return 0
+    # EEXIST means that dest is used by a pair from another source
+    log.cl_error("failed to add copytool from [%s] to [%s]: %s",
+                 source, dest, reply.strip())
     return -1
 
 
+def copytool_request(log, command):
+    """
+    Run a command of the copytool, return the errno of the protocol and the
+    output of the command
+    """
+    cmessage = copytoold_pb2.CopytooldMessage
+    ret, reply = copytool_control(log, command)
+    if ret == -errno.ENOENT:
+        log.cl_error("copytool is not running")
+        return cmessage.CE_NOT_RUNNING, None
+    if ret:
+        return cmessage.CE_OPERATION_FAILED, None
+    if reply.startswith("error: "):
+        log.cl_error("failed to run command [%s] of copytool: %s",
+                     command, reply.strip())
+        return cmessage.CE_OPERATION_FAILED, None
+    return cmessage.CE_NO_ERROR, reply
+
+
+def copytool_config_items(log, output, items):
+    """
+    Parse the "<name> <value>" lines of the copytool into config items
+    """
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) != 2 or not fields[1].isdigit():
+            log.cl_error("invalid config [%s] of copytool", line)
+            return -1
+        item = items.add()
+        item.cci_name = fields[0]
+        item.cci_value = int(fields[1])
+    return 0
+
+
+def copytool_get_config(log, reply):
+    """
+    Get the configs of the running copytool
+    """
+    cmessage = copytoold_pb2.CopytooldMessage
+    reply.cm_type = cmessage.CMT_GET_CONFIG_REPLY
+    reply.cm_errno, output = copytool_request(log, "get-config")
+    if output is None:
+        return
+    ret = copytool_config_items(log, output,
+                                reply.cm_get_config_reply.cgcr_items)
+    if ret:
+        reply.cm_errno = cmessage.CE_OPERATION_FAILED
+
+
+def copytool_set_config(log, request, reply):
+    """
+    Change the configs of the running copytool without restarting it
+    """
+    cmessage = copytoold_pb2.CopytooldMessage
+    reply.cm_type = cmessage.CMT_SET_CONFIG_REPLY
+    command = "set-config"
+    for item in request.cm_set_config_request.cscr_items:
+        if not re.match(r"^[a-z_]+$", item.cci_name):
+            log.cl_error("invalid config name [%s]", item.cci_name)
+            reply.cm_errno = cmessage.CE_OPERATION_FAILED
+            return
+        command += " %s=%d" % (item.cci_name, item.cci_value)
+    log.cl_info("received a request to change the copytool: [%s]", command)
+
+    reply.cm_errno, output = copytool_request(log, command)
+    if output is None:
+        return
+    ret = copytool_config_items(log, output,
+                                reply.cm_set_config_reply.cscp_items)
+    if ret:
+        reply.cm_errno = cmessage.CE_OPERATION_FAILED
+
+
+def copytool_stats(log, reply):
+    """
+    Get the metrics of the running copytool
+    """
+    cmessage = copytoold_pb2.CopytooldMessage
+    reply.cm_type = cmessage.CMT_STATS_REPLY
+    reply.cm_errno, output = copytool_request(log, "stats")
+    if output is not None:
+        reply.cm_stats_reply.cstr_json = output
+
+
 class CopytoolDaemon(object):
     """
     This server that listen and handle requests from console
@@ -155,6 +302,12 @@ class CopytoolDaemon(object):
                 if ret:
                     reply.cm_errno = cmessage.CE_OPERATION_FAILED
                 reply.cm_type = cmessage.CMT_START_REPLY
+            elif request.cm_type == cmessage.CMT_GET_CONFIG_REQUEST:
+                copytool_get_config(log, reply)
+            elif request.cm_type == cmessage.CMT_SET_CONFIG_REQUEST:
+                copytool_set_config(log, request, reply)
+            elif request.cm_type == cmessage.CMT_STATS_REQUEST:
+                copytool_stats(log, reply)
             else:
                 reply.cm_type = cmessage.CMT_GENERAL
                 reply.cm_errno = cmessage.CE_NO_TYPE
@@ -164,8 +317,8 @@ class CopytoolDaemon(object):
 
             reply_message = reply.SerializeToString()
             dispatcher_socket.send(reply_message)
-            log.cl_info("send reply to a start request of copytool from [%s] to [%s]",
-                        source, dest)
+            log.cl_debug("sent reply with type [%s] and errno [%s]",
+                         reply.cm_type, reply.cm_errno)
         dispatcher_socket.close()
         log.cl_info("worker thread [%s] exited", worker_index)
 
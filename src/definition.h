@@ -39,8 +39,12 @@ enum {
 	  .has_arg = required_argument },				\
 	{ .val = 'h',	.name = "help",					\
 	  .has_arg = no_argument },					\
+	{ .val = 'p',	.name = "prefetch",				\
+	  .has_arg = no_argument },					\
 	{ .val = 'r',	.name = "rename",				\
 	  .has_arg = no_argument },					\
+	{ .val = 't',	.name = "threads",				\
+	  .has_arg = required_argument },				\
 	{ .name = NULL }						\
 }
 
@@ -53,6 +57,8 @@ enum {
 	  .has_arg = no_argument },					\
 	{ .val = 'k',	.name = "key",					\
 	  .has_arg = required_argument },				\
+	{ .val = 't',	.name = "threads",				\
+	  .has_arg = required_argument },				\
 	{ .name = NULL }						\
 }
 
@@ -63,6 +69,28 @@ enum {
 	  .has_arg = no_argument },					\
 	{ .val = 'd',	.name = "directory",				\
 	  .has_arg = no_argument },					\
+	{ .val = 't',	.name = "threads",				\
+	  .has_arg = required_argument },				\
+	{ .name = NULL }						\
+}
+
+#define LOND_PREFETCH_OPTIONS {						\
+	{ .val = OPT_PROGNAME,	.name = LOND_OPTION_PROGNAME,		\
+	  .has_arg = required_argument },				\
+	{ .val = 'c',	.name = "concurrency",				\
+	  .has_arg = required_argument },				\
+	{ .val = 'f',	.name = "file-list",				\
+	  .has_arg = required_argument },				\
+	{ .val = 'h',	.name = "help",					\
+	  .has_arg = no_argument },					\
+	{ .val = 'n',	.name = "name",					\
+	  .has_arg = required_argument },				\
+	{ .val = 's',	.name = "min-size",				\
+	  .has_arg = required_argument },				\
+	{ .val = 'S',	.name = "max-size",				\
+	  .has_arg = required_argument },				\
+	{ .val = 't',	.name = "threads",				\
+	  .has_arg = required_argument },				\
 	{ .name = NULL }						\
 }
 
@@ -71,6 +99,26 @@ enum {
 	  .has_arg = required_argument },				\
 	{ .val = 'c',	.name = "copy",					\
 	  .has_arg = no_argument },					\
+	{ .val = 'C',	.name = "chunk-size",				\
+	  .has_arg = required_argument },				\
+	{ .val = 'D',	.name = "direct",				\
+	  .has_arg = no_argument },					\
+	{ .val = 'h',	.name = "help",					\
+	  .has_arg = no_argument },					\
+	{ .val = 'H',	.name = "hugepage",				\
+	  .has_arg = no_argument },					\
+	{ .val = 't',	.name = "threads",				\
+	  .has_arg = required_argument },				\
+	{ .name = NULL }						\
+}
+
+#define LOND_HSM_REQUEST_OPTIONS {					\
+	{ .val = OPT_PROGNAME,	.name = LOND_OPTION_PROGNAME,		\
+	  .has_arg = required_argument },				\
+	{ .val = 'a',	.name = "archive",				\
+	  .has_arg = required_argument },				\
+	{ .val = 'd',	.name = "data",					\
+	  .has_arg = required_argument },				\
 	{ .val = 'h',	.name = "help",					\
 	  .has_arg = no_argument },					\
 	{ .name = NULL }						\
@@ -84,6 +132,13 @@ enum {
 	     { .ca_type = ARG_TYPE_NONE }				\
 	  }								\
 	},								\
+	{ .co_name = "LOND_PREFETCH_OPTIONS",				\
+	  .co_options = LOND_PREFETCH_OPTIONS,				\
+	  .co_arguments = {						\
+	     { .ca_type = ARG_TYPE_FILE_PATH },				\
+	     { .ca_type = ARG_TYPE_NONE }				\
+	  }								\
+	},								\
 	{ .co_name = "LOND_STAT_OPTIONS",				\
 	  .co_options = LOND_STAT_OPTIONS,				\
 	  .co_arguments = {						\
@@ -8,6 +8,8 @@
 #define _LOND_H_
 
 #include <linux/limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <uthash.h>
 #include <linux/types.h>
 #ifdef NEW_USER_HEADER
@@ -15,6 +17,9 @@
 #else
 #include <lustre/lustre_user.h>
 #endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 #include "list.h"
 
 #define XATTR_NAME_LOND_GLOBAL	"trusted.lond_global"
@@ -22,6 +27,19 @@
 #define LOND_KEY_LENGH 10
 #define LOND_KEY_ANY "any"
 
+/*
+ * Data of the HSM requests sent by bulk tools. The copytool processes
+ * these actions with low priority so interactive restores go first.
+ */
+#define LOND_HSM_DATA_BULK "lond_bulk"
+
+/*
+ * Directory under the root of global Lustre to save the data archived by
+ * the copytool when the global original is locked. The files are named by
+ * the local FIDs.
+ */
+#define LOND_ARCHIVE_DIR ".lond_archive"
+
 #define LOND_KEY_BITS 128
 /* Key will be saved as char array */
 #define LOND_KEY_ARRAY_LENGH (LOND_KEY_BITS / 8)
@@ -73,12 +91,6 @@ struct lond_xattr {
 	char lx_invalid_reason[4096];
 };
 
-struct nftw_private_unlock {
-	/* The key to used to unlock the global Lustre */
-	struct lond_key	*npu_key;
-	bool		 npu_any_key;
-};
-
 /*
  * Use ST_DEV and ST_INO as the key, FILENAME as the value.
  * These are used to associate the destination name with the source
@@ -98,6 +110,11 @@ struct dest_entry {
 	 * Destination file name corresponding to the dev/ino of a copied file
 	 */
 	char	*de_fpath;
+	/*
+	 * LOND_DEST_CREATING until the inode of @de_fpath has been created,
+	 * then 0 or the negative error number of the creation.
+	 */
+	int	 de_status;
 	/*
 	 * Makes this structure hashable. Donot change this function name from
 	 * @hh to something else since HASH_xxx macros reply on this name.
@@ -105,55 +122,254 @@ struct dest_entry {
 	UT_hash_handle hh;
 };
 
-struct nftw_private_fetch {
-	/* The key to used to lock the global Lustre */
-	struct lond_key *npf_key;
-	/* The HSM archive ID */
-	__u32 npf_archive_id;
-	/* The dest directory to copy to */
-	char npf_dest[PATH_MAX + 1];
+/* The inode of the dest_entry is still being created */
+#define LOND_DEST_CREATING	1
+
+/* Default number of threads to walk a directory tree */
+#define LOND_WALK_THREADS_DEFAULT	16
+
+struct lond_walk_entry {
+	/* The directory fd that lwe_name is relative to */
+	int			 lwe_dirfd;
+	/* Name of the inode relative to lwe_dirfd */
+	const char		*lwe_name;
+	/* Path of the inode, the same as the fpath argument of nftw() */
+	const char		*lwe_path;
+	/* Level of the inode, the root of the walk is level 0 */
+	int			 lwe_level;
+	/* Stat of the inode, symbol link is not followed */
+	struct stat		 lwe_stat;
+	/* The private data set by the callback of the parent directory */
+	void			*lwe_parent_private;
+	/* Private data that the callback can attach to a directory */
+	void			*lwe_private;
+};
+
+struct lond_walk;
+
+/* Context of a walking thread */
+struct lond_walk_thread {
+	struct lond_walk	*lwt_walk;
+	/* Index of the thread */
+	int			 lwt_index;
+	/* Private data of the thread, set by lw_thread_init */
+	void			*lwt_private;
+	pthread_t		 lwt_thread;
+	/* Deque of the directories to scan */
+	struct lond_list_head	 lwt_deque;
+	pthread_mutex_t		 lwt_deque_mutex;
+	/* Buffer to read directory entries */
+	char			*lwt_dirent_buf;
+};
+
+/*
+ * The callback to visit an inode. Return 0 to continue, negative value
+ * to abort the walk unless lw_ignore_error is set.
+ */
+typedef int (*lond_walk_fn)(struct lond_walk_thread *thread,
+			    struct lond_walk_entry *entry);
+
+struct lond_walk {
+	/* Number of walking threads */
+	int			  lw_thread_number;
+	/* Whether to ignore error during the walk */
+	bool			  lw_ignore_error;
+	/* Private data shared by all threads */
+	void			 *lw_private;
+	lond_walk_fn		  lw_visit;
+	/* Optional, init and cleanup the private data of each thread */
+	int			(*lw_thread_init)(struct lond_walk_thread *lwt);
+	void			(*lw_thread_fini)(struct lond_walk_thread *lwt);
+	/* Optional, free the lwe_private attached to a directory */
+	void			(*lw_dir_private_free)(void *private);
+	/* The first error during the walk */
+	int			  lw_errno;
+	/* Internal states of the walk */
+	struct lond_walk_thread	 *lw_threads;
+	pthread_mutex_t		  lw_mutex;
+	pthread_cond_t		  lw_cond;
+	/* Number of directories in the deques */
+	int			  lw_queued;
+	/* Number of directories in the deques or being scanned */
+	int			  lw_pending;
+	/* Number of threads waiting for directories */
+	int			  lw_idle;
+	/* Set with lw_mutex held, but also read without it */
+	bool			  lw_aborted;
+	/* Number of fds opened for the directories in the deques */
+	int			  lw_open_fds;
+	int			  lw_max_open_fds;
+};
+
+/* Ways to copy data between files, from the fastest to the slowest */
+enum lond_copy_method {
+	/* copy_file_range(), no data is copied to user space */
+	LOND_COPY_FILE_RANGE = 0,
+	/* splice() through a pipe, no data is copied to user space */
+	LOND_COPY_SPLICE,
+	/* pread() and pwrite() through a user space buffer */
+	LOND_COPY_READ_WRITE,
+};
+
+/* Alignment of the offset, size and buffer of O_DIRECT */
+#define LOND_DIRECT_IO_ALIGN	4096
+
+/* Pool of aligned copy buffers shared by threads */
+struct lond_buf_pool {
+	pthread_mutex_t		 lbp_mutex;
+	/* Usable size of each buffer */
+	size_t			 lbp_buf_size;
+	/* Mapped size of each buffer, rounded up to the page size */
+	size_t			 lbp_map_size;
+	int			 lbp_max_bufs;
+	/* Whether to back the buffers with huge pages */
+	bool			 lbp_hugepage;
+	/* Number of buffers that have been mapped */
+	int			 lbp_allocated;
+	/* The mapped buffers, and the NUMA nodes they are on */
+	char			**lbp_bufs;
+	int			*lbp_nodes;
+	/* Indexes of the free buffers in lbp_bufs */
+	int			*lbp_free;
+	int			 lbp_free_count;
+};
+
+/*
+ * Copy engine that falls back to the slower methods when the faster ones
+ * are not supported by the kernel or the file systems. Not thread-safe,
+ * each thread should use its own engine.
+ */
+struct lond_copy_engine {
+	enum lond_copy_method	 lce_method;
+	/* Whether lce_method has copied any data successfully */
+	bool			 lce_method_verified;
+	/* Pipe used by splice, -1 if not created yet */
+	int			 lce_pipe[2];
+	/* Buffer of read/write, allocated when first needed */
+	char			*lce_buf;
+	size_t			 lce_buf_size;
+	/* Whether lce_buf is allocated by the engine */
+	bool			 lce_buf_allocated;
+	/* Pool to borrow lce_buf from, NULL to allocate it */
+	struct lond_buf_pool	*lce_pool;
+	/* Whether lce_buf is borrowed from lce_pool */
+	bool			 lce_buf_borrowed;
+	/*
+	 * Whether to drop the copied data from the page cache, so the
+	 * copy doesn't evict the working set of the applications.
+	 */
+	bool			 lce_nocache;
 	/*
-	 * The source directory under the dest directory. This is genrated
-	 * after copying started with source directory locked. So there is no
-	 * need to init it before calling nftw.
+	 * Whether to copy the aligned chunks with O_DIRECT. The engine sets
+	 * O_DIRECT on the fds, so only set this if the fds are not shared
+	 * with other engines.
 	 */
-	char npf_dest_source_dir[PATH_MAX + 2];
-	/* Hash table to check whether the inode is already created before */
-	struct dest_entry *npf_dest_entry_table;
+	bool			 lce_direct;
+	/* Whether O_DIRECT has copied any data successfully */
+	bool			 lce_direct_verified;
+	/* The source and dest fds that O_DIRECT is set on, -1 if none */
+	int			 lce_direct_fds[2];
+	/* Range copied but not dropped from the page cache yet */
+	int			 lce_drop_src_fd;
+	int			 lce_drop_dst_fd;
+	off_t			 lce_drop_start;
+	off_t			 lce_drop_end;
+	/*
+	 * Whether to skip the holes of the source. Only set this if the
+	 * dest doesn't have any data in the range to copy, and extend the
+	 * size of the dest after copying in case the source ends with hole.
+	 */
+	bool			 lce_sparse;
+	/* Cached data extent of the source, lce_extent_fd is -1 if none */
+	int			 lce_extent_fd;
+	/* Offset where the data extent is looked up from */
+	off_t			 lce_extent_from;
+	off_t			 lce_data_start;
+	off_t			 lce_data_end;
+	/* Whether the last chunk was a hole that was skipped */
+	bool			 lce_hole_skipped;
 };
 
-struct nftw_private_sync {
-	/* The dest directory to copy to */
-	char	 nps_dest[PATH_MAX + 1];
+/* Max time of tokens that can be consumed in a burst, 100ms */
+#define LOND_TOKEN_BUCKET_BURST_NS	100000000ULL
+
+/* Lock-free token bucket shared by multiple threads */
+struct lond_token_bucket {
+	/* Bytes per second, 0 means unlimited */
+	__u64			 ltb_rate;
+	/* Time in nanoseconds when the bucket will be full again */
+	__u64			 ltb_refill_time;
+	/* Increased when the rate is changed, so the sleepers recheck */
+	__u64			 ltb_generation;
+};
+
+/* Linear buckets in each power of two of the histograms */
+#define LOND_HISTOGRAM_SUB_BITS		3
+/* Values not smaller than 2^LOND_HISTOGRAM_MAX_BITS fall in the last bucket */
+#define LOND_HISTOGRAM_MAX_BITS		40
+#define LOND_HISTOGRAM_BUCKETS		\
+	((LOND_HISTOGRAM_MAX_BITS - 2) << LOND_HISTOGRAM_SUB_BITS)
+
+/* Log-linear histogram, recorded without lock */
+struct lond_histogram {
+	__u64			 lh_buckets[LOND_HISTOGRAM_BUCKETS];
+	/* Number and sum of the recorded values */
+	__u64			 lh_count;
+	__u64			 lh_sum;
+};
+
+#ifdef HAVE_LIBURING
+struct lond_uring_slot;
+
+/* Ring to copy data with multiple chunks in flight */
+struct lond_uring {
+	struct io_uring		 lu_ring;
+	/* Max number of chunks in flight */
+	int			 lu_depth;
+	/* Size of each chunk */
+	size_t			 lu_buf_size;
+	/* Fixed buffers registered to the ring, one for each slot */
+	char			*lu_bufs;
+	struct lond_uring_slot	*lu_slots;
 	/*
-	 * The source directory under the dest directory. This is genrated
-	 * after copying started with source directory locked. So there is no
-	 * need to init it before calling nftw.
+	 * A copy failed with requests still in the ring, the ring can not be
+	 * reused because their completions would be reaped by the next copy
 	 */
-	char	 nps_dest_source_dir[PATH_MAX + 2];
-	/* Hash table to check whether the inode is already created before */
-	struct	 dest_entry *nps_dest_entry_table;
-	/* Mount point of dest */
-	char	 nps_dest_mnt[PATH_MAX + 1];
-	/* Mount point of source */
-	char	 nps_source_mnt[PATH_MAX + 1];
-	char	*nps_copy_buf;
-	int	 nps_copy_buf_size;
+	bool			 lu_broken;
 };
 
-struct nftw_private {
-	/* Whether to ignore error during the iteration */
-	bool	np_ignore_error;
-	/* Error number during the iteration */
-	bool	np_errno;
-	union {
-		/* Used by unlock */
-		struct nftw_private_unlock	np_unlock;
-		/* Used by fetch */
-		struct nftw_private_fetch	np_fetch;
-		/* Used by sync */
-		struct nftw_private_sync	np_sync;
-	} u;
+/* Called with the bytes copied so far, return negative value to abort */
+typedef int (*lond_uring_progress_fn)(void *private, __u64 copied);
+#endif /* HAVE_LIBURING */
+
+/* Max number of items in one HSM request */
+#define LOND_HSM_BATCH_ITEMS_DEFAULT	1000
+/* Seconds that an item can wait before the request is sent */
+#define LOND_HSM_BATCH_INTERVAL_DEFAULT	5
+
+/* HSM requests of many files, thread-safe */
+struct lond_hsm_batch {
+	/* Path on the Lustre file system to send the requests to */
+	char			 lhb_path[PATH_MAX + 1];
+	enum hsm_user_action	 lhb_action;
+	int			 lhb_archive_id;
+	/* Data attached to each request, NULL if none */
+	char			*lhb_data;
+	int			 lhb_data_len;
+	int			 lhb_max_items;
+	int			 lhb_flush_interval;
+	pthread_mutex_t		 lhb_mutex;
+	/* Request with the accumulated items */
+	struct hsm_user_request	*lhb_hur;
+	/* Request to replace lhb_hur while it is being sent, NULL if none */
+	struct hsm_user_request	*lhb_spare;
+	int			 lhb_count;
+	/* When the first accumulated item is added */
+	time_t			 lhb_first_time;
+	/* Number of items that are sent successfully */
+	__u64			 lhb_submitted;
+	/* Number of items that failed to be sent */
+	__u64			 lhb_failed;
 };
 
 typedef int (*lond_copy_reg_file_fn)(char const *src_name,
@@ -163,14 +379,18 @@ typedef int (*lond_copy_reg_file_fn)(char const *src_name,
 				     struct stat const *src_sb,
 				     void *private);
 
+int lond_inode_lock_fd(int fd, const char *fpath, struct lond_key *key,
+		       bool is_root);
 int lond_inode_lock(const char *fpath, struct lond_key *key, bool is_root);
 int lond_inode_unlock(const char *fpath, bool any_key, struct lond_key *key,
 		      bool ignore_used_by_other);
-int lond_inode_stat(const char *fpath, struct lond_list_head *stack_list,
-		    mode_t mode);
+int lond_inode_unlock_fd(int fd, const char *fpath, bool any_key,
+			 struct lond_key *key, bool ignore_used_by_other);
+int lond_inode_stat(const char *fpath, mode_t mode);
 int lond_tree_unlock(const char *fpath, bool any_key, struct lond_key *key,
-		     bool ignore_error);
-int lond_tree_stat(const char *fpath, bool ignore_error);
+		     bool ignore_error, int thread_number);
+int lond_tree_stat(const char *fpath, bool ignore_error, int thread_number);
+int lond_walk_tree(const char *root, struct lond_walk *walk);
 void lond_key_generate(struct lond_key *key);
 bool lond_key_equal(struct lond_key *key1, struct lond_key *key2);
 int lond_key_get_string(struct lond_key *key, char *buffer,
@@ -179,15 +399,61 @@ int get_full_fpath(const char *fpath, char *full_fpath, size_t buf_size);
 int lustre_directory2fsname(const char *fpath, char *fsname);
 int check_lustre_root(const char *fsname, const char *fpath);
 int lond_read_global_xattr(const char *fpath, struct lond_xattr *lond_xattr);
+int lond_fread_global_xattr(int fd, struct lond_xattr *lond_xattr);
 int lond_read_local_xattr(const char *fpath, struct lond_xattr *lond_xattr);
 int lond_copy_inode(struct dest_entry **head, const char *src_name,
-		    const char *dst_name, lond_copy_reg_file_fn reg_fn,
-		    void *private);
+		    struct stat const *src_sb, const char *dst_name,
+		    lond_copy_reg_file_fn reg_fn, void *private);
 void free_dest_table(struct dest_entry **head);
 void remove_slash_tail(char *path);
+int lond_inode_flags_open(const char *fpath);
+int lond_inode_flags_openat(int dirfd, const char *name, const char *fpath);
+int lond_fd_is_immutable(int fd, const char *fpath, bool *immutable);
+int lond_fd_set_immutable(int fd, const char *fpath, bool immutable);
 int check_inode_is_immutable(const char *fpath, bool *immutable);
+int lond_inode_set_immutable(const char *fpath, bool immutable);
 int lustre_fid_path(char *buf, int sz, const char *mnt,
 		    const struct lu_fid *fid);
-
-extern struct nftw_private nftw_private;
+int lond_archive_path(char *buf, int sz, const char *mnt,
+		      const struct lu_fid *fid);
+void lond_copy_engine_init(struct lond_copy_engine *engine, char *buf,
+			   size_t buf_size);
+void lond_copy_engine_fini(struct lond_copy_engine *engine);
+ssize_t lond_copy_chunk(struct lond_copy_engine *engine, int src_fd,
+			int dst_fd, off_t offset, size_t length);
+const char *lond_copy_method_name(enum lond_copy_method method);
+int lond_copy_data_extent(int fd, off_t offset, off_t *data_start,
+			  off_t *data_end);
+int lond_copy_drop_cache(int src_fd, int dst_fd, off_t offset, off_t length);
+int lond_buf_pool_init(struct lond_buf_pool *pool, size_t buf_size,
+		       int max_bufs, bool hugepage);
+char *lond_buf_pool_get(struct lond_buf_pool *pool);
+void lond_buf_pool_put(struct lond_buf_pool *pool, char *buf);
+void lond_buf_pool_fini(struct lond_buf_pool *pool);
+void lond_token_bucket_init(struct lond_token_bucket *bucket, __u64 rate);
+void lond_token_bucket_set_rate(struct lond_token_bucket *bucket, __u64 rate);
+__u64 lond_token_bucket_get_rate(struct lond_token_bucket *bucket);
+__u64 lond_token_bucket_consume(struct lond_token_bucket *bucket,
+				__u64 bytes);
+int lond_token_bucket_throttle(struct lond_token_bucket *bucket, __u64 bytes);
+void lond_histogram_record(struct lond_histogram *histogram, __u64 value);
+void lond_histogram_merge(struct lond_histogram *dst,
+			  struct lond_histogram *src);
+__u64 lond_histogram_percentile(const struct lond_histogram *histogram,
+				double percentile);
+int lond_hsm_batch_init(struct lond_hsm_batch *batch, const char *path,
+			enum hsm_user_action action, int archive_id,
+			const char *data, int max_items, int flush_interval);
+int lond_hsm_batch_add(struct lond_hsm_batch *batch, const struct lu_fid *fid);
+int lond_hsm_batch_poll(struct lond_hsm_batch *batch);
+int lond_hsm_batch_flush(struct lond_hsm_batch *batch);
+int lond_hsm_batch_fini(struct lond_hsm_batch *batch);
+#ifdef HAVE_LIBURING
+int lond_uring_init(struct lond_uring *uring, int depth, size_t buf_size);
+void lond_uring_fini(struct lond_uring *uring);
+int lond_uring_copy(struct lond_uring *uring, int src_fd, int dst_fd,
+		    off_t offset, size_t length,
+		    lond_uring_progress_fn progress_fn, void *private,
+		    __u64 *copied);
+#endif /* HAVE_LIBURING */
 #endif /* _LOND_H_ */
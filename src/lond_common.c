@@ -14,49 +14,125 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <attr/xattr.h>
-#include <ftw.h>
+#include <pthread.h>
 #include <string.h>
 #include <inttypes.h>
 #include <linux/limits.h>
 #include <lustre/lustreapi.h>
 #include "definition.h"
 #include "debug.h"
-#include "cmd.h"
 #include "lond.h"
 #include "list.h"
 
-struct nftw_private nftw_private;
+/*
+ * Open an inode to get or set its inode flags. Use the same flags with
+ * lsattr/chattr, so symbol links are never followed and FIFOs never block.
+ * @name is relative to @dirfd, @fpath is only used for printing.
+ * Return the fd, or negative value on failure.
+ */
+int lond_inode_flags_openat(int dirfd, const char *name, const char *fpath)
+{
+	int fd;
+	int rc;
 
-int check_inode_is_immutable(const char *fpath, bool *immutable)
+	fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW |
+		    O_LARGEFILE | O_CLOEXEC);
+	if (fd < 0) {
+		rc = -errno;
+		LERROR("failed to open [%s] to access inode flags: %s\n",
+		       fpath, strerror(-rc));
+		return rc;
+	}
+	return fd;
+}
+
+int lond_inode_flags_open(const char *fpath)
 {
-	int i;
+	return lond_inode_flags_openat(AT_FDCWD, fpath, fpath);
+}
+
+/* Check whether the immutable flag is set on an opened inode */
+int lond_fd_is_immutable(int fd, const char *fpath, bool *immutable)
+{
+	int flags;
 	int rc;
-	char cmd[PATH_MAX + 1];
-	int cmdsz = sizeof(cmd);
-	char output[PATH_MAX + 1];
-	int output_sz = sizeof(output);
 
-	snprintf(cmd, cmdsz, "lsattr -d '%s'", fpath);
-	rc = command_read(cmd, output, output_sz - 1);
-	if (rc) {
-		LERROR("failed to run command [%s], rc = %d\n",
-		       cmd, rc);
+	if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0) {
+		rc = -errno;
+		LERROR("failed to get inode flags of [%s]: %s\n",
+		       fpath, strerror(-rc));
 		return rc;
 	}
 
-	*immutable = false;
-	for (i = 0; i < strlen(output); i++) {
-		if (output[i] == ' ')
-			break;
-		if (output[i] == 'i') {
-			*immutable = true;
-			break;
-		}
+	*immutable = !!(flags & FS_IMMUTABLE_FL);
+	return 0;
+}
+
+/*
+ * Set or clear the immutable flag of an opened inode, the same as
+ * chattr +i/-i. Nothing is changed if the flag is already as expected.
+ */
+int lond_fd_set_immutable(int fd, const char *fpath, bool immutable)
+{
+	int flags;
+	int new_flags;
+	int rc;
+
+	if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0) {
+		rc = -errno;
+		LERROR("failed to get inode flags of [%s]: %s\n",
+		       fpath, strerror(-rc));
+		return rc;
+	}
+
+	if (immutable)
+		new_flags = flags | FS_IMMUTABLE_FL;
+	else
+		new_flags = flags & ~FS_IMMUTABLE_FL;
+	if (new_flags == flags)
+		return 0;
+
+	if (ioctl(fd, FS_IOC_SETFLAGS, &new_flags) < 0) {
+		rc = -errno;
+		LERROR("failed to %s immutable flag of [%s]: %s\n",
+		       immutable ? "set" : "clear", fpath, strerror(-rc));
+		return rc;
 	}
 	return 0;
 }
 
+int check_inode_is_immutable(const char *fpath, bool *immutable)
+{
+	int fd;
+	int rc;
+
+	fd = lond_inode_flags_open(fpath);
+	if (fd < 0)
+		return fd;
+
+	rc = lond_fd_is_immutable(fd, fpath, immutable);
+	close(fd);
+	return rc;
+}
+
+int lond_inode_set_immutable(const char *fpath, bool immutable)
+{
+	int fd;
+	int rc;
+
+	fd = lond_inode_flags_open(fpath);
+	if (fd < 0)
+		return fd;
+
+	rc = lond_fd_set_immutable(fd, fpath, immutable);
+	close(fd);
+	return rc;
+}
+
 static void parse_global_xattr(struct lond_xattr *lond_xattr)
 {
 	int rc;
@@ -91,14 +167,12 @@ static void parse_global_xattr(struct lond_xattr *lond_xattr)
 	lond_xattr->lx_is_valid = true;
 }
 
-/* Return negative value if failed to read */
-int lond_read_global_xattr(const char *fpath, struct lond_xattr *lond_xattr)
+/* Check the result of reading global xattr, negative value if failed */
+static int global_xattr_read_result(struct lond_xattr *lond_xattr,
+				    ssize_t rc)
 {
-	int rc;
 	struct lond_global_xattr *disk = &lond_xattr->u.lx_global;
 
-	memset(lond_xattr, 0, sizeof(*lond_xattr));
-	rc = getxattr(fpath, XATTR_NAME_LOND_GLOBAL, disk, sizeof(*disk));
 	if (rc == sizeof(*disk)) {
 		parse_global_xattr(lond_xattr);
 		return 0;
@@ -124,6 +198,28 @@ int lond_read_global_xattr(const char *fpath, struct lond_xattr *lond_xattr)
 	return 0;
 }
 
+/* Return negative value if failed to read */
+int lond_read_global_xattr(const char *fpath, struct lond_xattr *lond_xattr)
+{
+	ssize_t rc;
+	struct lond_global_xattr *disk = &lond_xattr->u.lx_global;
+
+	memset(lond_xattr, 0, sizeof(*lond_xattr));
+	rc = getxattr(fpath, XATTR_NAME_LOND_GLOBAL, disk, sizeof(*disk));
+	return global_xattr_read_result(lond_xattr, rc);
+}
+
+/* Same as lond_read_global_xattr(), but read from an opened inode */
+int lond_fread_global_xattr(int fd, struct lond_xattr *lond_xattr)
+{
+	ssize_t rc;
+	struct lond_global_xattr *disk = &lond_xattr->u.lx_global;
+
+	memset(lond_xattr, 0, sizeof(*lond_xattr));
+	rc = fgetxattr(fd, XATTR_NAME_LOND_GLOBAL, disk, sizeof(*disk));
+	return global_xattr_read_result(lond_xattr, rc);
+}
+
 static void parse_local_xattr(struct lond_xattr *lond_xattr)
 {
 	int rc;
@@ -194,23 +290,17 @@ int lond_read_local_xattr(const char *fpath, struct lond_xattr *lond_xattr)
  * Print the EPERM reason of an inode,
  * If the inode is locked by myself, return 0. Otherwise, negative value.
  */
-static int lond_lock_eperm_reason(const char *fpath, const char *key_str)
+static int lond_lock_eperm_reason(int fd, const char *full_fpath,
+				  const char *key_str)
 {
 	int rc;
 	bool immutable = false;
 	struct lond_xattr lond_xattr;
-	char full_fpath[PATH_MAX + 1];
-
-	rc = get_full_fpath(fpath, full_fpath, PATH_MAX + 1);
-	if (rc) {
-		LERROR("failed to get full path of [%s]\n", fpath);
-		return rc;
-	}
 
-	rc = check_inode_is_immutable(fpath, &immutable);
+	rc = lond_fd_is_immutable(fd, full_fpath, &immutable);
 	if (rc) {
 		LERROR("failed to check whether file [%s] is immutable\n",
-		       fpath);
+		       full_fpath);
 		return rc;
 	}
 
@@ -219,10 +309,10 @@ static int lond_lock_eperm_reason(const char *fpath, const char *key_str)
 		return -EPERM;
 	}
 
-	rc = lond_read_global_xattr(fpath, &lond_xattr);
+	rc = lond_fread_global_xattr(fd, &lond_xattr);
 	if (rc) {
 		LERROR("failed to get lond key of immutable inode [%s]: %s\n",
-		       full_fpath, strerror(errno));
+		       full_fpath, strerror(-rc));
 		return rc;
 	}
 
@@ -245,16 +335,18 @@ static int lond_lock_eperm_reason(const char *fpath, const char *key_str)
  * Steps to lock an inode:
  *
  * 1) Set the xattr;
- * 2) chattr +i;
+ * 2) Set the immutable flag;
  * 3) If 2) fails because the flag already exists, ignore the failure.
  * 4) Check whether the xattr has expected value, if not, return failure
+ *
+ * All of the steps are done on the opened @fd, so that the path is only
+ * resolved once when opening it.
  */
-int lond_inode_lock(const char *fpath, struct lond_key *key, bool is_root)
+int lond_inode_lock_fd(int fd, const char *fpath, struct lond_key *key,
+		       bool is_root)
 {
 	int rc;
 	int rc2;
-	char cmd[PATH_MAX + 1];
-	int cmdsz = sizeof(cmd);
 	struct lond_xattr set_xattr;
 	struct lond_xattr get_xattr;
 	char full_fpath[PATH_MAX + 1];
@@ -278,12 +370,11 @@ int lond_inode_lock(const char *fpath, struct lond_key *key, bool is_root)
 	disk->lgx_magic = LOND_MAGIC;
 	disk->lgx_version = LOND_VERSION;
 
-	rc = lsetxattr(fpath, XATTR_NAME_LOND_GLOBAL, disk, sizeof(*disk),
-		       0);
+	rc = fsetxattr(fd, XATTR_NAME_LOND_GLOBAL, disk, sizeof(*disk), 0);
 	if (rc) {
 		rc2 = -errno;
 		if (errno == EPERM) {
-			rc = lond_lock_eperm_reason(fpath, key_str);
+			rc = lond_lock_eperm_reason(fd, full_fpath, key_str);
 			if (rc == 0)
 				return 0;
 		} else {
@@ -293,18 +384,17 @@ int lond_inode_lock(const char *fpath, struct lond_key *key, bool is_root)
 		return rc2;
 	}
 
-	snprintf(cmd, cmdsz, "chattr +i '%s'", fpath);
-	rc = command_run(cmd, cmdsz);
+	rc = lond_fd_set_immutable(fd, full_fpath, true);
 	if (rc) {
 		LERROR("failed to set immutable flag of [%s], rc = %d\n",
 		       full_fpath, rc);
 		return rc;
 	}
 
-	rc = lond_read_global_xattr(fpath, &get_xattr);
+	rc = lond_fread_global_xattr(fd, &get_xattr);
 	if (rc) {
 		LERROR("failed to get lond key of immutable inode [%s]: %s\n",
-		       full_fpath, strerror(errno));
+		       full_fpath, strerror(-rc));
 		return rc;
 	}
 
@@ -327,20 +417,32 @@ int lond_inode_lock(const char *fpath, struct lond_key *key, bool is_root)
 	return 0;
 }
 
+int lond_inode_lock(const char *fpath, struct lond_key *key, bool is_root)
+{
+	int fd;
+	int rc;
+
+	fd = lond_inode_flags_open(fpath);
+	if (fd < 0)
+		return fd;
+
+	rc = lond_inode_lock_fd(fd, fpath, key, is_root);
+	close(fd);
+	return rc;
+}
+
 /*
  * Steps to unlock an inode:
  *
  * 1) If immutable flag is not set, the inode should not be locked or already
  *    been unlocked.
  * 2) Read the xattr.
- * 3) If the xattr matches the key, chattr -i
+ * 3) If the xattr matches the key, clear the immutable flag
  */
-int lond_inode_unlock(const char *fpath, bool any_key, struct lond_key *key,
-		      bool ignore_used_by_other)
+int lond_inode_unlock_fd(int fd, const char *fpath, bool any_key,
+			 struct lond_key *key, bool ignore_used_by_other)
 {
 	int rc;
-	char cmd[PATH_MAX + 1];
-	int cmdsz = sizeof(cmd);
 	bool immutable = false;
 	struct lond_xattr global_xattr;
 	char full_fpath[PATH_MAX + 1];
@@ -363,7 +465,7 @@ int lond_inode_unlock(const char *fpath, bool any_key, struct lond_key *key,
 	}
 	LDEBUG("unlocking inode [%s] with key [%s]\n", full_fpath, key_str);
 
-	rc = check_inode_is_immutable(fpath, &immutable);
+	rc = lond_fd_is_immutable(fd, full_fpath, &immutable);
 	if (rc) {
 		LERROR("failed to check whether file [%s] is immutable\n",
 		       full_fpath);
@@ -377,10 +479,10 @@ int lond_inode_unlock(const char *fpath, bool any_key, struct lond_key *key,
 	}
 
 	if (!any_key) {
-		rc = lond_read_global_xattr(fpath, &global_xattr);
+		rc = lond_fread_global_xattr(fd, &global_xattr);
 		if (rc) {
 			LERROR("failed to get lond key of immutable inode [%s]: %s\n",
-			       full_fpath, strerror(errno));
+			       full_fpath, strerror(-rc));
 			return rc;
 		}
 
@@ -408,8 +510,7 @@ int lond_inode_unlock(const char *fpath, bool any_key, struct lond_key *key,
 		}
 	}
 
-	snprintf(cmd, cmdsz, "chattr -i '%s'", fpath);
-	rc = command_run(cmd, cmdsz);
+	rc = lond_fd_set_immutable(fd, full_fpath, false);
 	if (rc) {
 		LERROR("failed to clear immutable flag of [%s], rc = %d\n",
 		       full_fpath, rc);
@@ -419,41 +520,53 @@ int lond_inode_unlock(const char *fpath, bool any_key, struct lond_key *key,
 	return 0;
 }
 
-/* The function of nftw() to unlock file */
-static int nftw_unlock_fn(const char *fpath, const struct stat *sb,
-			  int tflag, struct FTW *ftwbuf)
+int lond_inode_unlock(const char *fpath, bool any_key, struct lond_key *key,
+		      bool ignore_used_by_other)
 {
+	int fd;
 	int rc;
-	struct nftw_private_unlock *unlock = &nftw_private.u.np_unlock;
-	bool any_key = unlock->npu_any_key;
-	struct lond_key *key = unlock->npu_key;
-	char full_fpath[PATH_MAX + 1];
+
+	fd = lond_inode_flags_open(fpath);
+	if (fd < 0)
+		return fd;
+
+	rc = lond_inode_unlock_fd(fd, fpath, any_key, key,
+				  ignore_used_by_other);
+	close(fd);
+	return rc;
+}
+
+struct walk_unlock_private {
+	bool			 wup_any_key;
+	struct lond_key		*wup_key;
+};
+
+/* The visit function of lond_walk_tree() to unlock file */
+static int walk_unlock_fn(struct lond_walk_thread *thread,
+			  struct lond_walk_entry *entry)
+{
+	int fd;
+	int rc;
+	struct walk_unlock_private *unlock = thread->lwt_walk->lw_private;
+	const char *fpath = entry->lwe_path;
+	mode_t mode = entry->lwe_stat.st_mode;
 
 	/* Only set regular files and directories to immutable */
-	if (!S_ISREG(sb->st_mode) && !S_ISDIR(sb->st_mode))
+	if (!S_ISREG(mode) && !S_ISDIR(mode))
 		return 0;
 
-	rc = get_full_fpath(fpath, full_fpath, PATH_MAX + 1);
-	if (rc) {
-		LERROR("failed to get full path of [%s]\n", fpath);
-		return rc;
-	}
-
-	/* Lock the inode first before copying to dest */
-	rc = lond_inode_unlock(fpath, any_key, key, true);
-	if (rc) {
-		nftw_private.np_errno = rc;
-		if (!nftw_private.np_ignore_error) {
-			LERROR("failed to unlock file [%s], aborting\n",
-			       full_fpath);
-			return rc;
-		} else {
-			LERROR("failed to unlock file [%s], continue unlocking\n",
-			       full_fpath);
-			return 0;
-		}
-	}
-	return 0;
+	fd = lond_inode_flags_openat(entry->lwe_dirfd, entry->lwe_name, fpath);
+	if (fd < 0)
+		return fd;
+
+	rc = lond_inode_unlock_fd(fd, fpath, unlock->wup_any_key,
+				  unlock->wup_key, true);
+	close(fd);
+	if (rc)
+		LERROR("failed to unlock file [%s]%s\n", fpath,
+		       thread->lwt_walk->lw_ignore_error ?
+		       ", continue unlocking" : ", aborting");
+	return rc;
 }
 
 /* Return a full path of a possibly relative path */
@@ -497,10 +610,11 @@ int get_full_fpath(const char *fpath, char *full_fpath, size_t buf_size)
 }
 
 int lond_tree_unlock(const char *fpath, bool any_key, struct lond_key *key,
-		     bool ignore_error)
+		     bool ignore_error, int thread_number)
 {
 	int rc;
-	int flags = FTW_PHYS;
+	struct lond_walk walk;
+	struct walk_unlock_private unlock;
 	char full_fpath[PATH_MAX + 1];
 	char key_str[LOND_KEY_STRING_SIZE];
 
@@ -520,31 +634,23 @@ int lond_tree_unlock(const char *fpath, bool any_key, struct lond_key *key,
 		snprintf(key_str, sizeof(key_str), LOND_KEY_ANY);
 	}
 
-	/*
-	 * There is no way to transfer the argument into nftw_unlock_fn,
-	 * thus use global variable to do that. This means, this is not
-	 * thread-safe.
-	 */
-	nftw_private.u.np_unlock.npu_any_key = any_key;
-	nftw_private.u.np_unlock.npu_key = key;
-	nftw_private.np_ignore_error = ignore_error;
-	nftw_private.np_errno = 0;
-	rc = nftw(fpath, nftw_unlock_fn, 32, flags);
+	unlock.wup_any_key = any_key;
+	unlock.wup_key = key;
+	memset(&walk, 0, sizeof(walk));
+	walk.lw_thread_number = thread_number;
+	walk.lw_ignore_error = ignore_error;
+	walk.lw_private = &unlock;
+	walk.lw_visit = walk_unlock_fn;
+	rc = lond_walk_tree(fpath, &walk);
 	if (rc) {
-		LERROR("failed to unlock directory tree [%s] with key [%s]\n",
+		LERROR("got error when unlocking directory tree [%s] with key [%s]\n",
 		       full_fpath, key_str);
 		return rc;
 	}
 
-	if (nftw_private.np_errno) {
-		LERROR("got error when unlocking directory tree [%s] with key [%s]\n",
-		       full_fpath, key_str);
-		rc = nftw_private.np_errno;
-	} else {
-		LINFO("unlocked directory tree [%s] with key [%s]\n",
-		      full_fpath, key_str);
-	}
-	return rc;
+	LINFO("unlocked directory tree [%s] with key [%s]\n",
+	      full_fpath, key_str);
+	return 0;
 }
 
 void lond_key_generate(struct lond_key *key)
@@ -588,69 +694,21 @@ int lond_key_get_string(struct lond_key *key, char *buffer, size_t buffer_size)
 	return 0;
 }
 
-LOND_LIST_HEAD(nftw_stat_stack);
-
+/* Lock status of a directory, passed to the visit of its children */
 struct lond_stat_entry {
-	/* Linked into stack */
-	struct lond_list_head			lse_linkage;
-	/* The inode full path */
-	char					lse_path[PATH_MAX + 1];
 	/* Whether this inode is immutable */
 	bool					lse_immutable;
 	/* Global xattr of this entry */
 	struct lond_xattr			lse_global_xattr;
 };
 
-static void stat_stack_push(struct lond_list_head *stack_list,
-			    struct lond_stat_entry *entry)
-{
-	lond_list_add(&entry->lse_linkage, stack_list);
-}
-
-static struct lond_stat_entry *stat_stack_pop(struct lond_list_head *stack_list)
-{
-	struct lond_stat_entry *top;
-
-	if (lond_list_empty(stack_list)) {
-		LERROR("stack is empty\n");
-		return NULL;
-	}
-	top = lond_list_entry(stack_list->next, struct lond_stat_entry,
-			      lse_linkage);
-	lond_list_del(&top->lse_linkage);
-	return top;
-}
-
-static struct lond_stat_entry *stat_stack_top(struct lond_list_head *stack_list)
-{
-	struct lond_stat_entry *top;
-
-	if (lond_list_empty(stack_list))
-		return NULL;
-
-	top = lond_list_entry(stack_list->next, struct lond_stat_entry,
-			      lse_linkage);
-	return top;
-}
-
-static void stat_stack_free(struct lond_list_head *stack_list)
-{
-	struct lond_stat_entry *entry, *n;
-
-	lond_list_for_each_entry_safe(entry, n, stack_list,
-				      lse_linkage) {
-		lond_list_del_init(&entry->lse_linkage);
-		free(entry);
-	}
-}
-
 static void print_inode_stat(const char *full_fpath, mode_t mode,
 			     bool immutable,
 			     struct lond_xattr *global_xattr,
 			     struct lond_stat_entry *parent)
 {
 	const char *type;
-	struct lond_xattr *parent_xattr = &parent->lse_global_xattr;
+	struct lond_xattr *parent_xattr;
 
 	if (S_ISDIR(mode))
 		type = "directory";
@@ -659,6 +717,7 @@ static void print_inode_stat(const char *full_fpath, mode_t mode,
 
 	if (!immutable) {
 		if (parent && parent->lse_immutable) {
+			parent_xattr = &parent->lse_global_xattr;
 			if (!parent_xattr->lx_is_valid)
 				LERROR("%s [%s] is not locked by lond, but its parent is locked with invalid key (%s)\n",
 				       type, full_fpath,
@@ -691,100 +750,35 @@ static void print_inode_stat(const char *full_fpath, mode_t mode,
 	}
 }
 
-/* Update the stat stack during the scanning process */
-static int stat_stack_update(struct lond_list_head *stack_list,
-			     const char *fpath, const char *full_fpath,
-			     mode_t mode, bool immutable,
-			     struct lond_xattr *lond_xattr)
+/* Whether the lock status of an inode differs from its parent's */
+static bool stat_entry_differ(struct lond_stat_entry *entry,
+			      struct lond_stat_entry *parent)
 {
-	struct lond_stat_entry *entry;
-	struct lond_stat_entry *top;
-	struct lond_stat_entry *parent = NULL;
-	struct lond_xattr *parent_xattr;
-	struct lond_key *parent_key;
-	struct lond_key *key;
-	char parent_path[PATH_MAX + 2];
-	bool need_print;
-
-	top = stat_stack_top(stack_list);
-	/* This is the root directory to scan, just print its status */
-	if (top == NULL)
-		print_inode_stat(full_fpath, mode, immutable, lond_xattr,
-				 NULL);
-
-	entry = calloc(sizeof(*entry), 1);
-	if (entry == NULL) {
-		LERROR("failed to allocate memory\n");
-		return -ENOMEM;
-	}
-
-	strncpy(entry->lse_path, fpath, sizeof(entry->lse_path) - 1);
-	entry->lse_path[sizeof(entry->lse_path) - 1] = '\0';
-	entry->lse_immutable = immutable;
-	if (immutable)
-		memcpy(&entry->lse_global_xattr, lond_xattr,
-		       sizeof(*lond_xattr));
-
-	if (top == NULL) {
-		stat_stack_push(stack_list, entry);
-		return 0;
-	}
-
-	/* pop the stack until find the parent directory of this inode */
-	while (!lond_list_empty(stack_list)) {
-		top = stat_stack_top(stack_list);
-		if (top == NULL)
-			break;
-
-		/* Need to append / to parent path to avoid mismatch */
-		snprintf(parent_path, sizeof(parent_path), "%s/",
-			 top->lse_path);
-		if (strncmp(fpath, parent_path, strlen(parent_path)) == 0) {
-			parent = top;
-			break;
-		}
-		stat_stack_pop(stack_list);
-	}
-
-	if (parent == NULL) {
-		LERROR("can not find parent directory of inode [%s] in the stack\n",
-		       full_fpath);
-		return -1;
-	}
-
-	parent_xattr = &parent->lse_global_xattr;
-	parent_key = &lond_xattr->u.lx_global.lgx_key;
-	key = &lond_xattr->u.lx_global.lgx_key;
-
-	need_print = false;
-	if (!entry->lse_immutable) {
-		if (parent->lse_immutable)
-			need_print = true;
-	} else if (!parent->lse_immutable) {
-		need_print = true;
-	} else if (!lond_xattr->lx_is_valid) {
-		if (parent_xattr->lx_is_valid)
-			need_print = true;
-	} else if (!parent_xattr->lx_is_valid) {
-		need_print = true;
-	} else if (memcmp(key, parent_key, sizeof(struct lond_key)) != 0) {
-		need_print = true;
-	}
-
-	if (need_print)
-		print_inode_stat(full_fpath, mode, immutable, lond_xattr,
-				 parent);
+	struct lond_xattr *xattr = &entry->lse_global_xattr;
+	struct lond_xattr *parent_xattr = &parent->lse_global_xattr;
 
-	stat_stack_push(stack_list, entry);
-	return 0;
+	if (!entry->lse_immutable)
+		return parent->lse_immutable;
+	if (!parent->lse_immutable)
+		return true;
+	if (!xattr->lx_is_valid)
+		return parent_xattr->lx_is_valid;
+	if (!parent_xattr->lx_is_valid)
+		return true;
+	return memcmp(&xattr->u.lx_global.lgx_key,
+		      &parent_xattr->u.lx_global.lgx_key,
+		      sizeof(struct lond_key)) != 0;
 }
 
-int lond_inode_stat(const char *fpath, struct lond_list_head *stack_list,
-		    mode_t mode)
+/*
+ * Get the lock status of an opened inode, and print it if it differs from
+ * the status of @parent. @parent is NULL for the root of the scanning.
+ */
+static int lond_fd_stat(int fd, const char *fpath, mode_t mode,
+			struct lond_stat_entry *parent,
+			struct lond_stat_entry *entry)
 {
 	int rc;
-	bool immutable = false;
-	struct lond_xattr global_xattr;
 	char full_fpath[PATH_MAX + 1];
 
 	rc = get_full_fpath(fpath, full_fpath, PATH_MAX + 1);
@@ -794,80 +788,99 @@ int lond_inode_stat(const char *fpath, struct lond_list_head *stack_list,
 	}
 	LDEBUG("stating inode [%s]\n", full_fpath);
 
-	rc = check_inode_is_immutable(fpath, &immutable);
+	memset(entry, 0, sizeof(*entry));
+	rc = lond_fd_is_immutable(fd, full_fpath, &entry->lse_immutable);
 	if (rc) {
 		LERROR("failed to check whether file [%s] is immutable\n",
 		       full_fpath);
 		return rc;
 	}
 
-	if (immutable) {
-		rc = lond_read_global_xattr(fpath, &global_xattr);
+	if (entry->lse_immutable) {
+		rc = lond_fread_global_xattr(fd, &entry->lse_global_xattr);
 		if (rc) {
 			LERROR("failed to get lond key of immutable inode [%s]: %s\n",
-			       full_fpath, strerror(errno));
+			       full_fpath, strerror(-rc));
 			return rc;
 		}
 	}
 
-	if (stack_list) {
-		rc = stat_stack_update(stack_list, fpath, full_fpath,
-				       mode, immutable, &global_xattr);
-		if (rc) {
-			LERROR("failed to update the stat stack\n");
-			return rc;
-		}
-	} else {
-		print_inode_stat(full_fpath, mode, immutable, &global_xattr,
-				 NULL);
-	}
+	if (parent == NULL || stat_entry_differ(entry, parent))
+		print_inode_stat(full_fpath, mode, entry->lse_immutable,
+				 &entry->lse_global_xattr, parent);
+	return 0;
+}
 
+int lond_inode_stat(const char *fpath, mode_t mode)
+{
+	int fd;
+	int rc;
+	struct lond_stat_entry entry;
+
+	fd = lond_inode_flags_open(fpath);
+	if (fd < 0)
+		return fd;
+
+	rc = lond_fd_stat(fd, fpath, mode, NULL, &entry);
+	close(fd);
 	return rc;
 }
 
-/* The function of nftw() to stat file */
-static int nftw_stat_fn(const char *fpath, const struct stat *sb,
-			int tflag, struct FTW *ftwbuf)
+/* The visit function of lond_walk_tree() to stat file */
+static int walk_stat_fn(struct lond_walk_thread *thread,
+			struct lond_walk_entry *entry)
 {
+	int fd;
 	int rc;
+	struct lond_stat_entry *stat_entry;
+	const char *fpath = entry->lwe_path;
+	mode_t mode = entry->lwe_stat.st_mode;
 
 	/* Only need to stat directory and regular file */
-	if (!S_ISREG(sb->st_mode) && !S_ISDIR(sb->st_mode))
+	if (!S_ISREG(mode) && !S_ISDIR(mode))
 		return 0;
 
-	rc = lond_inode_stat(fpath, &nftw_stat_stack, sb->st_mode);
-	if (rc) {
-		nftw_private.np_errno = rc;
-		if (!nftw_private.np_ignore_error) {
-			LERROR("failed to stat file [%s], aborting\n", fpath);
-			return rc;
-		} else {
-			LERROR("failed to stat file [%s], continue\n",
-			       fpath);
-			return 0;
-		}
+	stat_entry = malloc(sizeof(*stat_entry));
+	if (stat_entry == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
 	}
-	return 0;
+
+	fd = lond_inode_flags_openat(entry->lwe_dirfd, entry->lwe_name, fpath);
+	if (fd < 0) {
+		rc = fd;
+		goto out_free;
+	}
+
+	rc = lond_fd_stat(fd, fpath, mode, entry->lwe_parent_private,
+			  stat_entry);
+	close(fd);
+	if (rc)
+		goto out_free;
+
+	/* Children compare their status with the status of this directory */
+	if (S_ISDIR(mode)) {
+		entry->lwe_private = stat_entry;
+		return 0;
+	}
+out_free:
+	free(stat_entry);
+	if (rc)
+		LERROR("failed to stat file [%s]%s\n", fpath,
+		       thread->lwt_walk->lw_ignore_error ?
+		       ", continue" : ", aborting");
+	return rc;
 }
 
 /*
- * Scanning process example:
- * /lustre/.
- * /lustre/./dir0
- * /lustre/./dir0/dir0_1
- * /lustre/./dir0/dir0_1/dir0_1_0
- * /lustre/./dir0/dir0_1/dir0_2_0
- * /lustre/./dir0/dir0_0
- * /lustre/./dir0/dir0_0/dir0_0_0
- * /lustre/./dir0/dir0_2
- * /lustre/./dir1
- * /lustre/./dir1/dir1_1
- * /lustre/./dir1/dir1_0
+ * Only the inodes whose lock status differ from their parent directories
+ * are printed. The directories are scanned in parallel, so the order of
+ * the messages is not stable.
  */
-int lond_tree_stat(const char *fpath, bool ignore_error)
+int lond_tree_stat(const char *fpath, bool ignore_error, int thread_number)
 {
 	int rc;
-	int flags = FTW_PHYS;
+	struct lond_walk walk;
 	char full_fpath[PATH_MAX + 1];
 
 	rc = get_full_fpath(fpath, full_fpath, PATH_MAX + 1);
@@ -876,24 +889,15 @@ int lond_tree_stat(const char *fpath, bool ignore_error)
 		return rc;
 	}
 
-	/*
-	 * There is no way to transfer the argument into nftw_x_fn,
-	 * thus use global variable to do that. This means, this is not
-	 * thread-safe.
-	 */
-	nftw_private.np_ignore_error = ignore_error;
-	nftw_private.np_errno = 0;
-	LOND_INIT_LIST_HEAD(&nftw_stat_stack);
-	rc = nftw(fpath, nftw_stat_fn, 32, flags);
-	stat_stack_free(&nftw_stat_stack);
-	if (rc) {
+	memset(&walk, 0, sizeof(walk));
+	walk.lw_thread_number = thread_number;
+	walk.lw_ignore_error = ignore_error;
+	walk.lw_visit = walk_stat_fn;
+	walk.lw_dir_private_free = free;
+	rc = lond_walk_tree(fpath, &walk);
+	if (rc)
 		LERROR("failed to stat directory tree [%s]\n",
 		       full_fpath);
-		return rc;
-	}
-
-	if (nftw_private.np_errno)
-		rc = nftw_private.np_errno;
 	return rc;
 }
 
@@ -1017,11 +1021,13 @@ static void generate_hash_key(struct dest_entry *ent)
 
 /*
  * Add file path, copied from inode number INO and device number DEV,
- * If entry alreay exists in hash table, set $ent_in_table to it.
+ * If entry alreay exists in hash table, set $ent_in_table to it. Otherwise,
+ * set $new_entry to the added entry which is marked as LOND_DEST_CREATING.
  */
 static int remember_copied(struct dest_entry **head, const char *fpath,
 			   ino_t ino, dev_t dev,
-			   struct dest_entry **entry_in_table)
+			   struct dest_entry **entry_in_table,
+			   struct dest_entry **new_entry)
 {
 	int rc = 0;
 	struct dest_entry *entry;
@@ -1034,6 +1040,7 @@ static int remember_copied(struct dest_entry **head, const char *fpath,
 
 	entry->de_ino = ino;
 	entry->de_dev = dev;
+	entry->de_status = LOND_DEST_CREATING;
 	generate_hash_key(entry);
 
 	HASH_FIND_STR(*head, entry->de_key, *entry_in_table);
@@ -1050,6 +1057,7 @@ static int remember_copied(struct dest_entry **head, const char *fpath,
 	}
 	HASH_ADD_STR(*head, de_key, entry);
 	LDEBUG("remembered [%s]\n", entry->de_fpath);
+	*new_entry = entry;
 
 	return 0;
 out_free_entry:
@@ -1057,55 +1065,17 @@ out_free_entry:
 	return rc;
 }
 
-int lond_copy_inode(struct dest_entry **head, const char *src_name,
-		    const char *dst_name, lond_copy_reg_file_fn reg_fn,
-		    void *private)
+static int copy_inode_create(const char *src_name, struct stat *src_sb,
+			     const char *dst_name,
+			     lond_copy_reg_file_fn reg_fn, void *private)
 {
 	int rc;
-	struct stat src_sb;
 	struct stat dst_sb;
-	mode_t src_mode;
+	mode_t src_mode = src_sb->st_mode;
 	mode_t dst_mode = 0;
 	mode_t dst_mode_bits;
 	mode_t omitted_permissions;
 	bool restore_dst_mode = false;
-	struct dest_entry *earlier_entry = NULL;
-
-	LDEBUG("creating [%s]\n", dst_name);
-
-	/*
-	 * Do not rust the stat of nftw, do it myself after setting the file
-	 * to immutable
-	 */
-	rc = lstat(src_name, &src_sb);
-	if (rc) {
-		LERROR("failed to stat [%s]: %s\n", src_name, strerror(errno));
-		return rc;
-	}
-
-	src_mode = src_sb.st_mode;
-	if (!S_ISDIR(src_mode) && src_sb.st_nlink > 1) {
-		rc = remember_copied(head, dst_name,
-				     src_sb.st_ino, src_sb.st_dev,
-				     &earlier_entry);
-		if (rc) {
-			LERROR("failed to remember copied\n");
-			return rc;
-		}
-
-		if (earlier_entry != NULL) {
-			/* Already created the inode, create hard link to it */
-			rc = link(earlier_entry->de_fpath, dst_name);
-			if (rc) {
-				LERROR("failed to create hard link from [%s] to [%s]: %s\n",
-				       earlier_entry->de_fpath, dst_name,
-				       strerror(errno));
-				rc = -errno;
-				return rc;
-			}
-			return 0;
-		}
-	}
 
 	/*
 	 * Omit some permissions at first, so unauthorized users cannot nip
@@ -1149,7 +1119,7 @@ int lond_copy_inode(struct dest_entry **head, const char *src_name,
 		}
 	} else if (S_ISREG(src_mode)) {
 		rc = reg_fn(src_name, dst_name, dst_mode, omitted_permissions,
-			    &src_sb, private);
+			    src_sb, private);
 		if (rc) {
 			LERROR("failed to create regular stub file [%s]\n",
 			       dst_name);
@@ -1158,7 +1128,7 @@ int lond_copy_inode(struct dest_entry **head, const char *src_name,
 	} else if (S_ISLNK(src_mode)) {
 		/* Symbol link doesn't need to */
 		rc = create_stub_symlink(src_name, dst_name,
-					 src_sb.st_size + 1);
+					 src_sb->st_size + 1);
 		if (rc) {
 			LERROR("failed to create symbol link [%s]\n",
 			       dst_name);
@@ -1167,7 +1137,7 @@ int lond_copy_inode(struct dest_entry **head, const char *src_name,
 	} else if (S_ISBLK(src_mode) || S_ISCHR(src_mode) ||
 		   S_ISSOCK(src_mode)) {
 		rc = mknod(dst_name, src_mode & ~omitted_permissions,
-			   src_sb.st_rdev);
+			   src_sb->st_rdev);
 		if (rc) {
 			LERROR("failed to create special file [%s]\n",
 			       dst_name);
@@ -1185,7 +1155,7 @@ int lond_copy_inode(struct dest_entry **head, const char *src_name,
 		return -1;
 	}
 
-	rc = set_owner(dst_name, &src_sb);
+	rc = set_owner(dst_name, src_sb);
 	if (rc) {
 		LERROR("failed to set owner [%s]\n", dst_name);
 		return rc;
@@ -1230,6 +1200,94 @@ int lond_copy_inode(struct dest_entry **head, const char *src_name,
 	return rc;
 }
 
+/* Protect the dest_entry tables from the parallel walk threads */
+static pthread_mutex_t dest_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when the inode of a dest_entry has been created */
+static pthread_cond_t dest_table_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * If @locked_sb is not NULL, it is the stat of @src_name got after locking
+ * the inode, and will be used instead of stating @src_name again.
+ */
+int lond_copy_inode(struct dest_entry **head, const char *src_name,
+		    struct stat const *locked_sb, const char *dst_name,
+		    lond_copy_reg_file_fn reg_fn, void *private)
+{
+	int rc;
+	struct stat src_sb;
+	struct dest_entry *earlier_entry = NULL;
+	struct dest_entry *new_entry = NULL;
+
+	LDEBUG("creating [%s]\n", dst_name);
+
+	/*
+	 * Do not rust the stat of the walk, do it myself after setting the
+	 * file to immutable
+	 */
+	if (locked_sb != NULL) {
+		memcpy(&src_sb, locked_sb, sizeof(src_sb));
+	} else {
+		rc = lstat(src_name, &src_sb);
+		if (rc) {
+			LERROR("failed to stat [%s]: %s\n", src_name,
+			       strerror(errno));
+			return rc;
+		}
+	}
+
+	if (S_ISDIR(src_sb.st_mode) || src_sb.st_nlink <= 1)
+		return copy_inode_create(src_name, &src_sb, dst_name, reg_fn,
+					 private);
+
+	/*
+	 * Other threads might be copying the other links of this inode. Only
+	 * hold the lock for the lookup and the insert, so that the copies of
+	 * unrelated inodes do not wait for each other. The links wait until
+	 * the thread that inserted the entry has created the inode.
+	 */
+	pthread_mutex_lock(&dest_table_mutex);
+	rc = remember_copied(head, dst_name, src_sb.st_ino, src_sb.st_dev,
+			     &earlier_entry, &new_entry);
+	if (rc) {
+		pthread_mutex_unlock(&dest_table_mutex);
+		LERROR("failed to remember copied\n");
+		return rc;
+	}
+
+	if (earlier_entry == NULL) {
+		pthread_mutex_unlock(&dest_table_mutex);
+
+		rc = copy_inode_create(src_name, &src_sb, dst_name, reg_fn,
+				       private);
+
+		pthread_mutex_lock(&dest_table_mutex);
+		new_entry->de_status = rc < 0 ? rc : (rc ? -EIO : 0);
+		pthread_cond_broadcast(&dest_table_cond);
+		pthread_mutex_unlock(&dest_table_mutex);
+		return rc;
+	}
+
+	while (earlier_entry->de_status == LOND_DEST_CREATING)
+		pthread_cond_wait(&dest_table_cond, &dest_table_mutex);
+	rc = earlier_entry->de_status;
+	pthread_mutex_unlock(&dest_table_mutex);
+
+	if (rc) {
+		LERROR("failed to link [%s] because creating [%s] failed: %s\n",
+		       dst_name, earlier_entry->de_fpath, strerror(-rc));
+		return rc;
+	}
+
+	/* Already created the inode, create hard link to it */
+	rc = link(earlier_entry->de_fpath, dst_name);
+	if (rc) {
+		rc = -errno;
+		LERROR("failed to create hard link from [%s] to [%s]: %s\n",
+		       earlier_entry->de_fpath, dst_name, strerror(-rc));
+	}
+	return rc;
+}
+
 void free_dest_table(struct dest_entry **head)
 {
 	struct dest_entry *entry, *tmp;
@@ -1261,3 +1319,11 @@ int lustre_fid_path(char *buf, int sz, const char *mnt,
 	return snprintf(buf, sz, "%s/%s/fid/"DFID_NOBRACE, mnt,
 			dot_lustre_name, PFID(fid));
 }
+
+/* Path to save the archived data of local file @fid on global Lustre @mnt */
+int lond_archive_path(char *buf, int sz, const char *mnt,
+		      const struct lu_fid *fid)
+{
+	return snprintf(buf, sz, "%s/"LOND_ARCHIVE_DIR"/"DFID_NOBRACE, mnt,
+			PFID(fid));
+}
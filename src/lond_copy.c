@@ -0,0 +1,570 @@
+/*
+ *
+ * Data copy engine for Lustre On Demand.
+ *
+ * Data is copied with copy_file_range() if possible. If the kernel or the
+ * file systems do not support it, splice() through a pipe is tried, and
+ * pread()/pwrite() through a user space buffer is the last resort. Holes
+ * of the source can be skipped with SEEK_DATA/SEEK_HOLE.
+ *
+ * In the no-cache mode, the aligned chunks are copied with O_DIRECT, and
+ * the rest is written back and dropped from the page cache behind the
+ * copy, so background copies don't evict the working set of the jobs.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debug.h"
+#include "lond.h"
+
+/* Size of the buffer if the caller doesn't provide one */
+#define LOND_COPY_BUF_SIZE_DEFAULT	(1024 * 1024)
+/* Bytes copied before they are dropped from the page cache */
+#define LOND_COPY_DROP_WINDOW		(8 * 1024 * 1024)
+
+static const char * const copy_method_names[] = {
+	[LOND_COPY_FILE_RANGE]	= "copy_file_range",
+	[LOND_COPY_SPLICE]	= "splice",
+	[LOND_COPY_READ_WRITE]	= "read_write",
+};
+
+const char *lond_copy_method_name(enum lond_copy_method method)
+{
+	if (method > LOND_COPY_READ_WRITE)
+		return "unknown";
+	return copy_method_names[method];
+}
+
+/*
+ * If @buf is NULL, a buffer of @buf_size will be allocated when reading and
+ * writing through user space is needed.
+ */
+void lond_copy_engine_init(struct lond_copy_engine *engine, char *buf,
+			   size_t buf_size)
+{
+	memset(engine, 0, sizeof(*engine));
+	engine->lce_method = LOND_COPY_FILE_RANGE;
+	engine->lce_pipe[0] = -1;
+	engine->lce_pipe[1] = -1;
+	engine->lce_extent_fd = -1;
+	engine->lce_direct_fds[0] = -1;
+	engine->lce_direct_fds[1] = -1;
+	engine->lce_drop_src_fd = -1;
+	engine->lce_drop_dst_fd = -1;
+	engine->lce_buf = buf;
+	if (buf_size == 0)
+		buf_size = LOND_COPY_BUF_SIZE_DEFAULT;
+	engine->lce_buf_size = buf_size;
+}
+
+static void copy_pipe_close(struct lond_copy_engine *engine)
+{
+	if (engine->lce_pipe[0] >= 0) {
+		close(engine->lce_pipe[0]);
+		close(engine->lce_pipe[1]);
+	}
+	engine->lce_pipe[0] = -1;
+	engine->lce_pipe[1] = -1;
+}
+
+/*
+ * Write back the dirty pages of the range and drop the range of both files
+ * from the page cache.
+ */
+int lond_copy_drop_cache(int src_fd, int dst_fd, off_t offset, off_t length)
+{
+	int rc;
+
+	/* Dirty pages can't be dropped until they are written back */
+	if (sync_file_range(dst_fd, offset, length,
+			    SYNC_FILE_RANGE_WAIT_BEFORE |
+			    SYNC_FILE_RANGE_WRITE |
+			    SYNC_FILE_RANGE_WAIT_AFTER))
+		return -errno;
+	rc = posix_fadvise(dst_fd, offset, length, POSIX_FADV_DONTNEED);
+	if (rc)
+		return -rc;
+	rc = posix_fadvise(src_fd, offset, length, POSIX_FADV_DONTNEED);
+	return -rc;
+}
+
+static void copy_drop_flush(struct lond_copy_engine *engine)
+{
+	int rc;
+	off_t length = engine->lce_drop_end - engine->lce_drop_start;
+
+	if (engine->lce_drop_dst_fd < 0)
+		return;
+
+	rc = lond_copy_drop_cache(engine->lce_drop_src_fd,
+				  engine->lce_drop_dst_fd,
+				  engine->lce_drop_start, length);
+	if (rc)
+		LDEBUG("failed to drop copied data from page cache: %s\n",
+		       strerror(-rc));
+	engine->lce_drop_src_fd = -1;
+	engine->lce_drop_dst_fd = -1;
+}
+
+/* Drop the copied data behind the copy once a window has been copied */
+static void copy_drop_cache(struct lond_copy_engine *engine, int src_fd,
+			    int dst_fd, off_t offset, size_t length)
+{
+	if (engine->lce_drop_src_fd != src_fd ||
+	    engine->lce_drop_dst_fd != dst_fd ||
+	    engine->lce_drop_end != offset) {
+		copy_drop_flush(engine);
+		engine->lce_drop_src_fd = src_fd;
+		engine->lce_drop_dst_fd = dst_fd;
+		engine->lce_drop_start = offset;
+	}
+	engine->lce_drop_end = offset + length;
+	/* Start the write back now, so it is done when the window is full */
+	sync_file_range(dst_fd, offset, length, SYNC_FILE_RANGE_WRITE);
+	if (engine->lce_drop_end - engine->lce_drop_start >=
+	    LOND_COPY_DROP_WINDOW)
+		copy_drop_flush(engine);
+}
+
+/* Set or clear O_DIRECT of the source (@index 0) or dest (@index 1) fd */
+static int copy_set_direct(struct lond_copy_engine *engine, int index,
+			   int fd, bool direct)
+{
+	int flags;
+
+	if ((engine->lce_direct_fds[index] == fd) == direct)
+		return 0;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -errno;
+	flags = direct ? flags | O_DIRECT : flags & ~O_DIRECT;
+	if (fcntl(fd, F_SETFL, flags))
+		return -errno;
+	engine->lce_direct_fds[index] = direct ? fd : -1;
+	return 0;
+}
+
+/* Clear O_DIRECT set by the engine, so buffered I/O can be used */
+static void copy_direct_clear(struct lond_copy_engine *engine)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (engine->lce_direct_fds[i] >= 0)
+			copy_set_direct(engine, i, engine->lce_direct_fds[i],
+					false);
+	}
+}
+
+static void copy_direct_disable(struct lond_copy_engine *engine, int errnum)
+{
+	LDEBUG("O_DIRECT is not usable (%s), using buffered I/O\n",
+	       strerror(errnum));
+	engine->lce_direct = false;
+	copy_direct_clear(engine);
+}
+
+/* Borrow or allocate the buffer, aligned for O_DIRECT */
+static int copy_buf_prepare(struct lond_copy_engine *engine)
+{
+	void *buf;
+
+	if (engine->lce_buf != NULL)
+		return 0;
+
+	if (engine->lce_pool != NULL &&
+	    engine->lce_pool->lbp_buf_size >= engine->lce_buf_size) {
+		engine->lce_buf = lond_buf_pool_get(engine->lce_pool);
+		if (engine->lce_buf != NULL) {
+			engine->lce_buf_borrowed = true;
+			return 0;
+		}
+	}
+
+	if (posix_memalign(&buf, LOND_DIRECT_IO_ALIGN, engine->lce_buf_size))
+		return -ENOMEM;
+	engine->lce_buf = buf;
+	engine->lce_buf_allocated = true;
+	return 0;
+}
+
+void lond_copy_engine_fini(struct lond_copy_engine *engine)
+{
+	copy_pipe_close(engine);
+	copy_drop_flush(engine);
+	if (engine->lce_buf_allocated) {
+		free(engine->lce_buf);
+		engine->lce_buf = NULL;
+		engine->lce_buf_allocated = false;
+	} else if (engine->lce_buf_borrowed) {
+		lond_buf_pool_put(engine->lce_pool, engine->lce_buf);
+		engine->lce_buf = NULL;
+		engine->lce_buf_borrowed = false;
+	}
+}
+
+static void copy_fallback(struct lond_copy_engine *engine,
+			  enum lond_copy_method method, int errnum)
+{
+	LDEBUG("%s is not usable (%s), falling back to %s\n",
+	       lond_copy_method_name(engine->lce_method), strerror(errnum),
+	       lond_copy_method_name(method));
+	engine->lce_method = method;
+	engine->lce_method_verified = false;
+}
+
+static ssize_t copy_read_write(struct lond_copy_engine *engine, int src_fd,
+			       int dst_fd, off_t offset, size_t length)
+{
+	ssize_t rsize;
+	ssize_t wsize;
+	ssize_t written = 0;
+	int rc;
+
+	rc = copy_buf_prepare(engine);
+	if (rc)
+		return rc;
+
+	if (length > engine->lce_buf_size)
+		length = engine->lce_buf_size;
+
+	rsize = pread(src_fd, engine->lce_buf, length, offset);
+	if (rsize <= 0)
+		return rsize < 0 ? -errno : 0;
+
+	while (written < rsize) {
+		wsize = pwrite(dst_fd, engine->lce_buf + written,
+			       rsize - written, offset + written);
+		if (wsize < 0)
+			return -errno;
+		written += wsize;
+	}
+	return written;
+}
+
+/*
+ * The data in the pipe can not be spliced to the dest, write it through
+ * the buffer instead.
+ */
+static ssize_t copy_pipe_drain(struct lond_copy_engine *engine, int dst_fd,
+			       off_t offset, size_t length)
+{
+	ssize_t rsize;
+	ssize_t wsize;
+	ssize_t written = 0;
+	size_t size;
+	int rc;
+
+	rc = copy_buf_prepare(engine);
+	if (rc)
+		return rc;
+
+	while (written < length) {
+		size = length - written;
+		if (size > engine->lce_buf_size)
+			size = engine->lce_buf_size;
+		rsize = read(engine->lce_pipe[0], engine->lce_buf, size);
+		if (rsize <= 0)
+			return rsize < 0 ? -errno : -EIO;
+
+		wsize = pwrite(dst_fd, engine->lce_buf, rsize,
+			       offset + written);
+		if (wsize != rsize)
+			return wsize < 0 ? -errno : -EIO;
+		written += wsize;
+	}
+	return written;
+}
+
+static ssize_t copy_splice(struct lond_copy_engine *engine, int src_fd,
+			   int dst_fd, off_t offset, size_t length)
+{
+	loff_t in_offset = offset;
+	loff_t out_offset = offset;
+	ssize_t rsize;
+	ssize_t wsize;
+	ssize_t written = 0;
+	ssize_t rc;
+
+	if (engine->lce_pipe[0] < 0) {
+		if (pipe2(engine->lce_pipe, O_CLOEXEC))
+			return -errno;
+		/* Enlarge the pipe to reduce the number of syscalls */
+		fcntl(engine->lce_pipe[1], F_SETPIPE_SZ,
+		      (int)engine->lce_buf_size);
+	}
+
+	rsize = splice(src_fd, &in_offset, engine->lce_pipe[1], NULL,
+		       length, SPLICE_F_MOVE);
+	if (rsize <= 0)
+		return rsize < 0 ? -errno : 0;
+
+	while (written < rsize) {
+		wsize = splice(engine->lce_pipe[0], NULL, dst_fd, &out_offset,
+			       rsize - written, SPLICE_F_MOVE);
+		if (wsize > 0) {
+			written += wsize;
+			continue;
+		}
+
+		if (wsize < 0 && written == 0 &&
+		    !engine->lce_method_verified) {
+			copy_fallback(engine, LOND_COPY_READ_WRITE, errno);
+			rc = copy_pipe_drain(engine, dst_fd, offset, rsize);
+			copy_pipe_close(engine);
+			return rc;
+		}
+
+		rc = wsize < 0 ? -errno : -EIO;
+		/* The pipe might still contain data, do not reuse it */
+		copy_pipe_close(engine);
+		return rc;
+	}
+	engine->lce_method_verified = true;
+	return written;
+}
+
+static ssize_t copy_file_range_chunk(int src_fd, int dst_fd, off_t offset,
+				     size_t length)
+{
+#ifdef __NR_copy_file_range
+	loff_t in_offset = offset;
+	loff_t out_offset = offset;
+	ssize_t rc;
+
+	rc = syscall(__NR_copy_file_range, src_fd, &in_offset, dst_fd,
+		     &out_offset, length, 0);
+	return rc < 0 ? -errno : rc;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/*
+ * Look up the data extent at or after @offset. After success, the range
+ * [@offset, @data_start) is a hole, and [@data_start, @data_end) is data.
+ * If there is no data after @offset, both are set to the file size.
+ * Return -EOPNOTSUPP if the file system doesn't support SEEK_DATA.
+ */
+int lond_copy_data_extent(int fd, off_t offset, off_t *data_start,
+			  off_t *data_end)
+{
+	off_t data;
+	off_t hole;
+	struct stat sb;
+
+	data = lseek(fd, offset, SEEK_DATA);
+	if (data < 0) {
+		if (errno == EINVAL || errno == EOPNOTSUPP)
+			return -EOPNOTSUPP;
+		if (errno != ENXIO)
+			return -errno;
+
+		/* No data after offset */
+		if (fstat(fd, &sb))
+			return -errno;
+		data = sb.st_size > offset ? sb.st_size : offset;
+		hole = data;
+	} else {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return -errno;
+	}
+
+	*data_start = data;
+	*data_end = hole;
+	return 0;
+}
+
+/* Make sure the cached data extent covers @offset */
+static int copy_find_data(struct lond_copy_engine *engine, int fd,
+			  off_t offset)
+{
+	int rc;
+
+	if (engine->lce_extent_fd == fd &&
+	    offset >= engine->lce_extent_from &&
+	    offset < engine->lce_data_end)
+		return 0;
+
+	rc = lond_copy_data_extent(fd, offset, &engine->lce_data_start,
+				   &engine->lce_data_end);
+	if (rc == -EOPNOTSUPP) {
+		LDEBUG("SEEK_DATA is not supported, copying holes\n");
+		engine->lce_sparse = false;
+		return 0;
+	} else if (rc) {
+		engine->lce_extent_fd = -1;
+		return rc;
+	}
+
+	engine->lce_extent_fd = fd;
+	engine->lce_extent_from = offset;
+	return 0;
+}
+
+/*
+ * Copy the aligned part of the chunk with O_DIRECT. Return -EOPNOTSUPP if
+ * nothing can be copied this way, and the chunk should be copied with the
+ * other methods.
+ */
+static ssize_t copy_direct(struct lond_copy_engine *engine, int src_fd,
+			   int dst_fd, off_t offset, size_t length)
+{
+	int rc;
+	ssize_t rsize;
+	ssize_t wsize;
+	ssize_t written = 0;
+
+	if (offset % LOND_DIRECT_IO_ALIGN != 0)
+		return -EOPNOTSUPP;
+	if (length > engine->lce_buf_size)
+		length = engine->lce_buf_size;
+	length -= length % LOND_DIRECT_IO_ALIGN;
+	if (length == 0)
+		return -EOPNOTSUPP;
+
+	rc = copy_buf_prepare(engine);
+	if (rc)
+		return rc;
+
+	rc = copy_set_direct(engine, 0, src_fd, true);
+	if (rc == 0)
+		rc = copy_set_direct(engine, 1, dst_fd, true);
+	if (rc) {
+		copy_direct_disable(engine, -rc);
+		return -EOPNOTSUPP;
+	}
+
+	rsize = pread(src_fd, engine->lce_buf, length, offset);
+	if (rsize < 0) {
+		rc = -errno;
+		if (rc == -EINVAL && !engine->lce_direct_verified) {
+			copy_direct_disable(engine, -rc);
+			return -EOPNOTSUPP;
+		}
+		return rc;
+	}
+	if (rsize == 0)
+		return 0;
+
+	/* The unaligned tail at EOF can only be written with buffered I/O */
+	if (rsize % LOND_DIRECT_IO_ALIGN != 0) {
+		rc = copy_set_direct(engine, 1, dst_fd, false);
+		if (rc)
+			return rc;
+	}
+
+	while (written < rsize) {
+		wsize = pwrite(dst_fd, engine->lce_buf + written,
+			       rsize - written, offset + written);
+		if (wsize >= 0) {
+			written += wsize;
+			continue;
+		}
+
+		rc = -errno;
+		if (rc != -EINVAL || engine->lce_direct_verified)
+			return rc;
+		/* The dest doesn't support O_DIRECT, write the data anyway */
+		copy_direct_disable(engine, -rc);
+	}
+	engine->lce_direct_verified = engine->lce_direct;
+
+	if (rsize % LOND_DIRECT_IO_ALIGN != 0 || !engine->lce_direct)
+		copy_drop_cache(engine, src_fd, dst_fd, offset, written);
+	return written;
+}
+
+static ssize_t copy_chunk_method(struct lond_copy_engine *engine,
+				 int src_fd, int dst_fd, off_t offset,
+				 size_t length)
+{
+	ssize_t rc;
+
+	if (engine->lce_method == LOND_COPY_FILE_RANGE) {
+		rc = copy_file_range_chunk(src_fd, dst_fd, offset, length);
+		if (rc > 0) {
+			engine->lce_method_verified = true;
+			return rc;
+		}
+		/*
+		 * Some kernels return 0 instead of an error when copying
+		 * between different file systems isn't supported. Fall back
+		 * and let the next method decide whether this is EOF.
+		 */
+		if (engine->lce_method_verified)
+			return rc;
+		copy_fallback(engine, LOND_COPY_SPLICE, rc ? -rc : ENODATA);
+	}
+
+	if (engine->lce_method == LOND_COPY_SPLICE) {
+		rc = copy_splice(engine, src_fd, dst_fd, offset, length);
+		if (rc >= 0 || engine->lce_method_verified ||
+		    engine->lce_method != LOND_COPY_SPLICE)
+			return rc;
+		copy_fallback(engine, LOND_COPY_READ_WRITE, -rc);
+	}
+
+	return copy_read_write(engine, src_fd, dst_fd, offset, length);
+}
+
+/*
+ * Copy at most @length bytes from @src_fd to @dst_fd, both at @offset.
+ * Return the number of bytes copied, 0 on EOF of the source, or negative
+ * errno on failure. If lce_sparse is set and @offset is in a hole, nothing
+ * is written and the size of the hole is returned, at most @length.
+ *
+ * If a method fails before it has ever copied any data, it is considered
+ * as not supported for the files, and the next method is used instead.
+ * The error of the last method will be returned if all of them fail.
+ */
+ssize_t lond_copy_chunk(struct lond_copy_engine *engine, int src_fd,
+			int dst_fd, off_t offset, size_t length)
+{
+	ssize_t rc;
+
+	engine->lce_hole_skipped = false;
+	if (engine->lce_sparse) {
+		rc = copy_find_data(engine, src_fd, offset);
+		if (rc < 0)
+			return rc;
+	}
+
+	if (engine->lce_sparse) {
+		if (engine->lce_data_start > offset) {
+			if (length > engine->lce_data_start - offset)
+				length = engine->lce_data_start - offset;
+			engine->lce_hole_skipped = true;
+			return length;
+		}
+		/* EOF */
+		if (offset >= engine->lce_data_end)
+			return 0;
+		if (length > engine->lce_data_end - offset)
+			length = engine->lce_data_end - offset;
+	}
+
+	if (engine->lce_direct) {
+		rc = copy_direct(engine, src_fd, dst_fd, offset, length);
+		if (rc != -EOPNOTSUPP)
+			return rc;
+		copy_direct_clear(engine);
+	}
+
+	rc = copy_chunk_method(engine, src_fd, dst_fd, offset, length);
+	if (rc > 0 && engine->lce_nocache)
+		copy_drop_cache(engine, src_fd, dst_fd, offset, rc);
+	return rc;
+}
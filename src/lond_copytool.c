@@ -14,27 +14,32 @@
 #include <signal.h>
 #include <getopt.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <json-c/json.h>
 #include <lustre/lustreapi.h>
 #include "debug.h"
+#include "list.h"
 #include "lond.h"
 
 static int err_major;
 static int err_minor;
-static struct hsm_copytool_private *ctdata;
-static char fs_name[MAX_OBD_NAME + 1];
-static bool exiting;
 
 struct copytool_options {
-	char			*o_hsm_root;
-	/* Lustre mount point */
-	char			*o_mnt;
-	int			 o_mnt_fd;
 	/* Number of archive IDs that can be saved */
 	int			 o_archive_id_used;
 	/* Number of valid archive IDs */
@@ -44,50 +49,396 @@ struct copytool_options {
 	bool			 o_abort_on_error;
 	int			 o_daemonize;
 	int			 o_report_int;
+	/* Max bytes to copy at a time, also the size of the copy buffers */
 	int			 o_chunk_size;
-	unsigned long long	 o_bandwidth;
+	/* Max number of copy buffers in the pool, 0: one for each thread */
+	int			 o_buffer_pool;
+	/* Whether to back the copy buffers with huge pages */
+	bool			 o_hugepage;
+	/* Copy with O_DIRECT and keep the data out of the page cache */
+	bool			 o_nocache;
+	/* Seconds between the adjustments of the auto-tuner, 0: disabled */
+	int			 o_autotune;
+	/* Bounds of the chunk size adjusted by the auto-tuner */
+	int			 o_min_chunk_size;
+	int			 o_max_chunk_size;
+	/* Min number of active streams, the max is the thread number */
+	int			 o_min_streams;
+	/* Path of the Unix control socket, NULL: disabled */
+	char			*o_control_socket;
+	/* Interval in seconds to log the progress, 0: disabled */
+	int			 o_status_interval;
+	/* Bytes per second read from the source by all threads, 0: no limit */
+	unsigned long long	 o_read_bandwidth;
+	/* Bytes per second written to the dest by all threads, 0: no limit */
+	unsigned long long	 o_write_bandwidth;
+	/* Number of threads to process the actions */
+	int			 o_thread_number;
+	/* Max number of actions waiting in the queue */
+	int			 o_queue_depth;
+	/* Number of chunks in flight per file with io_uring, 0 to disable */
+	int			 o_uring_depth;
+	/* Number of threads to copy a large file */
+	int			 o_split_threads;
+	/* Files not smaller than this are copied by multiple threads */
+	unsigned long long	 o_split_size;
+	/* Restores of files smaller than this have high priority */
+	unsigned long long	 o_small_size;
+	/* Seconds of waiting that promote an action by one priority class */
+	int			 o_priority_age;
+	/* Max number of restores reading from the same OST, 0: no limit */
+	int			 o_ost_streams;
+	/* Max number of siblings to restore ahead of a restore, 0: disabled */
+	int			 o_readahead_files;
+	/* Max bytes of the siblings to restore ahead of a restore */
+	unsigned long long	 o_readahead_bytes;
+	/* Bytes of the source to advise the OSTs to read ahead, 0: disabled */
+	unsigned long long	 o_willread_size;
 };
 
 /* Progress reporting period */
 #define REPORT_INTERVAL_DEFAULT 30
-#ifndef NSEC_PER_SEC
-# define NSEC_PER_SEC 1000000000UL
-#endif
+#define THREAD_NUMBER_DEFAULT	16
+/* Default queue depth is multiple of the thread number */
+#define QUEUE_DEPTH_FACTOR	4
+#define SPLIT_THREADS_DEFAULT	4
+#define SPLIT_SIZE_DEFAULT	(1ULL << 30)
+#define SMALL_SIZE_DEFAULT	(16ULL << 20)
+#define PRIORITY_AGE_DEFAULT	30
+#define OST_STREAMS_DEFAULT	4
+#define READAHEAD_BYTES_DEFAULT	(1ULL << 30)
+/* Siblings examined by a readahead for each file to restore */
+#define READAHEAD_SCAN_FACTOR	4
+/* Max entries read to find the restored file in its directory */
+#define READAHEAD_LOCATE_MAX	16384
+#define WILLREAD_SIZE_DEFAULT	(64ULL << 20)
+#define CHUNK_SIZE_DEFAULT	(1024 * 1024)
+#define MIN_CHUNK_SIZE_DEFAULT	(256 * 1024)
+#define MAX_CHUNK_SIZE_DEFAULT	(16 * 1024 * 1024)
+/* The auto-tuner backs off if the latency grows more than this */
+#define AUTOTUNE_LATENCY_RATIO	1.25
+/* ... unless the throughput grows more than this */
+#define AUTOTUNE_RATE_RATIO	1.1
+/* Bytes copied with io_uring before they are dropped from the page cache */
+#define NOCACHE_WINDOW		(8ULL << 20)
+/* A FID requested again within this period has the highest priority */
+#define RECENT_FID_PERIOD	300
+/* Used if failed to get the stripe size of the source file */
+#define LOND_STRIPE_SIZE_DEFAULT	(1024 * 1024)
 
 struct copytool_options opt = {
 	.o_report_int = REPORT_INTERVAL_DEFAULT,
-	.o_chunk_size = 1048676,
+	.o_chunk_size = CHUNK_SIZE_DEFAULT,
+	.o_thread_number = THREAD_NUMBER_DEFAULT,
+	.o_split_threads = SPLIT_THREADS_DEFAULT,
+	.o_split_size = SPLIT_SIZE_DEFAULT,
+	.o_small_size = SMALL_SIZE_DEFAULT,
+	.o_priority_age = PRIORITY_AGE_DEFAULT,
+	.o_ost_streams = OST_STREAMS_DEFAULT,
+	.o_readahead_bytes = READAHEAD_BYTES_DEFAULT,
+	.o_willread_size = WILLREAD_SIZE_DEFAULT,
+	.o_min_chunk_size = MIN_CHUNK_SIZE_DEFAULT,
+	.o_max_chunk_size = MAX_CHUNK_SIZE_DEFAULT,
+	.o_min_streams = 1,
 };
 
-static void handler(int signal)
-{
-	psignal(signal, "exiting");
+/* Copy buffers shared by all the threads */
+static struct lond_buf_pool buf_pool;
+
+enum loop_source_type {
+	LS_HSM = 0,
+	LS_SIGNAL,
+	LS_TIMER,
+	LS_CONTROL,
+	LS_CLIENT,
+	LS_QUEUE,
+};
+
+/* File descriptor watched by the main loop */
+struct loop_source {
+	int			 ls_fd;
+	enum loop_source_type	 ls_type;
+	/* When the client connected */
+	time_t			 ls_time;
+	/* Linked into cl_clients */
+	struct lond_list_head	 ls_linkage;
+};
+
+/* Max number of archive IDs of a pair added at runtime */
+#define PAIR_ARCHIVE_IDS_MAX	32
+
+/*
+ * A source Lustre whose data is copied to a dest Lustre. The copytool
+ * registers on the dest for the archive IDs. Pairs are only added, never
+ * removed until exiting, so the queued actions can point to their pairs.
+ */
+struct copytool_pair {
+	/* Root of the source Lustre */
+	char			 ctp_hsm_root[PATH_MAX];
+	/* Mount point of the dest Lustre */
+	char			 ctp_mnt[PATH_MAX];
+	int			 ctp_mnt_fd;
+	char			 ctp_fs_name[MAX_OBD_NAME + 1];
+	/* Archive IDs to serve, all of them if none */
+	int			*ctp_archive_ids;
+	int			 ctp_archive_id_number;
+	struct hsm_copytool_private *ctp_ctdata;
+	/* Restore requests of the siblings of the restored files */
+	struct lond_hsm_batch	 ctp_readahead_batch;
+	/* Protects ctp_readahead_dir and ctp_readahead_pos */
+	pthread_mutex_t		 ctp_readahead_mutex;
+	/* Directory examined by the last readahead, relative to ctp_mnt */
+	char			 ctp_readahead_dir[PATH_MAX];
+	/* Position in ctp_readahead_dir where the last readahead stopped */
+	long			 ctp_readahead_pos;
+	/* HSM fd watched by the main loop */
+	struct loop_source	 ctp_source;
+	/*
+	 * Copy of the action list received when the queue was full, with the
+	 * index and the offset of the first item not queued yet. The HSM fd
+	 * is not watched until all of the items are queued.
+	 */
+	struct hsm_action_list	*ctp_pending;
+	int			 ctp_pending_size;
+	int			 ctp_pending_index;
+	size_t			 ctp_pending_offset;
+	/* Linked into copytool_pairs */
+	struct lond_list_head	 ctp_linkage;
+};
+
+/* Only changed by the main thread */
+static LOND_LIST_HEAD(copytool_pairs);
+
+/* Priority classes of the actions, from the highest to the lowest */
+enum copytool_priority {
+	/*
+	 * Removes, which only update metadata. They finish quickly and free
+	 * the slots of the coordinator, so they are not queued behind copies.
+	 */
+	CP_PRIORITY_REMOVE = 0,
+	/* FIDs that have been requested recently */
+	CP_PRIORITY_URGENT,
+	/* Interactive restores of small files */
+	CP_PRIORITY_HIGH,
+	/* Other interactive restores */
+	CP_PRIORITY_NORMAL,
+	/* Bulk restores and archives */
+	CP_PRIORITY_LOW,
+	CP_PRIORITY_NUMBER,
+};
+
+/* Number of running restores that read from an OST */
+struct ost_streams {
+	int			 os_index;
+	int			 os_running;
+	UT_hash_handle		 hh;
+};
+
+/*
+ * Bounded queue of the actions received from the coordinator. When the
+ * queue is full, the main loop stops receiving more actions until the
+ * workers catch up, but never blocks.
+ */
+struct copytool_queue {
+	pthread_mutex_t		 cq_mutex;
+	/* Signaled when an item is added or the queue is stopping */
+	pthread_cond_t		 cq_not_empty;
+	/* Eventfd of the main loop, written when a slot is freed if cq_full */
+	int			 cq_not_full_fd;
+	/* The main loop found the queue full and waits for a slot */
+	bool			 cq_full;
+	/* Lists of struct thread_data, one for each priority class */
+	struct lond_list_head	 cq_items[CP_PRIORITY_NUMBER];
 	/*
-	 * If we don't clean up upon interrupt, umount thinks there's a ref
-	 * and doesn't remove us from mtab (EINPROGRESS). The lustre client
-	 * does successfully unmount and the mount is actually gone, but the
-	 * mtab entry remains. So this just makes mtab happier.
+	 * Restores whose size or OST is not known yet. The workers resolve
+	 * them and move them to cq_items, so the thread receiving the
+	 * actions doesn't wait for the MDS.
 	 */
-	llapi_hsm_copytool_unregister(&ctdata);
-	exiting = true;
+	struct lond_list_head	 cq_unresolved;
+	/* Items being resolved by the workers */
+	struct lond_list_head	 cq_resolving;
+	int			 cq_count;
+	int			 cq_depth;
+	bool			 cq_stopping;
+	pthread_t		*cq_threads;
+	int			 cq_thread_number;
+	/* Number of running restores of each source OST */
+	struct ost_streams	*cq_ost_streams;
+	/* Number of items being processed, and the limit set by auto-tuner */
+	int			 cq_active;
+	int			 cq_active_limit;
+	/* Max of cq_active_limit, might be smaller than cq_thread_number */
+	int			 cq_thread_limit;
+};
+
+static struct copytool_queue queue = {
+	.cq_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cq_not_empty = PTHREAD_COND_INITIALIZER,
+	.cq_not_full_fd = -1,
+	.cq_items = {
+		LOND_LIST_HEAD_INIT(queue.cq_items[CP_PRIORITY_REMOVE]),
+		LOND_LIST_HEAD_INIT(queue.cq_items[CP_PRIORITY_URGENT]),
+		LOND_LIST_HEAD_INIT(queue.cq_items[CP_PRIORITY_HIGH]),
+		LOND_LIST_HEAD_INIT(queue.cq_items[CP_PRIORITY_NORMAL]),
+		LOND_LIST_HEAD_INIT(queue.cq_items[CP_PRIORITY_LOW]),
+	},
+	.cq_unresolved = LOND_LIST_HEAD_INIT(queue.cq_unresolved),
+	.cq_resolving = LOND_LIST_HEAD_INIT(queue.cq_resolving),
+};
+
+/* FID that has been requested recently */
+struct recent_fid {
+	struct lu_fid		 rf_fid;
+	time_t			 rf_time;
+	/* Linked into recent_fid_list in the order of rf_time */
+	struct lond_list_head	 rf_linkage;
+	UT_hash_handle		 hh;
+};
+
+/* Only accessed by the thread receiving the actions */
+static struct recent_fid *recent_fid_table;
+static LOND_LIST_HEAD(recent_fid_list);
+
+/* Stages of the actions whose latency is measured */
+enum metrics_stage {
+	/* From being queued to being taken by a thread */
+	MS_QUEUE_WAIT = 0,
+	/* Beginning the action and opening the files */
+	MS_OPEN,
+	/* Copying the data */
+	MS_COPY,
+	/* Reporting the end of the action to the coordinator */
+	MS_ACTION_END,
+	MS_NUMBER,
+};
+
+static const char * const metrics_stage_names[] = {
+	[MS_QUEUE_WAIT]	= "queue_wait",
+	[MS_OPEN]	= "open",
+	[MS_COPY]	= "copy",
+	[MS_ACTION_END]	= "action_end",
+};
+
+enum metrics_action {
+	MA_ARCHIVE = 0,
+	MA_RESTORE,
+	MA_REMOVE,
+	MA_OTHER,
+	MA_NUMBER,
+};
+
+static const char * const metrics_action_names[] = {
+	[MA_ARCHIVE]	= "archive",
+	[MA_RESTORE]	= "restore",
+	[MA_REMOVE]	= "remove",
+	[MA_OTHER]	= "other",
+};
+
+enum metrics_result {
+	MR_OK = 0,
+	MR_FAILED,
+	MR_CANCELED,
+	MR_NUMBER,
+};
+
+static const char * const metrics_result_names[] = {
+	[MR_OK]		= "ok",
+	[MR_FAILED]	= "failed",
+	[MR_CANCELED]	= "canceled",
+};
+
+/* Max archive ID that the bytes are counted for */
+#define METRICS_ARCHIVE_ID_MAX	32
+/* Percentiles of the latency to export */
+static const double metrics_percentiles[] = {50, 90, 99, 99.9};
+
+/*
+ * Counters of a worker thread, or of the other threads for slot 0. They
+ * are updated with atomic operations without lock, and summed up when
+ * exported.
+ */
+struct metrics_slot {
+	__u64			 ms_actions[MA_NUMBER][MR_NUMBER];
+	/* Bytes copied in total and of each archive ID */
+	__u64			 ms_bytes;
+	__u64			 ms_archive_bytes[METRICS_ARCHIVE_ID_MAX + 1];
+	/* Cancel requests received */
+	__u64			 ms_cancels;
+	/* Latency in microseconds */
+	struct lond_histogram	 ms_latency[MS_NUMBER];
+};
+
+/* Slot 0 is shared, the others belong to the worker threads */
+static struct metrics_slot *metrics_slots;
+static int metrics_slot_number;
+static __thread struct metrics_slot *thread_metrics;
+
+static struct metrics_slot *metrics_slot(void)
+{
+	return thread_metrics != NULL ? thread_metrics : &metrics_slots[0];
+}
+
+static void metrics_count(__u64 *counter, __u64 value)
+{
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static __u64 copy_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Record the latency of @stage which started at @start_ns */
+static void metrics_latency(enum metrics_stage stage, __u64 start_ns)
+{
+	lond_histogram_record(&metrics_slot()->ms_latency[stage],
+			      (copy_now_ns() - start_ns) / 1000);
+}
+
+static enum metrics_action metrics_action(const struct hsm_action_item *hai)
+{
+	switch (hai->hai_action) {
+	case HSMA_ARCHIVE:
+		return MA_ARCHIVE;
+	case HSMA_RESTORE:
+		return MA_RESTORE;
+	case HSMA_REMOVE:
+		return MA_REMOVE;
+	default:
+		return MA_OTHER;
+	}
 }
 
-static int action_fini(struct hsm_copyaction_private **phcp,
+static int action_fini(struct copytool_pair *pair,
+		       struct hsm_copyaction_private **phcp,
 		       const struct hsm_action_item *hai, int hp_flags,
 		       int ct_rc)
 {
 	struct hsm_copyaction_private	*hcp;
 	char				 lstr[PATH_MAX + 1];
 	int				 rc;
+	enum metrics_result		 result = MR_OK;
+	__u64				 start;
+
+	if (abs(ct_rc) == ECANCELED)
+		result = MR_CANCELED;
+	else if (ct_rc != 0)
+		result = MR_FAILED;
+	metrics_count(&metrics_slot()->ms_actions[metrics_action(hai)][result],
+		      1);
 
 	LDEBUG("Action completed, notifying coordinator cookie=%#jx, FID="DFID", hp_flags=%d err=%d\n",
 	       (uintmax_t)hai->hai_cookie, PFID(&hai->hai_fid),
 	       hp_flags, -ct_rc);
 
-	lustre_fid_path(lstr, sizeof(lstr), opt.o_mnt, &hai->hai_fid);
+	lustre_fid_path(lstr, sizeof(lstr), pair->ctp_mnt, &hai->hai_fid);
 
 	if (phcp == NULL || *phcp == NULL) {
-		rc = llapi_hsm_action_begin(&hcp, ctdata, hai, -1, 0, true);
+		rc = llapi_hsm_action_begin(&hcp, pair->ctp_ctdata, hai, -1, 0,
+					    true);
 		if (rc < 0) {
 			LERROR("llapi_hsm_action_begin() on [%s] failed\n",
 			       lstr);
@@ -96,7 +447,9 @@ static int action_fini(struct hsm_copyaction_private **phcp,
 		phcp = &hcp;
 	}
 
+	start = copy_now_ns();
 	rc = llapi_hsm_action_end(phcp, &hai->hai_extent, hp_flags, abs(ct_rc));
+	metrics_latency(MS_ACTION_END, start);
 	if (rc == -ECANCELED)
 		LERROR("completed action on '%s' has been canceled: cookie=%#jx, FID="DFID"\n",
 		       lstr,
@@ -110,23 +463,20 @@ static int action_fini(struct hsm_copyaction_private **phcp,
 	return rc;
 }
 
-static int process_archive(const struct hsm_action_item *hai,
-			   const long hal_flags)
-{
-	return -1;
-}
 
-static int begin_restore(struct hsm_copyaction_private **phcp,
+static int begin_restore(struct copytool_pair *pair,
+			 struct hsm_copyaction_private **phcp,
 			 const struct hsm_action_item *hai,
 			 int mdt_index, int open_flags)
 {
 	char src[PATH_MAX];
 	int rc;
 
-	rc = llapi_hsm_action_begin(phcp, ctdata, hai, mdt_index, open_flags,
-				    false);
+	rc = llapi_hsm_action_begin(phcp, pair->ctp_ctdata, hai, mdt_index,
+				    open_flags, false);
 	if (rc < 0) {
-		lustre_fid_path(src, sizeof(src), opt.o_mnt, &hai->hai_fid);
+		lustre_fid_path(src, sizeof(src), pair->ctp_mnt,
+				&hai->hai_fid);
 		LERROR("llapi_hsm_action_begin() on '%s' failed\n", src);
 	}
 
@@ -142,447 +492,3857 @@ static inline double time_now(void)
 	return tv.tv_sec + 0.000001 * tv.tv_usec;
 }
 
-static int copy_data(struct hsm_copyaction_private *hcp, const char *src,
-		     const char *dst, int src_fd, int dst_fd,
-		     const struct hsm_action_item *hai, long hal_flags)
+/* Cookies are only unique within a file system */
+struct copy_inflight_key {
+	struct copytool_pair	*cik_pair;
+	__u64			 cik_cookie;
+};
+
+/* Action that is copying data, so that it can be canceled */
+struct copy_inflight {
+	struct copy_inflight_key ci_key;
+	/* Set when the coordinator cancels the action */
+	bool			 ci_canceled;
+	UT_hash_handle		 hh;
+};
+
+/* Hash table of the in-flight actions, indexed by cookie */
+static struct copy_inflight *inflight_table;
+static pthread_mutex_t inflight_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void inflight_add(struct copy_inflight *inflight,
+			 struct copytool_pair *pair, __u64 cookie)
 {
-	struct hsm_extent	 he;
-	__u64			 offset = hai->hai_extent.offset;
-	struct stat		 src_st;
-	struct stat		 dst_st;
-	char			*buf = NULL;
-	__u64			 write_total = 0;
-	__u64			 length = hai->hai_extent.length;
-	time_t			 last_report_time;
-	int			 rc = 0;
-	double			 start_ct_now = time_now();
-	/* Bandwidth Control */
-	time_t			start_time;
-	time_t			now;
-	time_t			last_bw_print;
+	memset(&inflight->ci_key, 0, sizeof(inflight->ci_key));
+	inflight->ci_key.cik_pair = pair;
+	inflight->ci_key.cik_cookie = cookie;
+	inflight->ci_canceled = false;
+	pthread_mutex_lock(&inflight_mutex);
+	HASH_ADD(hh, inflight_table, ci_key, sizeof(inflight->ci_key),
+		 inflight);
+	pthread_mutex_unlock(&inflight_mutex);
+}
 
-	if (fstat(src_fd, &src_st) < 0) {
-		rc = -errno;
-		LERROR("cannot stat [%s]\n", src);
-		return rc;
-	}
+static void inflight_del(struct copy_inflight *inflight)
+{
+	pthread_mutex_lock(&inflight_mutex);
+	HASH_DEL(inflight_table, inflight);
+	pthread_mutex_unlock(&inflight_mutex);
+}
 
-	if (!S_ISREG(src_st.st_mode)) {
-		rc = -EINVAL;
-		LERROR("[%s] is not a regular file\n", src);
-		return rc;
-	}
+/*
+ * The returned item is only freed by the thread processing the action, so
+ * that thread can use it without holding the lock.
+ */
+static struct copy_inflight *inflight_find(struct copytool_pair *pair,
+					   __u64 cookie)
+{
+	struct copy_inflight_key key;
+	struct copy_inflight *inflight;
 
-	if (hai->hai_extent.offset > (__u64)src_st.st_size) {
-		rc = -EINVAL;
-		LERROR("trying to start reading past end (%ju > %jd) of [%s] source file\n",
-		       (uintmax_t)hai->hai_extent.offset,
-		       (intmax_t)src_st.st_size, src);
-		return rc;
-	}
+	memset(&key, 0, sizeof(key));
+	key.cik_pair = pair;
+	key.cik_cookie = cookie;
+	pthread_mutex_lock(&inflight_mutex);
+	HASH_FIND(hh, inflight_table, &key, sizeof(key), inflight);
+	pthread_mutex_unlock(&inflight_mutex);
+	return inflight;
+}
 
-	if (fstat(dst_fd, &dst_st) < 0) {
-		rc = -errno;
-		LERROR("cannot stat [%s]\n", dst);
-		return rc;
-	}
+/* Return whether an in-flight action is found and canceled */
+static bool inflight_cancel(struct copytool_pair *pair, __u64 cookie)
+{
+	struct copy_inflight_key key;
+	struct copy_inflight *inflight;
 
-	if (!S_ISREG(dst_st.st_mode)) {
-		rc = -EINVAL;
-		LERROR("[%s] is not a regular file\n", dst);
+	memset(&key, 0, sizeof(key));
+	key.cik_pair = pair;
+	key.cik_cookie = cookie;
+	pthread_mutex_lock(&inflight_mutex);
+	HASH_FIND(hh, inflight_table, &key, sizeof(key), inflight);
+	if (inflight != NULL)
+		__atomic_store_n(&inflight->ci_canceled, true,
+				 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&inflight_mutex);
+	return inflight != NULL;
+}
+
+/* Progress of copying the data of an action */
+struct copy_progress {
+	/* NULL if the action can't be canceled */
+	struct copy_inflight		*cp_inflight;
+	struct hsm_copyaction_private	*cp_hcp;
+	const char			*cp_src;
+	const char			*cp_dst;
+	/* Extent copied since the last report */
+	struct hsm_extent		 cp_he;
+	/* Start offset of the copy */
+	__u64				 cp_offset;
+	/* Bytes copied that have been counted in the metrics */
+	__u64				 cp_counted;
+	/* Total length to copy */
+	__u64				 cp_length;
+	time_t				 cp_start_time;
+	time_t				 cp_last_report_time;
+};
+
+/* Shared by all the threads to limit the total bandwidth */
+static struct lond_token_bucket read_bucket;
+static struct lond_token_bucket write_bucket;
+
+/* Sleep if needed to honor the bandwidth limits after copying @bytes */
+static int copy_throttle(__u64 bytes)
+{
+	int rc;
+
+	rc = lond_token_bucket_throttle(&read_bucket, bytes);
+	if (rc)
 		return rc;
+	return lond_token_bucket_throttle(&write_bucket, bytes);
+}
+
+/* Range of the source that the OSTs have been advised to read ahead */
+struct copy_willread {
+	int	cw_fd;
+	/* End of the advised range */
+	__u64	cw_advised;
+	/* Set if ladvise is not supported */
+	bool	cw_disabled;
+};
+
+static void copy_willread_init(struct copy_willread *cw, int fd)
+{
+	cw->cw_fd = fd;
+	cw->cw_advised = 0;
+	cw->cw_disabled = opt.o_willread_size == 0;
+}
+
+/*
+ * Advise the OSTs to read the source ahead of @offset, not beyond @end, so
+ * that they fetch the next window while the current one is being copied.
+ * The advice is only renewed when less than half of the window is left.
+ */
+static void copy_willread(struct copy_willread *cw, __u64 offset, __u64 end)
+{
+	int rc;
+	__u64 window = opt.o_willread_size;
+	struct llapi_lu_ladvise advice;
+
+	if (cw->cw_disabled)
+		return;
+
+	if (cw->cw_advised < offset)
+		cw->cw_advised = offset;
+	if (cw->cw_advised >= end || cw->cw_advised - offset >= window / 2)
+		return;
+
+	memset(&advice, 0, sizeof(advice));
+	advice.lla_advice = LU_LADVISE_WILLREAD;
+	advice.lla_start = cw->cw_advised;
+	advice.lla_end = end - offset > window ? offset + window : end;
+	rc = llapi_ladvise(cw->cw_fd, LF_ASYNC, 1, &advice);
+	if (rc) {
+		LDEBUG("failed to advise read ahead, disabling it for the file\n");
+		cw->cw_disabled = true;
+		return;
 	}
+	cw->cw_advised = advice.lla_end;
+}
 
-	/* Don't read beyond a given extent */
-	if (length > src_st.st_size - hai->hai_extent.offset)
-		length = src_st.st_size - hai->hai_extent.offset;
+/*
+ * Report the progress to the coordinator periodically. @write_total is the
+ * number of bytes copied so far. Return negative value if the copy should
+ * be stopped, e.g. -ECANCELED if the action is canceled.
+ */
+static int copy_progress_update(struct copy_progress *progress,
+				__u64 write_total)
+{
+	int rc;
+	time_t now;
 
-	start_time = last_bw_print = last_report_time = time(NULL);
+	metrics_count(&metrics_slot()->ms_bytes,
+		      write_total - progress->cp_counted);
+	progress->cp_counted = write_total;
 
-	he.offset = offset;
-	he.length = 0;
-	rc = llapi_hsm_action_progress(hcp, &he, length, 0);
-	if (rc < 0) {
-		/* Action has been canceled or something wrong
-		 * is happening. Stop copying data.
+	if (progress->cp_inflight != NULL &&
+	    __atomic_load_n(&progress->cp_inflight->ci_canceled,
+			    __ATOMIC_RELAXED))
+		return -ECANCELED;
+
+	now = time(NULL);
+	if (now >= progress->cp_last_report_time + opt.o_report_int) {
+		progress->cp_last_report_time = now;
+		LDEBUG("%%%ju\n",
+		       (uintmax_t)(100 * write_total / progress->cp_length));
+		/* only give the length of the write since the last
+		 * progress report
 		 */
-		LERROR("progress ioctl for copy [%s]->[%s] failed\n",
-		       src, dst);
-		goto out;
+		progress->cp_he.length = progress->cp_offset + write_total -
+			progress->cp_he.offset;
+		rc = llapi_hsm_action_progress(progress->cp_hcp,
+					       &progress->cp_he,
+					       progress->cp_length, 0);
+		if (rc < 0) {
+			/* Action has been canceled or something wrong
+			 * is happening. Stop copying data.
+			 */
+			LERROR("progress ioctl for copy [%s]->[%s] failed\n",
+			       progress->cp_src, progress->cp_dst);
+			return rc;
+		}
+		progress->cp_he.offset = progress->cp_offset + write_total;
 	}
+	return 0;
+}
 
-	errno = 0;
+/* Counters of the copies for the auto-tuner, updated atomically */
+struct copy_tuner_stats {
+	/* Bytes copied */
+	__u64			 cts_bytes;
+	/* Bytes copied by the timed chunks, and the time spent on them */
+	__u64			 cts_timed_bytes;
+	__u64			 cts_timed_ns;
+	/* Bytes and time of the finished actions */
+	__u64			 cts_action_bytes;
+	__u64			 cts_action_ns;
+};
 
-	buf = malloc(opt.o_chunk_size);
-	if (buf == NULL) {
-		rc = -ENOMEM;
-		goto out;
+/*
+ * Auto-tuner of the chunk size and the number of active streams. Both are
+ * increased additively one after another, and halved once the latency of
+ * the chunks grows without more throughput in return.
+ */
+struct copy_tuner {
+	struct copy_tuner_stats	 ct_stats;
+	/* Current chunk size, read by the copying threads */
+	int			 ct_chunk_size;
+	/* Stats at the last adjustment */
+	struct copy_tuner_stats	 ct_last_stats;
+	/* Bytes per second and nanoseconds per byte of the last interval */
+	double			 ct_last_rate;
+	double			 ct_last_latency;
+	/* Whether to increase the chunk size or the streams next time */
+	bool			 ct_grow_chunk;
+	pthread_t		 ct_thread;
+	bool			 ct_started;
+	bool			 ct_stopping;
+	pthread_mutex_t		 ct_mutex;
+	pthread_cond_t		 ct_cond;
+};
+
+static struct copy_tuner tuner = {
+	.ct_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.ct_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void tuner_add(__u64 *counter, __u64 value)
+{
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+/* Size of the chunks to copy now */
+static int copy_chunk_size(void)
+{
+	return __atomic_load_n(&tuner.ct_chunk_size, __ATOMIC_RELAXED);
+}
+
+/* The buffers should be large enough for the largest chunks */
+static int copy_buf_size(void)
+{
+	return opt.o_autotune > 0 ? opt.o_max_chunk_size : opt.o_chunk_size;
+}
+
+/* Copy a chunk, and measure the latency if the auto-tuner is enabled */
+static ssize_t copy_chunk(struct lond_copy_engine *engine, int src_fd,
+			  int dst_fd, off_t offset, size_t length)
+{
+	ssize_t rc;
+	__u64 start;
+
+	if (opt.o_autotune <= 0)
+		return lond_copy_chunk(engine, src_fd, dst_fd, offset, length);
+
+	start = copy_now_ns();
+	rc = lond_copy_chunk(engine, src_fd, dst_fd, offset, length);
+	if (rc > 0 && !engine->lce_hole_skipped) {
+		tuner_add(&tuner.ct_stats.cts_bytes, rc);
+		tuner_add(&tuner.ct_stats.cts_timed_bytes, rc);
+		tuner_add(&tuner.ct_stats.cts_timed_ns, copy_now_ns() - start);
 	}
+	return rc;
+}
 
-	LDEBUG("start copy of %ju bytes from [%s] to [%s]\n",
-	       (uintmax_t)length, src, dst);
+/*
+ * O_DIRECT is only used if @shared_fds is false, since the engine changes
+ * the flags of the fds.
+ */
+static void copy_engine_init(struct lond_copy_engine *engine, bool shared_fds)
+{
+	/* Buffer is only needed if zero-copy methods are not supported */
+	lond_copy_engine_init(engine, NULL, copy_buf_size());
+	engine->lce_pool = &buf_pool;
+	/* The file to copy to has no data, skip the holes */
+	engine->lce_sparse = true;
+	engine->lce_nocache = opt.o_nocache;
+	engine->lce_direct = opt.o_nocache && !shared_fds;
+}
+
+/* Copy the data chunk by chunk with the copy engine */
+static int copy_data_engine(struct copy_progress *progress, int src_fd,
+			    int dst_fd, __u64 *write_total)
+{
+	int rc = 0;
+	__u64 offset = progress->cp_offset;
+	__u64 length = progress->cp_length;
+	struct lond_copy_engine engine;
+	struct copy_willread cw;
+
+	copy_engine_init(&engine, false);
+	copy_willread_init(&cw, src_fd);
 
-	while (write_total < length) {
-		ssize_t	rsize;
+	while (*write_total < length) {
 		ssize_t	wsize;
-		int	chunk = (length - write_total > opt.o_chunk_size) ?
-				 opt.o_chunk_size : length - write_total;
+		int	chunk = copy_chunk_size();
 
-		rsize = pread(src_fd, buf, chunk, offset);
-		if (rsize == 0)
-			/* EOF */
-			break;
+		if (chunk > length - *write_total)
+			chunk = length - *write_total;
 
-		if (rsize < 0) {
-			rc = -errno;
-			LERROR("cannot read from [%s]\n", src);
+		copy_willread(&cw, offset, progress->cp_offset + length);
+		wsize = copy_chunk(&engine, src_fd, dst_fd, offset, chunk);
+		if (wsize == 0)
+			/* EOF */
 			break;
-		}
 
-		wsize = pwrite(dst_fd, buf, rsize, offset);
 		if (wsize < 0) {
-			rc = -errno;
-			LERROR("cannot write to [%s]\n", dst);
+			rc = wsize;
+			LERROR("cannot copy from [%s] to [%s] with %s: %s\n",
+			       progress->cp_src, progress->cp_dst,
+			       lond_copy_method_name(engine.lce_method),
+			       strerror(-rc));
 			break;
 		}
 
-		write_total += wsize;
+		*write_total += wsize;
 		offset += wsize;
 
-		now = time(NULL);
-		/* sleep if needed, to honor bandwidth limits */
-		if (opt.o_bandwidth != 0) {
-			unsigned long long write_theory;
-
-			write_theory = (now - start_time) * opt.o_bandwidth;
-
-			if (write_theory < write_total) {
-				unsigned long long	excess;
-				struct timespec		delay;
-
-				excess = write_total - write_theory;
-
-				delay.tv_sec = excess / opt.o_bandwidth;
-				delay.tv_nsec = (excess % opt.o_bandwidth) *
-					NSEC_PER_SEC / opt.o_bandwidth;
-
-				if (now >= last_bw_print + opt.o_report_int) {
-					LDEBUG("bandwith control: %lluB/s excess=%llu sleep for %lld.%09lds\n",
-					       opt.o_bandwidth, excess,
-					       (long long)delay.tv_sec,
-					       delay.tv_nsec);
-					last_bw_print = now;
-				}
-
-				do {
-					rc = nanosleep(&delay, &delay);
-				} while (rc < 0 && errno == EINTR);
-				if (rc < 0) {
-					LERROR("delay for bandwidth control failed to sleep: residual=%lld.%09lds\n",
-					       (long long)delay.tv_sec,
-					       delay.tv_nsec);
-					rc = 0;
-				}
-			}
+		if (!engine.lce_hole_skipped) {
+			rc = copy_throttle(wsize);
+			if (rc < 0)
+				break;
 		}
 
-		now = time(NULL);
-		if (now >= last_report_time + opt.o_report_int) {
-			last_report_time = now;
-			LDEBUG("%%%ju\n",
-			       (uintmax_t)(100 * write_total / length));
-			/* only give the length of the write since the last
-			 * progress report
-			 */
-			he.length = offset - he.offset;
-			rc = llapi_hsm_action_progress(hcp, &he, length, 0);
-			if (rc < 0) {
-				/* Action has been canceled or something wrong
-				 * is happening. Stop copying data.
-				 */
-				LERROR("progress ioctl for copy [%s]->[%s] failed\n",
-				       src, dst);
-				goto out;
-			}
-			he.offset = offset;
-		}
-		rc = 0;
+		rc = copy_progress_update(progress, *write_total);
+		if (rc < 0)
+			break;
 	}
 
-out:
-	/*
-	 * truncate restored file
-	 * size is taken from the archive this is done to support
-	 * restore after a force release which leaves the file with the
-	 * wrong size (can big bigger than the new size)
-	 */
-	if ((hai->hai_action == HSMA_RESTORE) &&
-	    (src_st.st_size < dst_st.st_size)) {
-		/*
-		 * make sure the file is on disk before reporting success.
-		 */
-		rc = ftruncate(dst_fd, src_st.st_size);
-		if (rc < 0) {
-			rc = -errno;
-			LERROR("cannot truncate [%s] to size %jd\n",
-			       dst, (intmax_t)src_st.st_size);
-			err_major++;
-		}
-	}
+	lond_copy_engine_fini(&engine);
+	return rc;
+}
 
-	if (buf != NULL)
-		free(buf);
+/* Shared by the threads copying the ranges of a large file */
+struct copy_split {
+	struct copy_progress	*cs_progress;
+	int			 cs_src_fd;
+	int			 cs_dst_fd;
+	/* Size of each range, multiple of the stripe size */
+	__u64			 cs_range_size;
+	/* Protects the fields below */
+	pthread_mutex_t		 cs_mutex;
+	/* Start offset of the next range to copy, relative to cp_offset */
+	__u64			 cs_next;
+	/* Total bytes copied by all threads */
+	__u64			 cs_write_total;
+	/* The first error, stop all threads if set */
+	int			 cs_rc;
+};
 
-	LDEBUG("copied %ju bytes in %f seconds\n",
-	       (uintmax_t)length, time_now() - start_ct_now);
+/* Get the next range to copy, return false if no more */
+static bool copy_split_next(struct copy_split *split, __u64 *start,
+			    __u64 *end)
+{
+	bool found = false;
+	__u64 length = split->cs_progress->cp_length;
 
-	return rc;
+	pthread_mutex_lock(&split->cs_mutex);
+	if (split->cs_rc == 0 && split->cs_next < length) {
+		*start = split->cs_next;
+		*end = *start + split->cs_range_size;
+		if (*end > length)
+			*end = length;
+		split->cs_next = *end;
+		found = true;
+	}
+	pthread_mutex_unlock(&split->cs_mutex);
+	return found;
 }
 
-static int process_restore(const struct hsm_action_item *hai,
-			   const long hal_flags)
+/*
+ * Add the written bytes to cs_write_total and report the progress with the
+ * lock held, since all the threads of the split copy update them. Return
+ * non-zero if the copy should be stopped.
+ */
+static int copy_split_report(struct copy_split *split, ssize_t wsize)
 {
 	int rc;
-	char src[PATH_MAX]; /* HSM file */
-	char dst[PATH_MAX]; /* Lustre file */
-	int open_flags = 0;
-	int mdt_index = -1;
-	int src_fd = -1;
-	int dst_fd = -1;
-	int hp_flags = 0;
-	struct hsm_copyaction_private *hcp = NULL;
-	struct lond_xattr lond_xattr;
 
-	rc = llapi_get_mdt_index_by_fid(opt.o_mnt_fd, &hai->hai_fid,
-					&mdt_index);
-	if (rc < 0) {
-		LERROR("cannot get mdt index "DFID"\n", PFID(&hai->hai_fid));
-		return rc;
-	}
+	pthread_mutex_lock(&split->cs_mutex);
+	split->cs_write_total += wsize;
+	rc = split->cs_rc;
+	if (rc == 0)
+		rc = copy_progress_update(split->cs_progress,
+					  split->cs_write_total);
+	pthread_mutex_unlock(&split->cs_mutex);
+	return rc;
+}
 
-	rc = begin_restore(&hcp, hai, mdt_index, open_flags);
-	if (rc < 0) {
-		LERROR("failed to begin retore\n");
-		goto fini;
-	}
+static void *copy_split_thread(void *arg)
+{
+	int rc = 0;
+	__u64 start;
+	__u64 end;
+	ssize_t wsize;
+	struct copy_split *split = arg;
+	struct copy_progress *progress = split->cs_progress;
+	struct lond_copy_engine engine;
+	struct copy_willread cw;
 
-	lustre_fid_path(dst, sizeof(dst), opt.o_mnt, &hai->hai_fid);
-	rc = lond_read_local_xattr(dst, &lond_xattr);
-	if (rc) {
-		LERROR("failed to read local xattr of [%s]\n", dst);
-		goto fini;
+	copy_engine_init(&engine, true);
+	copy_willread_init(&cw, split->cs_src_fd);
+	while (rc == 0 && copy_split_next(split, &start, &end)) {
+		while (start < end) {
+			__u64 chunk = end - start;
+
+			if (chunk > copy_chunk_size())
+				chunk = copy_chunk_size();
+			/* Each thread only reads ahead in its own range */
+			copy_willread(&cw, progress->cp_offset + start,
+				      progress->cp_offset + end);
+			wsize = copy_chunk(&engine, split->cs_src_fd,
+					   split->cs_dst_fd,
+					   progress->cp_offset + start, chunk);
+			if (wsize <= 0) {
+				/* The source shouldn't shrink during restore */
+				rc = wsize < 0 ? wsize : -ENODATA;
+				LERROR("cannot copy from [%s] to [%s] at offset [%llu] with %s: %s\n",
+				       progress->cp_src, progress->cp_dst,
+				       (unsigned long long)
+				       (progress->cp_offset + start),
+				       lond_copy_method_name(engine.lce_method),
+				       strerror(-rc));
+				break;
+			}
+			start += wsize;
+
+			if (!engine.lce_hole_skipped) {
+				rc = copy_throttle(wsize);
+				if (rc)
+					break;
+			}
+
+			rc = copy_split_report(split, wsize);
+			if (rc)
+				break;
+		}
 	}
+	lond_copy_engine_fini(&engine);
 
-	if (!lond_xattr.lx_is_valid) {
-		LERROR("file [%s] doesn't have valid local lond xattr: %s\n",
-		       dst, lond_xattr.lx_invalid_reason);
-		rc = -ENODATA;
-		goto fini;
+	if (rc) {
+		pthread_mutex_lock(&split->cs_mutex);
+		if (split->cs_rc == 0)
+			split->cs_rc = rc;
+		pthread_mutex_unlock(&split->cs_mutex);
 	}
+	return NULL;
+}
 
-	lustre_fid_path(src, sizeof(src), opt.o_hsm_root,
-			&lond_xattr.u.lx_local.llx_global_fid);
+/* Get the size of the ranges so that each range covers whole stripes */
+static __u64 copy_split_range_size(int src_fd)
+{
+	int rc;
+	uint64_t stripe_size = 0;
+	__u64 range_size;
+	struct llapi_layout *layout;
 
-	src_fd = open(src, O_RDONLY | O_NOATIME | O_NOFOLLOW);
+	layout = llapi_layout_get_by_fd(src_fd, 0);
+	if (layout != NULL) {
+		rc = llapi_layout_stripe_size_get(layout, &stripe_size);
+		if (rc)
+			stripe_size = 0;
+		llapi_layout_free(layout);
+	}
+	if (stripe_size == 0)
+		stripe_size = LOND_STRIPE_SIZE_DEFAULT;
+
+	range_size = opt.o_chunk_size;
+	if (range_size < stripe_size)
+		range_size = stripe_size;
+	return (range_size + stripe_size - 1) / stripe_size * stripe_size;
+}
+
+/*
+ * Copy a large file by splitting it into stripe-aligned ranges. The ranges
+ * are taken in order by o_split_threads threads including the current one,
+ * so the threads read from different OSTs at the same time.
+ */
+static int copy_data_split(struct copy_progress *progress, int src_fd,
+			   int dst_fd, __u64 *write_total)
+{
+	int i;
+	int rc;
+	int started;
+	int thread_number = opt.o_split_threads - 1;
+	pthread_t *threads;
+	struct copy_split split;
+
+	threads = calloc(thread_number, sizeof(*threads));
+	if (threads == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	memset(&split, 0, sizeof(split));
+	split.cs_progress = progress;
+	split.cs_src_fd = src_fd;
+	split.cs_dst_fd = dst_fd;
+	split.cs_range_size = copy_split_range_size(src_fd);
+	pthread_mutex_init(&split.cs_mutex, NULL);
+
+	LDEBUG("copying [%s] with [%d] threads and range size [%llu]\n",
+	       progress->cp_src, opt.o_split_threads,
+	       (unsigned long long)split.cs_range_size);
+
+	for (started = 0; started < thread_number; started++) {
+		rc = pthread_create(&threads[started], NULL,
+				    copy_split_thread, &split);
+		if (rc) {
+			/* The threads already started can finish the copy */
+			LERROR("failed to create thread to copy [%s]: %s\n",
+			       progress->cp_src, strerror(rc));
+			break;
+		}
+	}
+
+	copy_split_thread(&split);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&split.cs_mutex);
+	free(threads);
+	*write_total = split.cs_write_total;
+	return split.cs_rc;
+}
+
+#ifdef HAVE_LIBURING
+/* io_uring of each worker thread, initialized when first used */
+static __thread struct lond_uring *thread_uring;
+static __thread bool thread_uring_failed;
+
+struct copy_uring_private {
+	struct copy_progress	*cup_progress;
+	int			 cup_src_fd;
+	int			 cup_dst_fd;
+	/* Bytes processed before the current data extent */
+	__u64			 cup_base;
+	/* Bytes of the current data extent that have been throttled */
+	__u64			 cup_throttled;
+	/* The current data extent */
+	__u64			 cup_data_start;
+	__u64			 cup_data_end;
+	/* Bytes of the current data extent dropped from the page cache */
+	__u64			 cup_dropped;
+	struct copy_willread	 cup_willread;
+};
+
+static void copy_uring_drop_cache(struct copy_uring_private *cup, int src_fd,
+				  int dst_fd, __u64 copied)
+{
+	int rc;
+
+	if (!opt.o_nocache || copied <= cup->cup_dropped)
+		return;
+	rc = lond_copy_drop_cache(src_fd, dst_fd,
+				  cup->cup_data_start + cup->cup_dropped,
+				  copied - cup->cup_dropped);
+	if (rc)
+		LDEBUG("failed to drop copied data of [%s] from page cache: %s\n",
+		       cup->cup_progress->cp_src, strerror(-rc));
+	cup->cup_dropped = copied;
+}
+
+static int copy_uring_progress(void *private, __u64 copied)
+{
+	int rc;
+	struct copy_uring_private *cup = private;
+
+	rc = copy_throttle(copied - cup->cup_throttled);
+	if (rc)
+		return rc;
+	/* The latency of io_uring is not comparable, only count the bytes */
+	if (opt.o_autotune > 0)
+		tuner_add(&tuner.ct_stats.cts_bytes,
+			  copied - cup->cup_throttled);
+	cup->cup_throttled = copied;
+
+	copy_willread(&cup->cup_willread, cup->cup_data_start + copied,
+		      cup->cup_data_end);
+	if (copied - cup->cup_dropped >= NOCACHE_WINDOW)
+		copy_uring_drop_cache(cup, cup->cup_src_fd, cup->cup_dst_fd,
+				      copied);
+	return copy_progress_update(cup->cup_progress,
+				    cup->cup_base + copied);
+}
+
+static void copy_uring_fini(void)
+{
+	if (thread_uring == NULL)
+		return;
+	lond_uring_fini(thread_uring);
+	free(thread_uring);
+	thread_uring = NULL;
+}
+
+/*
+ * Copy the data with multiple chunks in flight with io_uring. Return
+ * -EOPNOTSUPP if io_uring can not be used by this thread.
+ */
+static int copy_data_uring(struct copy_progress *progress, int src_fd,
+			   int dst_fd, __u64 *write_total)
+{
+	int rc;
+	off_t offset;
+	off_t end;
+	off_t data_start;
+	off_t data_end;
+	__u64 copied;
+	struct copy_uring_private cup;
+
+	if (thread_uring_failed)
+		return -EOPNOTSUPP;
+
+	if (thread_uring == NULL) {
+		thread_uring = malloc(sizeof(*thread_uring));
+		if (thread_uring == NULL)
+			return -ENOMEM;
+
+		rc = lond_uring_init(thread_uring, opt.o_uring_depth,
+				     opt.o_chunk_size);
+		if (rc) {
+			LERROR("failed to init io_uring, falling back to the copy engine\n");
+			free(thread_uring);
+			thread_uring = NULL;
+			thread_uring_failed = true;
+			return -EOPNOTSUPP;
+		}
+	}
+
+	cup.cup_progress = progress;
+	cup.cup_src_fd = src_fd;
+	cup.cup_dst_fd = dst_fd;
+	copy_willread_init(&cup.cup_willread, src_fd);
+	offset = progress->cp_offset;
+	end = offset + progress->cp_length;
+	/* Only copy the data extents, leave the holes in the dest */
+	while (offset < end) {
+		rc = lond_copy_data_extent(src_fd, offset, &data_start,
+					   &data_end);
+		if (rc == -EOPNOTSUPP) {
+			data_start = offset;
+			data_end = end;
+		} else if (rc) {
+			LERROR("failed to find data in [%s]: %s\n",
+			       progress->cp_src, strerror(-rc));
+			return rc;
+		}
+
+		if (data_end > end)
+			data_end = end;
+		/* The rest is a hole */
+		if (data_start >= data_end)
+			break;
+
+		*write_total += data_start - offset;
+		cup.cup_base = *write_total;
+		cup.cup_throttled = 0;
+		cup.cup_data_start = data_start;
+		cup.cup_data_end = data_end;
+		cup.cup_dropped = 0;
+		copy_willread(&cup.cup_willread, data_start, data_end);
+		rc = lond_uring_copy(thread_uring, src_fd, dst_fd, data_start,
+				     data_end - data_start,
+				     copy_uring_progress, &cup, &copied);
+		*write_total += copied;
+		copy_uring_drop_cache(&cup, src_fd, dst_fd, copied);
+		if (thread_uring->lu_broken) {
+			/*
+			 * Stale completions would be reaped by the next copy,
+			 * stop using io_uring in this thread.
+			 */
+			copy_uring_fini();
+			thread_uring_failed = true;
+		}
+		if (rc < 0) {
+			LERROR("cannot copy from [%s] to [%s] with io_uring: %s\n",
+			       progress->cp_src, progress->cp_dst,
+			       strerror(-rc));
+			return rc;
+		}
+
+		/* EOF */
+		if (copied < data_end - data_start)
+			break;
+		offset = data_end;
+	}
+	return 0;
+}
+#endif /* HAVE_LIBURING */
+
+static int copy_data(struct copytool_pair *pair,
+		     struct hsm_copyaction_private *hcp, const char *src,
+		     const char *dst, int src_fd, int dst_fd,
+		     const struct hsm_action_item *hai, long hal_flags,
+		     int archive_id)
+{
+	struct stat		 src_st;
+	struct stat		 dst_st;
+	struct copy_progress	 progress;
+	__u64			 write_total = 0;
+	__u64			 length = hai->hai_extent.length;
+	int			 rc = 0;
+	double			 start_ct_now = time_now();
+	__u64			 start_copy;
+
+	if (fstat(src_fd, &src_st) < 0) {
+		rc = -errno;
+		LERROR("cannot stat [%s]\n", src);
+		return rc;
+	}
+
+	if (!S_ISREG(src_st.st_mode)) {
+		rc = -EINVAL;
+		LERROR("[%s] is not a regular file\n", src);
+		return rc;
+	}
+
+	if (hai->hai_extent.offset > (__u64)src_st.st_size) {
+		rc = -EINVAL;
+		LERROR("trying to start reading past end (%ju > %jd) of [%s] source file\n",
+		       (uintmax_t)hai->hai_extent.offset,
+		       (intmax_t)src_st.st_size, src);
+		return rc;
+	}
+
+	if (fstat(dst_fd, &dst_st) < 0) {
+		rc = -errno;
+		LERROR("cannot stat [%s]\n", dst);
+		return rc;
+	}
+
+	if (!S_ISREG(dst_st.st_mode)) {
+		rc = -EINVAL;
+		LERROR("[%s] is not a regular file\n", dst);
+		return rc;
+	}
+
+	/* Don't read beyond a given extent */
+	if (length > src_st.st_size - hai->hai_extent.offset)
+		length = src_st.st_size - hai->hai_extent.offset;
+
+	memset(&progress, 0, sizeof(progress));
+	progress.cp_inflight = inflight_find(pair, hai->hai_cookie);
+	progress.cp_hcp = hcp;
+	progress.cp_src = src;
+	progress.cp_dst = dst;
+	progress.cp_offset = hai->hai_extent.offset;
+	progress.cp_length = length;
+	progress.cp_start_time = time(NULL);
+	progress.cp_last_report_time = progress.cp_start_time;
+
+	progress.cp_he.offset = progress.cp_offset;
+	progress.cp_he.length = 0;
+	rc = llapi_hsm_action_progress(hcp, &progress.cp_he, length, 0);
+	if (rc < 0) {
+		/* Action has been canceled or something wrong
+		 * is happening. Stop copying data.
+		 */
+		LERROR("progress ioctl for copy [%s]->[%s] failed\n",
+		       src, dst);
+		goto out;
+	}
+
+	errno = 0;
+
+	LDEBUG("start copy of %ju bytes from [%s] to [%s]\n",
+	       (uintmax_t)length, src, dst);
+
+	start_copy = copy_now_ns();
+	rc = -EOPNOTSUPP;
+#ifdef HAVE_LIBURING
+	if (opt.o_uring_depth > 0)
+		rc = copy_data_uring(&progress, src_fd, dst_fd, &write_total);
+#endif
+	if (rc == -EOPNOTSUPP && opt.o_split_threads > 1 &&
+	    length >= opt.o_split_size)
+		rc = copy_data_split(&progress, src_fd, dst_fd, &write_total);
+	else if (rc == -EOPNOTSUPP)
+		rc = copy_data_engine(&progress, src_fd, dst_fd, &write_total);
+	metrics_latency(MS_COPY, start_copy);
+	if (archive_id >= 0 && archive_id <= METRICS_ARCHIVE_ID_MAX)
+		metrics_count(&metrics_slot()->ms_archive_bytes[archive_id],
+			      write_total);
+
+out:
+	/*
+	 * truncate restored file
+	 * size is taken from the archive this is done to support
+	 * restore after a force release which leaves the file with the
+	 * wrong size (can big bigger than the new size). The holes in the
+	 * tail of the source are not written, so extend the file too.
+	 * Archived files need the same for the trailing holes.
+	 */
+	if (rc == 0 && (hai->hai_action == HSMA_RESTORE ||
+			hai->hai_action == HSMA_ARCHIVE) &&
+	    fstat(dst_fd, &dst_st) == 0 &&
+	    src_st.st_size != dst_st.st_size) {
+		/*
+		 * make sure the file is on disk before reporting success.
+		 */
+		rc = ftruncate(dst_fd, src_st.st_size);
+		if (rc < 0) {
+			rc = -errno;
+			LERROR("cannot truncate [%s] to size %jd\n",
+			       dst, (intmax_t)src_st.st_size);
+			__atomic_add_fetch(&err_major, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	LDEBUG("copied %ju bytes in %f seconds\n",
+	       (uintmax_t)write_total, time_now() - start_ct_now);
+	if (rc == 0 && opt.o_autotune > 0) {
+		tuner_add(&tuner.ct_stats.cts_action_bytes, write_total);
+		tuner_add(&tuner.ct_stats.cts_action_ns,
+			  (time_now() - start_ct_now) * 1000000000.0);
+	}
+
+	return rc;
+}
+
+/*
+ * Open the file on global Lustre to archive to. The data is written to the
+ * global original in place, unless it is locked by fetching, or the local
+ * file was not fetched at all. Then a new file under LOND_ARCHIVE_DIR is
+ * created, which will be used by lond_sync. The new file is written to
+ * @tmp first and then renamed to @dst, so lond_sync never uses partial data.
+ *
+ * The global original can not be replaced by rename since the local files
+ * refer to it by FID, so it is not truncated when opened. A failed archive
+ * then leaves the old data in place, and the size is fixed and the stale
+ * data in the holes is cleared only after the copy succeeds.
+ */
+static int archive_open(struct copytool_pair *pair,
+			const struct hsm_action_item *hai, const char *src,
+			mode_t mode, char *dst, int dst_size, char *tmp,
+			int tmp_size)
+{
+	int rc;
+	int fd;
+	char *dir;
+	struct lond_xattr lond_xattr;
+
+	tmp[0] = '\0';
+	rc = lond_read_local_xattr(src, &lond_xattr);
+	if (rc) {
+		LERROR("failed to read local xattr of [%s]\n", src);
+		return rc;
+	}
+
+	if (lond_xattr.lx_is_valid) {
+		lustre_fid_path(dst, dst_size, pair->ctp_hsm_root,
+				&lond_xattr.u.lx_local.llx_global_fid);
+		/* A locked inode is immutable and can't be opened to write */
+		fd = open(dst, O_WRONLY | O_NOFOLLOW);
+		if (fd >= 0)
+			return fd;
+		if (errno != EPERM && errno != ENOENT) {
+			rc = -errno;
+			LERROR("failed to open [%s] to archive [%s]: %s\n",
+			       dst, src, strerror(errno));
+			return rc;
+		}
+		LDEBUG("global original [%s] of [%s] is locked or removed\n",
+		       dst, src);
+	}
+
+	lond_archive_path(dst, dst_size, pair->ctp_hsm_root, &hai->hai_fid);
+	snprintf(tmp, tmp_size, "%s.tmp", dst);
+
+	dir = strrchr(dst, '/');
+	*dir = '\0';
+	rc = mkdir(dst, 0700);
+	if (rc < 0 && errno != EEXIST) {
+		rc = -errno;
+		LERROR("failed to create directory [%s]: %s\n", dst,
+		       strerror(errno));
+		*dir = '/';
+		return rc;
+	}
+	*dir = '/';
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode);
+	if (fd < 0) {
+		rc = -errno;
+		LERROR("failed to create [%s] to archive [%s]: %s\n", tmp,
+		       src, strerror(errno));
+		return rc;
+	}
+	return fd;
+}
+
+/* Write zeros to [@offset, @offset + @length) of @fd */
+static int archive_write_zeros(int fd, off_t offset, off_t length)
+{
+	static const char zeros[65536];
+	ssize_t written;
+	size_t size;
+
+	while (length > 0) {
+		size = length > sizeof(zeros) ? sizeof(zeros) : length;
+		written = pwrite(fd, zeros, size, offset);
+		if (written < 0)
+			return -errno;
+		offset += written;
+		length -= written;
+	}
+	return 0;
+}
+
+/*
+ * The holes of the source are not written by the copy, so clear the old
+ * data of the global original in the same ranges after archiving in place.
+ */
+static int archive_clear_holes(const char *src, const char *dst, int src_fd,
+			       int dst_fd)
+{
+	int rc;
+	off_t offset = 0;
+	off_t data_start;
+	off_t data_end;
+	struct stat src_st;
+	struct stat dst_st;
+
+	if (fstat(src_fd, &src_st) < 0 || fstat(dst_fd, &dst_st) < 0) {
+		rc = -errno;
+		LERROR("cannot stat [%s] or [%s]: %s\n", src, dst,
+		       strerror(-rc));
+		return rc;
+	}
+
+	while (offset < src_st.st_size && offset < dst_st.st_size) {
+		rc = lond_copy_data_extent(src_fd, offset, &data_start,
+					   &data_end);
+		/* All of the data was copied without looking for holes */
+		if (rc == -EOPNOTSUPP)
+			return 0;
+		if (rc) {
+			LERROR("failed to find data in [%s]: %s\n", src,
+			       strerror(-rc));
+			return rc;
+		}
+
+		if (data_start > dst_st.st_size)
+			data_start = dst_st.st_size;
+		if (data_start > offset) {
+			rc = fallocate(dst_fd, FALLOC_FL_PUNCH_HOLE |
+				       FALLOC_FL_KEEP_SIZE, offset,
+				       data_start - offset);
+			if (rc < 0 && errno == EOPNOTSUPP)
+				rc = archive_write_zeros(dst_fd, offset,
+							 data_start - offset);
+			else if (rc < 0)
+				rc = -errno;
+			if (rc) {
+				LERROR("cannot clear [%jd, %jd) of [%s]: %s\n",
+				       (intmax_t)offset, (intmax_t)data_start,
+				       dst, strerror(-rc));
+				return rc;
+			}
+		}
+
+		if (data_end <= offset)
+			break;
+		offset = data_end;
+	}
+	return 0;
+}
+
+/* Copy the data of the local file back to global Lustre */
+static int process_archive(struct copytool_pair *pair,
+			   const struct hsm_action_item *hai,
+			   const long hal_flags, int archive_id)
+{
+	int rc;
+	char src[PATH_MAX]; /* Lustre file */
+	char dst[PATH_MAX]; /* Global Lustre file */
+	char tmp[PATH_MAX + 5];
+	int src_fd = -1;
+	int dst_fd = -1;
+	int hp_flags = 0;
+	struct stat src_st;
+	struct hsm_copyaction_private *hcp = NULL;
+	__u64 start = copy_now_ns();
+
+	lustre_fid_path(src, sizeof(src), pair->ctp_mnt, &hai->hai_fid);
+	tmp[0] = '\0';
+	rc = llapi_hsm_action_begin(&hcp, pair->ctp_ctdata, hai, -1, 0, false);
+	if (rc < 0) {
+		LERROR("llapi_hsm_action_begin() on [%s] failed\n", src);
+		goto fini;
+	}
+
+	src_fd = llapi_hsm_action_get_fd(hcp);
 	if (src_fd < 0) {
+		rc = src_fd;
+		LERROR("cannot open [%s] for read\n", src);
+		goto fini;
+	}
+
+	if (fstat(src_fd, &src_st) < 0) {
 		rc = -errno;
-		LERROR("cannot open [%s] for read", src, strerror(errno));
+		LERROR("cannot stat [%s]: %s\n", src, strerror(errno));
 		goto fini;
 	}
 
-	dst_fd = llapi_hsm_action_get_fd(hcp);
-	if (dst_fd < 0) {
-		rc = dst_fd;
-		LERROR("cannot open [%s] for write\n", dst);
-		goto fini;
+	dst_fd = archive_open(pair, hai, src, src_st.st_mode & 07777, dst,
+			      sizeof(dst), tmp, sizeof(tmp));
+	if (dst_fd < 0) {
+		rc = dst_fd;
+		goto fini;
+	}
+	metrics_latency(MS_OPEN, start);
+
+	rc = copy_data(pair, hcp, src, dst, src_fd, dst_fd, hai, hal_flags,
+		       archive_id);
+	if (rc == -ECANCELED) {
+		LINFO("archive of [%s] is canceled\n", src);
+		goto fini;
+	} else if (rc < 0) {
+		LERROR("cannot copy data from [%s] to [%s]\n", src, dst);
+		__atomic_add_fetch(&err_major, 1, __ATOMIC_RELAXED);
+		if (rc == -ETIMEDOUT)
+			hp_flags |= HP_FLAG_RETRY;
+		goto fini;
+	}
+
+	if (tmp[0] == '\0') {
+		rc = archive_clear_holes(src, dst, src_fd, dst_fd);
+		if (rc)
+			goto fini;
+	}
+
+	/* The file will be marked as archived, so make sure it is on disk */
+	if (fsync(dst_fd) < 0) {
+		rc = -errno;
+		LERROR("cannot sync [%s]: %s\n", dst, strerror(errno));
+		goto fini;
+	}
+
+	if (tmp[0] != '\0') {
+		rc = rename(tmp, dst);
+		if (rc < 0) {
+			rc = -errno;
+			LERROR("cannot rename [%s] to [%s]: %s\n", tmp, dst,
+			       strerror(errno));
+			goto fini;
+		}
+		tmp[0] = '\0';
+	}
+	LDEBUG("archived [%s] to [%s]\n", src, dst);
+
+fini:
+	if (dst_fd >= 0)
+		close(dst_fd);
+	if (tmp[0] != '\0' && dst_fd >= 0)
+		unlink(tmp);
+	rc = action_fini(pair, &hcp, hai, hp_flags, rc);
+	if (!(src_fd < 0))
+		close(src_fd);
+
+	return rc;
+}
+
+static bool action_is_bulk(const struct hsm_action_item *hai)
+{
+	size_t data_len = hai->hai_len - sizeof(*hai);
+	size_t bulk_len = strlen(LOND_HSM_DATA_BULK);
+
+	return data_len >= bulk_len &&
+	       memcmp(hai->hai_data, LOND_HSM_DATA_BULK, bulk_len) == 0;
+}
+
+/*
+ * Find the entry after @name in @dirp, or continue where the last readahead
+ * of the same directory stopped, so that the files restored one after the
+ * other don't read the directory from the start again and again.
+ */
+static bool readahead_locate(struct copytool_pair *pair, DIR *dirp,
+			     const char *dir, const char *name)
+{
+	struct dirent *ent;
+	bool resume = false;
+	long pos = 0;
+	int i;
+
+	pthread_mutex_lock(&pair->ctp_readahead_mutex);
+	if (strcmp(pair->ctp_readahead_dir, dir) == 0) {
+		resume = true;
+		pos = pair->ctp_readahead_pos;
+	}
+	pthread_mutex_unlock(&pair->ctp_readahead_mutex);
+
+	if (resume) {
+		seekdir(dirp, pos);
+		return true;
+	}
+
+	for (i = 0; i < READAHEAD_LOCATE_MAX; i++) {
+		ent = readdir(dirp);
+		if (ent == NULL)
+			return false;
+		if (strcmp(ent->d_name, name) == 0)
+			return true;
+	}
+	LDEBUG("[%s] not found in the first [%d] entries of [%s]\n", name,
+	       READAHEAD_LOCATE_MAX, dir);
+	return false;
+}
+
+/*
+ * Request restores of the released files following the file to restore in
+ * the same directory, by the order of the directory. The requests are
+ * marked as bulk so they don't delay the restores that the jobs are waiting
+ * for. At most READAHEAD_SCAN_FACTOR times o_readahead_files siblings are
+ * examined, whether they are released or not. The siblings whose restores
+ * are requested already count toward the window, so the following restores
+ * don't request ever more files.
+ */
+static void restore_readahead(struct copytool_pair *pair,
+			      const struct hsm_action_item *hai)
+{
+	int rc;
+	int examined;
+	int queued = 0;
+	int requested = 0;
+	int linkno = 0;
+	long long recno = -1;
+	char *name;
+	char *subdir;
+	char fid_str[64];
+	char path[PATH_MAX];
+	char dir[PATH_MAX + MAX_OBD_NAME + 2];
+	char sibling[PATH_MAX * 2 + MAX_OBD_NAME + 3];
+	DIR *dirp;
+	struct dirent *ent;
+	struct stat sb;
+	struct lu_fid fid;
+	struct hsm_user_state hus;
+	struct hsm_current_action hca;
+	unsigned long long bytes = 0;
+
+	snprintf(fid_str, sizeof(fid_str), DFID_NOBRACE, PFID(&hai->hai_fid));
+	rc = llapi_fid2path(pair->ctp_mnt, fid_str, path, sizeof(path), &recno,
+			    &linkno);
+	if (rc) {
+		LDEBUG("failed to get path of "DFID": %s\n",
+		       PFID(&hai->hai_fid), strerror(-rc));
+		return;
+	}
+
+	name = strrchr(path, '/');
+	if (name == NULL) {
+		snprintf(dir, sizeof(dir), "%s", pair->ctp_mnt);
+		subdir = "";
+		name = path;
+	} else {
+		*name = '\0';
+		name++;
+		snprintf(dir, sizeof(dir), "%s/%s", pair->ctp_mnt, path);
+		subdir = path;
+	}
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		LDEBUG("failed to open directory [%s]: %s\n", dir,
+		       strerror(errno));
+		return;
+	}
+
+	if (!readahead_locate(pair, dirp, subdir, name))
+		goto out_close;
+
+	for (examined = 0;
+	     examined < opt.o_readahead_files * READAHEAD_SCAN_FACTOR &&
+	     requested + queued < opt.o_readahead_files &&
+	     bytes < opt.o_readahead_bytes; examined++) {
+		ent = readdir(dirp);
+		if (ent == NULL)
+			break;
+		if (ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN)
+			continue;
+		if (fstatat(dirfd(dirp), ent->d_name, &sb,
+			    AT_SYMLINK_NOFOLLOW) || !S_ISREG(sb.st_mode))
+			continue;
+		snprintf(sibling, sizeof(sibling), "%s/%s", dir, ent->d_name);
+		if (llapi_hsm_state_get(sibling, &hus) ||
+		    !(hus.hus_states & HS_RELEASED))
+			continue;
+		if (llapi_hsm_current_action(sibling, &hca))
+			continue;
+		/* Restore requested already */
+		if (hca.hca_action != HUA_NONE) {
+			requested++;
+			bytes += sb.st_size;
+			continue;
+		}
+		if (llapi_path2fid(sibling, &fid))
+			continue;
+		if (lond_hsm_batch_add(&pair->ctp_readahead_batch, &fid))
+			break;
+		queued++;
+		bytes += sb.st_size;
+	}
+
+	pthread_mutex_lock(&pair->ctp_readahead_mutex);
+	snprintf(pair->ctp_readahead_dir, sizeof(pair->ctp_readahead_dir),
+		 "%s", subdir);
+	pair->ctp_readahead_pos = telldir(dirp);
+	pthread_mutex_unlock(&pair->ctp_readahead_mutex);
+out_close:
+	closedir(dirp);
+
+	if (queued == 0)
+		return;
+	lond_hsm_batch_flush(&pair->ctp_readahead_batch);
+	LDEBUG("requested restores of [%d] siblings of [%s/%s]\n", queued,
+	       dir, name);
+}
+
+/* Only the restores of the jobs, not the ones for readahead */
+static bool restore_wants_readahead(const struct hsm_action_item *hai)
+{
+	return opt.o_readahead_files > 0 && hai->hai_action == HSMA_RESTORE &&
+	       !action_is_bulk(hai);
+}
+
+static int process_restore(struct copytool_pair *pair,
+			   const struct hsm_action_item *hai,
+			   const long hal_flags, int archive_id)
+{
+	int rc;
+	char src[PATH_MAX]; /* HSM file */
+	char dst[PATH_MAX]; /* Lustre file */
+	int open_flags = 0;
+	int mdt_index = -1;
+	int src_fd = -1;
+	int dst_fd = -1;
+	int hp_flags = 0;
+	struct hsm_copyaction_private *hcp = NULL;
+	struct lond_xattr lond_xattr;
+	__u64 start = copy_now_ns();
+
+	rc = llapi_get_mdt_index_by_fid(pair->ctp_mnt_fd, &hai->hai_fid,
+					&mdt_index);
+	if (rc < 0) {
+		LERROR("cannot get mdt index "DFID"\n", PFID(&hai->hai_fid));
+		return rc;
+	}
+
+	rc = begin_restore(pair, &hcp, hai, mdt_index, open_flags);
+	if (rc < 0) {
+		LERROR("failed to begin retore\n");
+		goto fini;
+	}
+
+	lustre_fid_path(dst, sizeof(dst), pair->ctp_mnt, &hai->hai_fid);
+	rc = lond_read_local_xattr(dst, &lond_xattr);
+	if (rc) {
+		LERROR("failed to read local xattr of [%s]\n", dst);
+		goto fini;
+	}
+
+	if (!lond_xattr.lx_is_valid) {
+		LERROR("file [%s] doesn't have valid local lond xattr: %s\n",
+		       dst, lond_xattr.lx_invalid_reason);
+		rc = -ENODATA;
+		goto fini;
+	}
+
+	lustre_fid_path(src, sizeof(src), pair->ctp_hsm_root,
+			&lond_xattr.u.lx_local.llx_global_fid);
+
+	src_fd = open(src, O_RDONLY | O_NOATIME | O_NOFOLLOW);
+	if (src_fd < 0) {
+		rc = -errno;
+		LERROR("cannot open [%s] for read", src, strerror(errno));
+		goto fini;
+	}
+
+	dst_fd = llapi_hsm_action_get_fd(hcp);
+	if (dst_fd < 0) {
+		rc = dst_fd;
+		LERROR("cannot open [%s] for write\n", dst);
+		goto fini;
+	}
+	metrics_latency(MS_OPEN, start);
+
+	rc = copy_data(pair, hcp, src, dst, src_fd, dst_fd, hai, hal_flags,
+		       archive_id);
+	if (rc == -ECANCELED) {
+		LINFO("restore of [%s] is canceled\n", dst);
+		goto fini;
+	} else if (rc < 0) {
+		LERROR("cannot copy data from [%s] to [%s]",
+		       src, dst);
+		__atomic_add_fetch(&err_major, 1, __ATOMIC_RELAXED);
+		if (rc == -ETIMEDOUT)
+			hp_flags |= HP_FLAG_RETRY;
+		goto fini;
+	}
+
+fini:
+	rc = action_fini(pair, &hcp, hai, hp_flags, rc);
+
+	/* object swaping is done by cdt at copy end, so close of volatile file
+	 * cannot be done before
+	 */
+	if (!(src_fd < 0))
+		close(src_fd);
+
+	return rc;
+}
+
+/*
+ * The copy on global Lustre is the original data shared with others, so
+ * it is never removed. Instead, drop the link from the local file to the
+ * global original, so that lond_sync copies the data rather than linking
+ * the original. The data archived to LOND_ARCHIVE_DIR is removed too. The
+ * coordinator clears the HSM archive state when the action is finished.
+ */
+static int process_remove(struct copytool_pair *pair,
+			  const struct hsm_action_item *hai,
+			  const long hal_flags)
+{
+	int rc;
+	char path[PATH_MAX];
+	struct hsm_user_state hus;
+
+	/* The local file might have been removed, which is fine */
+	lustre_fid_path(path, sizeof(path), pair->ctp_mnt, &hai->hai_fid);
+	rc = llapi_hsm_state_get(path, &hus);
+	if (rc == 0 && (hus.hus_states & HS_RELEASED)) {
+		/* The data of the file would be lost */
+		rc = -EBUSY;
+		LERROR("can't remove the archive of released file [%s]\n",
+		       path);
+		goto fini;
+	} else if (rc == 0) {
+		rc = removexattr(path, XATTR_NAME_LOND_LOCAL);
+		if (rc < 0 && errno != ENOATTR && errno != ENOENT) {
+			rc = -errno;
+			LERROR("failed to remove xattr [%s] of [%s]: %s\n",
+			       XATTR_NAME_LOND_LOCAL, path, strerror(errno));
+			goto fini;
+		}
+	} else if (rc != -ENOENT) {
+		LERROR("failed to get HSM state of [%s]: %s\n", path,
+		       strerror(-rc));
+		goto fini;
+	}
+
+	lond_archive_path(path, sizeof(path), pair->ctp_hsm_root,
+			  &hai->hai_fid);
+	rc = unlink(path);
+	if (rc < 0 && errno != ENOENT) {
+		rc = -errno;
+		LERROR("failed to remove archived file [%s]: %s\n", path,
+		       strerror(errno));
+		goto fini;
+	}
+	rc = 0;
+	LDEBUG("removed archive of "DFID"\n", PFID(&hai->hai_fid));
+fini:
+	if (rc)
+		__atomic_add_fetch(&err_minor, 1, __ATOMIC_RELAXED);
+	return action_fini(pair, NULL, hai, 0, rc);
+}
+
+static int process_item(struct copytool_pair *pair,
+			struct hsm_action_item *hai, const long hal_flags,
+			int archive_id)
+{
+	int rc;
+
+	switch (hai->hai_action) {
+	/* set err_major, minor inside these functions */
+	case HSMA_ARCHIVE:
+		rc = process_archive(pair, hai, hal_flags, archive_id);
+		break;
+	case HSMA_RESTORE:
+		rc = process_restore(pair, hai, hal_flags, archive_id);
+		break;
+	case HSMA_REMOVE:
+		rc = process_remove(pair, hai, hal_flags);
+		break;
+	case HSMA_CANCEL:
+		/* Handled when received, see process_cancel() */
+		return 0;
+	default:
+		rc = -EINVAL;
+		LERROR("unknown action [%d] on [%s]\n", hai->hai_action,
+		       pair->ctp_mnt);
+		__atomic_add_fetch(&err_minor, 1, __ATOMIC_RELAXED);
+		action_fini(pair, NULL, hai, 0, rc);
+	}
+
+	return rc;
+}
+
+struct thread_data {
+	/* Linked into cq_items, cq_unresolved or cq_resolving */
+	struct lond_list_head	 linkage;
+	struct copytool_pair	*pair;
+	long			 hal_flags;
+	int			 archive_id;
+	enum copytool_priority	 priority;
+	/* When the item is queued */
+	time_t			 queue_time;
+	/* Monotonic time in nanoseconds when the item is queued */
+	__u64			 queue_ns;
+	/* Added to inflight_table when the item is taken from the queue */
+	struct copy_inflight	 inflight;
+	/* OST of the first stripe of the source to restore, -1 if unknown */
+	int			 ost_index;
+	/* The priority depends on the size, which is not known yet */
+	bool			 resolve_priority;
+	/* The OST index is not known yet */
+	bool			 resolve_ost;
+	/* Canceled while being resolved, finished by the resolving worker */
+	bool			 canceled;
+	struct hsm_action_item	*hai;
+};
+
+/*
+ * Return whether the FID has been requested in the last RECENT_FID_PERIOD
+ * seconds, and record this request.
+ */
+static bool recent_fid_check(const struct lu_fid *fid, time_t now)
+{
+	struct recent_fid *recent;
+	struct recent_fid *tmp;
+	bool found = false;
+
+	lond_list_for_each_entry_safe(recent, tmp, &recent_fid_list,
+				      rf_linkage) {
+		if (recent->rf_time + RECENT_FID_PERIOD > now)
+			break;
+		lond_list_del(&recent->rf_linkage);
+		HASH_DEL(recent_fid_table, recent);
+		free(recent);
+	}
+
+	HASH_FIND(hh, recent_fid_table, fid, sizeof(*fid), recent);
+	if (recent != NULL) {
+		found = true;
+		lond_list_del(&recent->rf_linkage);
+	} else {
+		recent = calloc(1, sizeof(*recent));
+		/* Not a big deal, only loses the priority of next request */
+		if (recent == NULL)
+			return false;
+		recent->rf_fid = *fid;
+		HASH_ADD(hh, recent_fid_table, rf_fid, sizeof(recent->rf_fid),
+			 recent);
+	}
+	recent->rf_time = now;
+	lond_list_add_tail(&recent->rf_linkage, &recent_fid_list);
+	return found;
+}
+
+static void recent_fid_fini(void)
+{
+	struct recent_fid *recent;
+	struct recent_fid *tmp;
+
+	lond_list_for_each_entry_safe(recent, tmp, &recent_fid_list,
+				      rf_linkage) {
+		lond_list_del(&recent->rf_linkage);
+		HASH_DEL(recent_fid_table, recent);
+		free(recent);
+	}
+}
+
+/*
+ * Set the priority of the item when it is received. Return false if the
+ * priority depends on the size of the file, which is left to the workers.
+ */
+static bool action_priority(struct thread_data *data, time_t now)
+{
+	const struct hsm_action_item *hai = data->hai;
+
+	if (hai->hai_action == HSMA_REMOVE) {
+		data->priority = CP_PRIORITY_REMOVE;
+		return true;
+	}
+	if (hai->hai_action != HSMA_RESTORE || action_is_bulk(hai)) {
+		data->priority = CP_PRIORITY_LOW;
+		return true;
+	}
+	/* Somebody is probably waiting for the retried restore */
+	if (recent_fid_check(&hai->hai_fid, now)) {
+		data->priority = CP_PRIORITY_URGENT;
+		return true;
+	}
+	data->priority = CP_PRIORITY_NORMAL;
+	return false;
+}
+
+/* Get the priority of a restore by its size, called by the workers */
+static enum copytool_priority action_size_priority(struct copytool_pair *pair,
+					const struct hsm_action_item *hai,
+					unsigned long long small_size)
+{
+	struct stat sb;
+	char path[PATH_MAX];
+
+	/* The released file keeps the size of the archived file */
+	lustre_fid_path(path, sizeof(path), pair->ctp_mnt, &hai->hai_fid);
+	if (stat(path, &sb) == 0 && sb.st_size < small_size)
+		return CP_PRIORITY_HIGH;
+	return CP_PRIORITY_NORMAL;
+}
+
+/* Get the OST of the first stripe of the restore source, -1 if unknown */
+static int action_ost_index(struct copytool_pair *pair,
+			    const struct hsm_action_item *hai)
+{
+	int rc;
+	uint64_t index;
+	char path[PATH_MAX];
+	struct llapi_layout *layout;
+	struct lond_xattr lond_xattr;
+
+	lustre_fid_path(path, sizeof(path), pair->ctp_mnt, &hai->hai_fid);
+	rc = lond_read_local_xattr(path, &lond_xattr);
+	if (rc || !lond_xattr.lx_is_valid)
+		return -1;
+
+	lustre_fid_path(path, sizeof(path), pair->ctp_hsm_root,
+			&lond_xattr.u.lx_local.llx_global_fid);
+	layout = llapi_layout_get_by_path(path, 0);
+	if (layout == NULL)
+		return -1;
+	rc = llapi_layout_ost_index_get(layout, 0, &index);
+	llapi_layout_free(layout);
+	if (rc)
+		return -1;
+	return index;
+}
+
+/* Return the number of running restores of the OST with queue lock held */
+static int ost_streams_running(int index)
+{
+	struct ost_streams *streams;
+
+	if (index < 0)
+		return 0;
+	HASH_FIND_INT(queue.cq_ost_streams, &index, streams);
+	return streams == NULL ? 0 : streams->os_running;
+}
+
+static void ost_streams_update(int index, int delta)
+{
+	struct ost_streams *streams;
+
+	if (index < 0)
+		return;
+	HASH_FIND_INT(queue.cq_ost_streams, &index, streams);
+	if (streams == NULL) {
+		streams = calloc(1, sizeof(*streams));
+		/* Not a big deal, only loses the limit of this OST */
+		if (streams == NULL)
+			return;
+		streams->os_index = index;
+		HASH_ADD_INT(queue.cq_ost_streams, os_index, streams);
+	}
+	streams->os_running += delta;
+}
+
+static void ost_streams_fini(void)
+{
+	struct ost_streams *streams;
+	struct ost_streams *tmp;
+
+	HASH_ITER(hh, queue.cq_ost_streams, streams, tmp) {
+		HASH_DEL(queue.cq_ost_streams, streams);
+		free(streams);
+	}
+}
+
+/*
+ * Choose the item of a class with queue.cq_mutex held. Skip the items whose
+ * OST already has o_ost_streams restores running, and prefer the OST with
+ * the fewest running restores, so the restores are spread over the OSTs.
+ * The items are in the order of queueing, and the oldest one that has
+ * waited for o_priority_age seconds is chosen regardless of how busy its
+ * OST is, so the items of a busy OST are not bypassed forever.
+ */
+static struct thread_data *queue_pick_class(struct lond_list_head *head,
+					    time_t now)
+{
+	int running;
+	int best_running = 0;
+	struct thread_data *data;
+	struct thread_data *best = NULL;
+
+	lond_list_for_each_entry(data, head, linkage) {
+		running = ost_streams_running(data->ost_index);
+		if (opt.o_ost_streams > 0 && running >= opt.o_ost_streams)
+			continue;
+		if (now - data->queue_time >= opt.o_priority_age)
+			return data;
+		if (best == NULL || running < best_running) {
+			best = data;
+			best_running = running;
+			if (running == 0)
+				break;
+		}
+	}
+	return best;
+}
+
+/*
+ * Choose the item to process next with queue.cq_mutex held. An item
+ * waiting for o_priority_age seconds is promoted by one class, so nothing
+ * starves. Return NULL if all the queued items are limited by their OSTs.
+ */
+static struct thread_data *queue_pick(time_t now)
+{
+	int i;
+	long score;
+	long best_score = 0;
+	struct thread_data *data;
+	struct thread_data *best = NULL;
+
+	for (i = 0; i < CP_PRIORITY_NUMBER; i++) {
+		data = queue_pick_class(&queue.cq_items[i], now);
+		if (data == NULL)
+			continue;
+		score = (long)i * opt.o_priority_age -
+			(now - data->queue_time);
+		if (best == NULL || score < best_score) {
+			best = data;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+/* Wake up the main loop waiting for a free slot with queue.cq_mutex held */
+static void queue_signal_not_full(void)
+{
+	__u64 value = 1;
+
+	if (!queue.cq_full || queue.cq_not_full_fd < 0)
+		return;
+	/* Can only fail if the counter overflows, which can't happen */
+	if (write(queue.cq_not_full_fd, &value, sizeof(value)) ==
+	    sizeof(value))
+		queue.cq_full = false;
+}
+
+/*
+ * Resolve the size and the OST of the first unresolved item, and move it to
+ * the list of its class. Called and returns with queue.cq_mutex held, but
+ * the lock is released during the resolving.
+ */
+static void queue_resolve(void)
+{
+	struct thread_data *data;
+	unsigned long long small_size = opt.o_small_size;
+	enum copytool_priority priority = CP_PRIORITY_NORMAL;
+	int ost_index = -1;
+
+	data = lond_list_entry(queue.cq_unresolved.next, struct thread_data,
+			       linkage);
+	lond_list_move_tail(&data->linkage, &queue.cq_resolving);
+	pthread_mutex_unlock(&queue.cq_mutex);
+
+	/* The item is only read by the others while on cq_resolving */
+	if (data->resolve_priority)
+		priority = action_size_priority(data->pair, data->hai,
+						small_size);
+	if (data->resolve_ost)
+		ost_index = action_ost_index(data->pair, data->hai);
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	lond_list_del(&data->linkage);
+	if (data->canceled) {
+		queue.cq_count--;
+		queue_signal_not_full();
+		pthread_mutex_unlock(&queue.cq_mutex);
+
+		action_fini(data->pair, NULL, data->hai, 0, -ECANCELED);
+		free(data->hai);
+		free(data);
+		pthread_mutex_lock(&queue.cq_mutex);
+		return;
+	}
+
+	/* Otherwise, the priority might have been promoted meanwhile */
+	if (data->resolve_priority)
+		data->priority = priority;
+	if (data->resolve_ost)
+		data->ost_index = ost_index;
+	data->resolve_priority = false;
+	data->resolve_ost = false;
+	LDEBUG("resolved action [%d] on "DFID" with priority [%d], OST [%d]\n",
+	       data->hai->hai_action, PFID(&data->hai->hai_fid),
+	       data->priority, data->ost_index);
+	lond_list_add_tail(&data->linkage, &queue.cq_items[data->priority]);
+	pthread_cond_broadcast(&queue.cq_not_empty);
+}
+
+/* Get an item from the queue, return NULL if the queue is stopped */
+static struct thread_data *queue_get(void)
+{
+	struct thread_data *data = NULL;
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	while (1) {
+		/* Resolving doesn't take a stream, do it before the limit */
+		if (!lond_list_empty(&queue.cq_unresolved)) {
+			queue_resolve();
+			continue;
+		}
+
+		/* Finish the queued items even if stopping */
+		if (queue.cq_count > 0 &&
+		    queue.cq_active < queue.cq_active_limit) {
+			data = queue_pick(time(NULL));
+			if (data != NULL)
+				break;
+		} else if (queue.cq_stopping) {
+			break;
+		}
+		pthread_cond_wait(&queue.cq_not_empty, &queue.cq_mutex);
+	}
+
+	if (data != NULL) {
+		lond_list_del(&data->linkage);
+		/* With the queue lock, so a cancel can find it either way */
+		inflight_add(&data->inflight, data->pair,
+			     data->hai->hai_cookie);
+		ost_streams_update(data->ost_index, 1);
+		queue.cq_active++;
+		queue.cq_count--;
+		metrics_latency(MS_QUEUE_WAIT, data->queue_ns);
+		queue_signal_not_full();
+	}
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return data;
+}
+
+/* The item is finished, let the waiting threads pick the items of its OST */
+static void queue_put(struct thread_data *data)
+{
+	pthread_mutex_lock(&queue.cq_mutex);
+	queue.cq_active--;
+	ost_streams_update(data->ost_index, -1);
+	pthread_cond_broadcast(&queue.cq_not_empty);
+	pthread_mutex_unlock(&queue.cq_mutex);
+}
+
+static void *process_thread(void *arg)
+{
+	struct thread_data *data;
+	int rc;
+
+	thread_metrics = arg;
+
+	while ((data = queue_get()) != NULL) {
+		rc = process_item(data->pair, data->hai, data->hal_flags,
+				  data->archive_id);
+		inflight_del(&data->inflight);
+		queue_put(data);
+		/*
+		 * Scan the siblings after the restore is finished and its
+		 * slots of the queue and the OST are released, so neither the
+		 * job nor the other restores wait for the metadata work.
+		 */
+		if (rc == 0 && restore_wants_readahead(data->hai))
+			restore_readahead(data->pair, data->hai);
+		free(data->hai);
+		free(data);
+	}
+#ifdef HAVE_LIBURING
+	copy_uring_fini();
+#endif
+	return NULL;
+}
+
+/*
+ * Cancel the action with the same cookie. A queued action is finished right
+ * away. An in-flight action stops at the next chunk, and the thread
+ * processing it finishes it. Don't report anything to coordinator for the
+ * cancel itself.
+ */
+static int process_cancel(struct copytool_pair *pair,
+			  const struct hsm_action_item *hai)
+{
+	int i;
+	bool canceled;
+	struct lond_list_head *head;
+	struct thread_data *data;
+	struct thread_data *found = NULL;
+
+	metrics_count(&metrics_slot()->ms_cancels, 1);
+	pthread_mutex_lock(&queue.cq_mutex);
+	lond_list_for_each_entry(data, &queue.cq_resolving, linkage) {
+		if (data->pair == pair &&
+		    data->hai->hai_cookie == hai->hai_cookie) {
+			/* The resolving worker finishes it */
+			data->canceled = true;
+			pthread_mutex_unlock(&queue.cq_mutex);
+			LINFO("canceling queued action with cookie [%#jx], FID="DFID"\n",
+			      (uintmax_t)hai->hai_cookie, PFID(&hai->hai_fid));
+			return 0;
+		}
+	}
+	for (i = 0; i <= CP_PRIORITY_NUMBER && found == NULL; i++) {
+		head = i < CP_PRIORITY_NUMBER ? &queue.cq_items[i] :
+		       &queue.cq_unresolved;
+		lond_list_for_each_entry(data, head, linkage) {
+			if (data->pair == pair &&
+			    data->hai->hai_cookie == hai->hai_cookie) {
+				found = data;
+				break;
+			}
+		}
+	}
+	if (found != NULL) {
+		lond_list_del(&found->linkage);
+		queue.cq_count--;
+		queue_signal_not_full();
+		canceled = false;
+	} else {
+		canceled = inflight_cancel(pair, hai->hai_cookie);
+	}
+	pthread_mutex_unlock(&queue.cq_mutex);
+
+	if (canceled) {
+		LINFO("canceling in-flight action with cookie [%#jx], FID="DFID"\n",
+		      (uintmax_t)hai->hai_cookie, PFID(&hai->hai_fid));
+		return 0;
+	}
+
+	if (found == NULL) {
+		/* Finished already */
+		LDEBUG("no action with cookie [%#jx] to cancel, FID="DFID"\n",
+		       (uintmax_t)hai->hai_cookie, PFID(&hai->hai_fid));
+		return 0;
+	}
+
+	LINFO("canceling queued action with cookie [%#jx], FID="DFID"\n",
+	      (uintmax_t)hai->hai_cookie, PFID(&hai->hai_fid));
+	action_fini(pair, NULL, found->hai, 0, -ECANCELED);
+	free(found->hai);
+	free(found);
+	return 0;
+}
+
+/* Cancel all the queued and in-flight actions */
+static void queue_cancel_all(void)
+{
+	struct thread_data *data, *n;
+	struct copy_inflight *inflight, *tmp;
+	struct lond_list_head canceled;
+	int i;
+
+	LOND_INIT_LIST_HEAD(&canceled);
+	pthread_mutex_lock(&queue.cq_mutex);
+	for (i = 0; i < CP_PRIORITY_NUMBER; i++)
+		lond_list_splice_init(&queue.cq_items[i], &canceled);
+	lond_list_splice_init(&queue.cq_unresolved, &canceled);
+	/* The items being resolved are finished by the resolving workers */
+	queue.cq_count = 0;
+	lond_list_for_each_entry(data, &queue.cq_resolving, linkage) {
+		data->canceled = true;
+		queue.cq_count++;
+	}
+	queue_signal_not_full();
+
+	pthread_mutex_lock(&inflight_mutex);
+	HASH_ITER(hh, inflight_table, inflight, tmp)
+		__atomic_store_n(&inflight->ci_canceled, true,
+				 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&inflight_mutex);
+	pthread_mutex_unlock(&queue.cq_mutex);
+
+	lond_list_for_each_entry_safe(data, n, &canceled, linkage) {
+		lond_list_del(&data->linkage);
+		action_fini(data->pair, NULL, data->hai, 0, -ECANCELED);
+		free(data->hai);
+		free(data);
+	}
+}
+
+/* Whether all the queued and in-flight actions are finished */
+static bool queue_idle(void)
+{
+	bool idle;
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	idle = queue.cq_count == 0 && queue.cq_active == 0;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return idle;
+}
+
+/*
+ * A job is waiting for the file if a restore that is not bulk is received
+ * for it, so promote the queued bulk restores of the same file with
+ * queue.cq_mutex held. Otherwise, the job waits behind the aging of the
+ * bulk actions.
+ */
+static void queue_promote_bulk(struct copytool_pair *pair,
+			       const struct lu_fid *fid)
+{
+	int i;
+	struct lond_list_head *heads[] = {
+		&queue.cq_items[CP_PRIORITY_LOW],
+		&queue.cq_unresolved,
+		&queue.cq_resolving,
+	};
+	struct thread_data *data;
+	struct thread_data *n;
+
+	for (i = 0; i < ARRAY_SIZE(heads); i++) {
+		lond_list_for_each_entry_safe(data, n, heads[i], linkage) {
+			if (data->pair != pair ||
+			    data->hai->hai_action != HSMA_RESTORE ||
+			    !action_is_bulk(data->hai) ||
+			    memcmp(&data->hai->hai_fid, fid, sizeof(*fid)) != 0)
+				continue;
+			LDEBUG("promoting bulk restore of "DFID"\n",
+			       PFID(fid));
+			data->priority = CP_PRIORITY_URGENT;
+			if (heads[i] == &queue.cq_items[CP_PRIORITY_LOW])
+				lond_list_move_tail(&data->linkage,
+					&queue.cq_items[CP_PRIORITY_URGENT]);
+		}
+	}
+}
+
+/*
+ * Queue the action. Return -EAGAIN if the queue is full, then the main loop
+ * is notified through queue.cq_not_full_fd when a slot is freed.
+ */
+static int process_item_async(struct copytool_pair *pair,
+			      const struct hsm_action_item *hai,
+			      long hal_flags, int archive_id)
+{
+	struct thread_data	*data;
+	bool demand = hai->hai_action == HSMA_RESTORE && !action_is_bulk(hai);
+
+	if (hai->hai_action == HSMA_CANCEL)
+		return process_cancel(pair, hai);
+
+	/* Only this thread adds items, so the queue stays not full */
+	pthread_mutex_lock(&queue.cq_mutex);
+	if (demand)
+		queue_promote_bulk(pair, &hai->hai_fid);
+	if (queue.cq_count >= queue.cq_depth) {
+		queue.cq_full = true;
+		pthread_mutex_unlock(&queue.cq_mutex);
+		return -EAGAIN;
+	}
+	pthread_mutex_unlock(&queue.cq_mutex);
+
+	data = malloc(sizeof(*data));
+	if (data == NULL)
+		return -ENOMEM;
+
+	data->hai = malloc(hai->hai_len);
+	if (data->hai == NULL) {
+		free(data);
+		return -ENOMEM;
+	}
+
+	memcpy(data->hai, hai, hai->hai_len);
+	data->pair = pair;
+	data->hal_flags = hal_flags;
+	data->archive_id = archive_id;
+	data->queue_time = time(NULL);
+	data->queue_ns = copy_now_ns();
+	data->ost_index = -1;
+	data->canceled = false;
+	data->resolve_priority = !action_priority(data, data->queue_time);
+	LDEBUG("queueing action [%d] on "DFID" with priority [%d]\n",
+	       hai->hai_action, PFID(&hai->hai_fid), data->priority);
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	data->resolve_ost = opt.o_ost_streams > 0 &&
+			    hai->hai_action == HSMA_RESTORE;
+	if (data->resolve_priority || data->resolve_ost)
+		lond_list_add_tail(&data->linkage, &queue.cq_unresolved);
+	else
+		lond_list_add_tail(&data->linkage,
+				   &queue.cq_items[data->priority]);
+	queue.cq_count++;
+	pthread_cond_signal(&queue.cq_not_empty);
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return 0;
+}
+
+static void tuner_read_stats(struct copy_tuner_stats *stats)
+{
+	struct copy_tuner_stats *current = &tuner.ct_stats;
+
+	stats->cts_bytes = __atomic_load_n(&current->cts_bytes,
+					   __ATOMIC_RELAXED);
+	stats->cts_timed_bytes = __atomic_load_n(&current->cts_timed_bytes,
+						 __ATOMIC_RELAXED);
+	stats->cts_timed_ns = __atomic_load_n(&current->cts_timed_ns,
+					      __ATOMIC_RELAXED);
+	stats->cts_action_bytes = __atomic_load_n(&current->cts_action_bytes,
+						  __ATOMIC_RELAXED);
+	stats->cts_action_ns = __atomic_load_n(&current->cts_action_ns,
+					       __ATOMIC_RELAXED);
+}
+
+/*
+ * Adjust with the stats of the last interval. If the latency of the chunks
+ * grows while the throughput doesn't, the global Lustre is congested, so
+ * halve both the chunk size and the number of streams. Otherwise increase
+ * one of them additively. The streams are only increased if actions are
+ * waiting, otherwise the limit is not what restricts the throughput.
+ */
+static void tuner_adjust(void)
+{
+	int chunk_size = tuner.ct_chunk_size;
+	int streams;
+	int max_streams;
+	bool waiting;
+	double rate;
+	double latency;
+	double action_rate = 0;
+	const char *decision;
+	struct copy_tuner_stats stats;
+	struct copy_tuner_stats *last = &tuner.ct_last_stats;
+	__u64 bytes;
+	__u64 timed_bytes;
+	__u64 action_ns;
+
+	tuner_read_stats(&stats);
+	bytes = stats.cts_bytes - last->cts_bytes;
+	timed_bytes = stats.cts_timed_bytes - last->cts_timed_bytes;
+	action_ns = stats.cts_action_ns - last->cts_action_ns;
+	rate = (double)bytes / opt.o_autotune;
+	latency = timed_bytes == 0 ? tuner.ct_last_latency :
+		(double)(stats.cts_timed_ns - last->cts_timed_ns) / timed_bytes;
+	if (action_ns > 0)
+		action_rate = (stats.cts_action_bytes -
+			       last->cts_action_bytes) * 1000000000.0 /
+			      action_ns;
+	*last = stats;
+
+	/* Nothing to learn from an idle interval */
+	if (bytes == 0)
+		return;
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	streams = queue.cq_active_limit;
+	max_streams = queue.cq_thread_limit;
+	waiting = queue.cq_count > 0;
+	pthread_mutex_unlock(&queue.cq_mutex);
+
+	if (tuner.ct_last_rate > 0 &&
+	    latency > tuner.ct_last_latency * AUTOTUNE_LATENCY_RATIO &&
+	    rate < tuner.ct_last_rate * AUTOTUNE_RATE_RATIO) {
+		decision = "decreasing";
+		chunk_size = chunk_size / 2 / LOND_DIRECT_IO_ALIGN *
+			LOND_DIRECT_IO_ALIGN;
+		if (chunk_size < opt.o_min_chunk_size)
+			chunk_size = opt.o_min_chunk_size;
+		streams /= 2;
+		if (streams < opt.o_min_streams)
+			streams = opt.o_min_streams;
+	} else if (tuner.ct_grow_chunk || !waiting) {
+		decision = "increasing chunk size";
+		chunk_size += opt.o_min_chunk_size;
+		if (chunk_size > opt.o_max_chunk_size)
+			chunk_size = opt.o_max_chunk_size;
+		tuner.ct_grow_chunk = false;
+	} else {
+		decision = "increasing streams";
+		if (streams < max_streams)
+			streams++;
+		tuner.ct_grow_chunk = true;
+	}
+	tuner.ct_last_rate = rate;
+	tuner.ct_last_latency = latency;
+
+	LINFO("autotune: [%.1f] MB/s, [%.1f] MB/s per action, [%.3f] ms per MB, %s, chunk size [%d], streams [%d]\n",
+	      rate / 1048576, action_rate / 1048576,
+	      latency * 1048576 / 1000000, decision, chunk_size, streams);
+
+	__atomic_store_n(&tuner.ct_chunk_size, chunk_size, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&queue.cq_mutex);
+	/* The thread limit might have been lowered meanwhile */
+	if (streams > queue.cq_thread_limit)
+		streams = queue.cq_thread_limit;
+	queue.cq_active_limit = streams;
+	pthread_cond_broadcast(&queue.cq_not_empty);
+	pthread_mutex_unlock(&queue.cq_mutex);
+}
+
+static void *tuner_thread(void *arg)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock(&tuner.ct_mutex);
+	while (!tuner.ct_stopping) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += opt.o_autotune;
+		while (!tuner.ct_stopping &&
+		       pthread_cond_timedwait(&tuner.ct_cond, &tuner.ct_mutex,
+					      &deadline) != ETIMEDOUT)
+			;
+		if (tuner.ct_stopping)
+			break;
+		pthread_mutex_unlock(&tuner.ct_mutex);
+		tuner_adjust();
+		pthread_mutex_lock(&tuner.ct_mutex);
+	}
+	pthread_mutex_unlock(&tuner.ct_mutex);
+	return NULL;
+}
+
+static int tuner_start(void)
+{
+	int rc;
+
+	if (opt.o_autotune <= 0)
+		return 0;
+
+	tuner.ct_stopping = false;
+	rc = pthread_create(&tuner.ct_thread, NULL, tuner_thread, NULL);
+	if (rc) {
+		LERROR("cannot create auto-tuner thread: %s\n", strerror(rc));
+		return -rc;
+	}
+	tuner.ct_started = true;
+	LINFO("auto-tuning every [%d] seconds, chunk size [%d, %d], streams [%d, %d]\n",
+	      opt.o_autotune, opt.o_min_chunk_size, opt.o_max_chunk_size,
+	      opt.o_min_streams, opt.o_thread_number);
+	return 0;
+}
+
+static void tuner_stop(void)
+{
+	if (!tuner.ct_started)
+		return;
+
+	pthread_mutex_lock(&tuner.ct_mutex);
+	tuner.ct_stopping = true;
+	pthread_cond_signal(&tuner.ct_cond);
+	pthread_mutex_unlock(&tuner.ct_mutex);
+	pthread_join(tuner.ct_thread, NULL);
+	tuner.ct_started = false;
+}
+
+static void queue_stop(void)
+{
+	int i;
+
+	tuner_stop();
+	pthread_mutex_lock(&queue.cq_mutex);
+	queue.cq_stopping = true;
+	pthread_cond_broadcast(&queue.cq_not_empty);
+	pthread_mutex_unlock(&queue.cq_mutex);
+
+	for (i = 0; i < queue.cq_thread_number; i++)
+		pthread_join(queue.cq_threads[i], NULL);
+	free(queue.cq_threads);
+	queue.cq_threads = NULL;
+	queue.cq_thread_number = 0;
+	ost_streams_fini();
+}
+
+static int queue_thread_create(int index)
+{
+	int rc;
+
+	/* The threads added at runtime share slot 0 */
+	rc = pthread_create(&queue.cq_threads[index], NULL, process_thread,
+			    index + 1 < metrics_slot_number ?
+			    &metrics_slots[index + 1] : NULL);
+	if (rc) {
+		LERROR("cannot create worker thread: %s\n", strerror(rc));
+		return -rc;
+	}
+	return 0;
+}
+
+/*
+ * Change the max number of actions processed at the same time. More
+ * threads are created if needed, but the idle ones are kept until the
+ * queue is stopped, since they might be processing actions right now.
+ */
+static int queue_set_threads(int number)
+{
+	pthread_t *threads;
+	int rc;
+
+	if (number <= 0)
+		return -EINVAL;
+
+	if (number > queue.cq_thread_number) {
+		threads = realloc(queue.cq_threads, sizeof(*threads) * number);
+		if (threads == NULL) {
+			LERROR("failed to allocate memory\n");
+			return -ENOMEM;
+		}
+		queue.cq_threads = threads;
+		while (queue.cq_thread_number < number) {
+			rc = queue_thread_create(queue.cq_thread_number);
+			if (rc)
+				return rc;
+			queue.cq_thread_number++;
+		}
+	}
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	queue.cq_thread_limit = number;
+	/* The auto-tuner grows the limit by itself */
+	if (opt.o_autotune <= 0 || queue.cq_active_limit > number)
+		queue.cq_active_limit = number;
+	pthread_cond_broadcast(&queue.cq_not_empty);
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return 0;
+}
+
+static int queue_start(void)
+{
+	int rc;
+
+	queue.cq_depth = opt.o_queue_depth;
+	if (queue.cq_depth <= 0)
+		queue.cq_depth = opt.o_thread_number * QUEUE_DEPTH_FACTOR;
+	queue.cq_stopping = false;
+	queue.cq_thread_limit = opt.o_thread_number;
+	queue.cq_active_limit = opt.o_thread_number;
+	/* Start from the middle and let the auto-tuner find the best */
+	if (opt.o_autotune > 0 && opt.o_thread_number / 2 > opt.o_min_streams)
+		queue.cq_active_limit = opt.o_thread_number / 2;
+	else if (opt.o_autotune > 0)
+		queue.cq_active_limit = opt.o_min_streams;
+
+	queue.cq_threads = calloc(opt.o_thread_number,
+				  sizeof(*queue.cq_threads));
+	if (queue.cq_threads == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	for (queue.cq_thread_number = 0;
+	     queue.cq_thread_number < opt.o_thread_number;
+	     queue.cq_thread_number++) {
+		rc = queue_thread_create(queue.cq_thread_number);
+		if (rc) {
+			queue_stop();
+			return rc;
+		}
+	}
+	LINFO("started [%d] threads with queue depth [%d]\n",
+	      queue.cq_thread_number, queue.cq_depth);
+
+	rc = tuner_start();
+	if (rc) {
+		queue_stop();
+		return rc;
+	}
+	return 0;
+}
+
+/* Max size of the request of a control client */
+#define CONTROL_REQUEST_SIZE	1024
+/* Seconds to wait for the request of a control client */
+#define CONTROL_REQUEST_TIMEOUT	1
+
+struct metrics_buf {
+	char	*mb_buf;
+	size_t	 mb_len;
+	size_t	 mb_size;
+	/* Allocation failed, the content is incomplete */
+	bool	 mb_failed;
+};
+
+static void metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+	size_t size;
+	char *buf;
+
+	while (!mb->mb_failed) {
+		va_start(ap, fmt);
+		size = mb->mb_size - mb->mb_len;
+		len = vsnprintf(mb->mb_buf + mb->mb_len, size, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			mb->mb_failed = true;
+			break;
+		}
+		if (mb->mb_len + len < mb->mb_size) {
+			mb->mb_len += len;
+			break;
+		}
+
+		size = mb->mb_size * 2;
+		if (size < mb->mb_len + len + 1)
+			size = mb->mb_len + len + 1;
+		buf = realloc(mb->mb_buf, size);
+		if (buf == NULL) {
+			LERROR("failed to allocate memory\n");
+			mb->mb_failed = true;
+			break;
+		}
+		mb->mb_buf = buf;
+		mb->mb_size = size;
+	}
+}
+
+static __u64 metrics_load(__u64 *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Sum up the slots of all the threads */
+static void metrics_sum(struct metrics_slot *total)
+{
+	struct metrics_slot *slot;
+	int i, j, k;
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < metrics_slot_number; i++) {
+		slot = &metrics_slots[i];
+		for (j = 0; j < MA_NUMBER; j++)
+			for (k = 0; k < MR_NUMBER; k++)
+				total->ms_actions[j][k] +=
+					metrics_load(&slot->ms_actions[j][k]);
+		total->ms_bytes += metrics_load(&slot->ms_bytes);
+		for (j = 0; j <= METRICS_ARCHIVE_ID_MAX; j++)
+			total->ms_archive_bytes[j] +=
+				metrics_load(&slot->ms_archive_bytes[j]);
+		total->ms_cancels += metrics_load(&slot->ms_cancels);
+		for (j = 0; j < MS_NUMBER; j++)
+			lond_histogram_merge(&total->ms_latency[j],
+					     &slot->ms_latency[j]);
+	}
+}
+
+/* Gauges of the queue and the auto-tuner */
+struct metrics_gauges {
+	int	mg_queued;
+	int	mg_active;
+	int	mg_active_limit;
+	int	mg_chunk_size;
+	int	mg_threads;
+	int	mg_err_major;
+	int	mg_err_minor;
+};
+
+static void metrics_gauges(struct metrics_gauges *gauges)
+{
+	pthread_mutex_lock(&queue.cq_mutex);
+	gauges->mg_queued = queue.cq_count;
+	gauges->mg_active = queue.cq_active;
+	gauges->mg_active_limit = queue.cq_active_limit;
+	gauges->mg_threads = queue.cq_thread_number;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	gauges->mg_chunk_size = copy_chunk_size();
+	gauges->mg_err_major = __atomic_load_n(&err_major, __ATOMIC_RELAXED);
+	gauges->mg_err_minor = __atomic_load_n(&err_minor, __ATOMIC_RELAXED);
+}
+
+/* Format the metrics in the text format of Prometheus */
+static void metrics_format_text(struct metrics_buf *mb,
+				struct metrics_slot *total,
+				struct metrics_gauges *gauges)
+{
+	struct lond_histogram *histogram;
+	const char *name;
+	int i, j;
+
+	metrics_printf(mb, "# TYPE lond_copytool_actions_total counter\n");
+	for (i = 0; i < MA_NUMBER; i++)
+		for (j = 0; j < MR_NUMBER; j++)
+			metrics_printf(mb,
+				       "lond_copytool_actions_total{action=\"%s\",result=\"%s\"} %llu\n",
+				       metrics_action_names[i],
+				       metrics_result_names[j],
+				       total->ms_actions[i][j]);
+
+	metrics_printf(mb, "# TYPE lond_copytool_bytes_total counter\n"
+		       "lond_copytool_bytes_total %llu\n", total->ms_bytes);
+	metrics_printf(mb,
+		       "# TYPE lond_copytool_archive_bytes_total counter\n");
+	for (i = 0; i <= METRICS_ARCHIVE_ID_MAX; i++)
+		if (total->ms_archive_bytes[i] > 0)
+			metrics_printf(mb,
+				       "lond_copytool_archive_bytes_total{archive_id=\"%d\"} %llu\n",
+				       i, total->ms_archive_bytes[i]);
+	metrics_printf(mb,
+		       "# TYPE lond_copytool_cancel_requests_total counter\n"
+		       "lond_copytool_cancel_requests_total %llu\n",
+		       total->ms_cancels);
+	metrics_printf(mb, "# TYPE lond_copytool_errors_total counter\n"
+		       "lond_copytool_errors_total{severity=\"major\"} %d\n"
+		       "lond_copytool_errors_total{severity=\"minor\"} %d\n",
+		       gauges->mg_err_major, gauges->mg_err_minor);
+
+	metrics_printf(mb, "# TYPE lond_copytool_queued gauge\n"
+		       "lond_copytool_queued %d\n"
+		       "# TYPE lond_copytool_active_streams gauge\n"
+		       "lond_copytool_active_streams %d\n"
+		       "# TYPE lond_copytool_active_streams_limit gauge\n"
+		       "lond_copytool_active_streams_limit %d\n"
+		       "# TYPE lond_copytool_chunk_size_bytes gauge\n"
+		       "lond_copytool_chunk_size_bytes %d\n"
+		       "# TYPE lond_copytool_threads gauge\n"
+		       "lond_copytool_threads %d\n",
+		       gauges->mg_queued, gauges->mg_active,
+		       gauges->mg_active_limit, gauges->mg_chunk_size,
+		       gauges->mg_threads);
+
+	for (i = 0; i < MS_NUMBER; i++) {
+		histogram = &total->ms_latency[i];
+		name = metrics_stage_names[i];
+		metrics_printf(mb, "# TYPE lond_copytool_%s_seconds summary\n",
+			       name);
+		for (j = 0; j < ARRAY_SIZE(metrics_percentiles); j++)
+			metrics_printf(mb,
+				       "lond_copytool_%s_seconds{quantile=\"%g\"} %.6f\n",
+				       name, metrics_percentiles[j] / 100,
+				       lond_histogram_percentile(histogram,
+					       metrics_percentiles[j]) / 1e6);
+		metrics_printf(mb, "lond_copytool_%s_seconds_sum %.6f\n"
+			       "lond_copytool_%s_seconds_count %llu\n",
+			       name, histogram->lh_sum / 1e6,
+			       name, histogram->lh_count);
+	}
+}
+
+/* Add an integer to @object, return the new object for the caller to check */
+static struct json_object *metrics_json_add_int(struct json_object *object,
+						const char *key,
+						int64_t value)
+{
+	struct json_object *child = json_object_new_int64(value);
+
+	if (child != NULL)
+		json_object_object_add(object, key, child);
+	return child;
+}
+
+static struct json_object *metrics_json_add_double(struct json_object *object,
+						   const char *key,
+						   double value)
+{
+	struct json_object *child = json_object_new_double(value);
+
+	if (child != NULL)
+		json_object_object_add(object, key, child);
+	return child;
+}
+
+static struct json_object *metrics_json_add_object(struct json_object *object,
+						   const char *key)
+{
+	struct json_object *child = json_object_new_object();
+
+	if (child != NULL)
+		json_object_object_add(object, key, child);
+	return child;
+}
+
+static struct json_object *metrics_build_json(struct metrics_slot *total,
+					      struct metrics_gauges *gauges)
+{
+	struct lond_histogram *histogram;
+	struct json_object *root;
+	struct json_object *object;
+	struct json_object *child;
+	char key[32];
+	int i, j;
+
+	root = json_object_new_object();
+	if (root == NULL)
+		return NULL;
+
+	object = metrics_json_add_object(root, "actions");
+	if (object == NULL)
+		goto out_put;
+	for (i = 0; i < MA_NUMBER; i++) {
+		child = metrics_json_add_object(object,
+						metrics_action_names[i]);
+		if (child == NULL)
+			goto out_put;
+		for (j = 0; j < MR_NUMBER; j++)
+			if (metrics_json_add_int(child,
+						 metrics_result_names[j],
+						 total->ms_actions[i][j]) ==
+			    NULL)
+				goto out_put;
+	}
+
+	if (metrics_json_add_int(root, "bytes", total->ms_bytes) == NULL)
+		goto out_put;
+	object = metrics_json_add_object(root, "archive_bytes");
+	if (object == NULL)
+		goto out_put;
+	for (i = 0; i <= METRICS_ARCHIVE_ID_MAX; i++) {
+		if (total->ms_archive_bytes[i] == 0)
+			continue;
+		snprintf(key, sizeof(key), "%d", i);
+		if (metrics_json_add_int(object, key,
+					 total->ms_archive_bytes[i]) == NULL)
+			goto out_put;
+	}
+
+	if (metrics_json_add_int(root, "cancel_requests",
+				 total->ms_cancels) == NULL)
+		goto out_put;
+	object = metrics_json_add_object(root, "errors");
+	if (object == NULL ||
+	    metrics_json_add_int(object, "major",
+				 gauges->mg_err_major) == NULL ||
+	    metrics_json_add_int(object, "minor",
+				 gauges->mg_err_minor) == NULL)
+		goto out_put;
+
+	if (metrics_json_add_int(root, "queued", gauges->mg_queued) == NULL ||
+	    metrics_json_add_int(root, "active_streams",
+				 gauges->mg_active) == NULL ||
+	    metrics_json_add_int(root, "active_streams_limit",
+				 gauges->mg_active_limit) == NULL ||
+	    metrics_json_add_int(root, "chunk_size",
+				 gauges->mg_chunk_size) == NULL ||
+	    metrics_json_add_int(root, "threads",
+				 gauges->mg_threads) == NULL)
+		goto out_put;
+
+	object = metrics_json_add_object(root, "latency_seconds");
+	if (object == NULL)
+		goto out_put;
+	for (i = 0; i < MS_NUMBER; i++) {
+		histogram = &total->ms_latency[i];
+		child = metrics_json_add_object(object, metrics_stage_names[i]);
+		if (child == NULL ||
+		    metrics_json_add_int(child, "count",
+					 histogram->lh_count) == NULL ||
+		    metrics_json_add_double(child, "sum",
+					    histogram->lh_sum / 1e6) == NULL)
+			goto out_put;
+		for (j = 0; j < ARRAY_SIZE(metrics_percentiles); j++) {
+			snprintf(key, sizeof(key), "p%g",
+				 metrics_percentiles[j]);
+			if (metrics_json_add_double(child, key,
+				lond_histogram_percentile(histogram,
+					metrics_percentiles[j]) / 1e6) == NULL)
+				goto out_put;
+		}
+	}
+	return root;
+out_put:
+	json_object_put(root);
+	return NULL;
+}
+
+static void metrics_format_json(struct metrics_buf *mb,
+				struct metrics_slot *total,
+				struct metrics_gauges *gauges)
+{
+	struct json_object *root;
+
+	root = metrics_build_json(total, gauges);
+	if (root == NULL) {
+		LERROR("failed to build the JSON of metrics\n");
+		mb->mb_failed = true;
+		return;
+	}
+	metrics_printf(mb, "%s\n",
+		       json_object_to_json_string_ext(root,
+						      JSON_C_TO_STRING_PRETTY));
+	json_object_put(root);
+}
+
+static int metrics_send(int fd, const char *buf, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = send(fd, buf, len, MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -errno;
+		buf += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/* Reply with the metrics, in JSON if @json, otherwise in Prometheus text */
+static int control_metrics(struct metrics_buf *reply, bool json)
+{
+	struct metrics_slot *total;
+	struct metrics_gauges gauges;
+
+	total = malloc(sizeof(*total));
+	if (total == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
+	}
+	metrics_sum(total);
+	metrics_gauges(&gauges);
+	if (json)
+		metrics_format_json(reply, total, &gauges);
+	else
+		metrics_format_text(reply, total, &gauges);
+	free(total);
+	return 0;
+}
+
+struct copytool_loop {
+	int			 cl_epoll_fd;
+	/* Number of pairs whose actions are being received */
+	int			 cl_pair_number;
+	struct loop_source	 cl_signal;
+	struct loop_source	 cl_timer;
+	struct loop_source	 cl_control;
+	/* Eventfd written by the workers when the full queue has a slot */
+	struct loop_source	 cl_queue;
+	/* Control clients whose requests haven't been received */
+	struct lond_list_head	 cl_clients;
+	/* No action is received any more, exit when all are finished */
+	bool			 cl_draining;
+	bool			 cl_exiting;
+	/* When and with how many bytes the progress was logged */
+	time_t			 cl_status_time;
+	__u64			 cl_status_bytes;
+};
+
+static int loop_drain(struct copytool_loop *loop);
+static int pair_add(struct copytool_loop *loop, const char *source,
+		    const char *dest, const int *archive_ids,
+		    int archive_id_number);
+
+struct control_command {
+	const char	*cc_name;
+	/* @args is the rest of the request line */
+	int		(*cc_handler)(struct copytool_loop *loop, char *args,
+				      struct metrics_buf *reply);
+};
+
+static int control_handle_metrics(struct copytool_loop *loop, char *args,
+				  struct metrics_buf *reply)
+{
+	return control_metrics(reply, strcmp(args, "json") == 0);
+}
+
+static int control_handle_drain(struct copytool_loop *loop, char *args,
+				struct metrics_buf *reply)
+{
+	int rc;
+
+	rc = loop_drain(loop);
+	if (rc == 0)
+		metrics_printf(reply, "draining\n");
+	return rc;
+}
+
+/* add-pair <source> <dest> [<archive_id>...] */
+static int control_handle_add_pair(struct copytool_loop *loop, char *args,
+				   struct metrics_buf *reply)
+{
+	int archive_ids[PAIR_ARCHIVE_IDS_MAX];
+	int archive_id_number = 0;
+	char *source;
+	char *dest;
+	char *token;
+	char *saveptr;
+	char *end;
+	long val;
+	int rc;
+
+	source = strtok_r(args, " ", &saveptr);
+	dest = strtok_r(NULL, " ", &saveptr);
+	if (source == NULL || dest == NULL) {
+		LERROR("missing source or dest of pair to add\n");
+		return -EINVAL;
+	}
+
+	while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+		val = strtol(token, &end, 10);
+		if (*end != '\0' || val < 0 || val > INT_MAX ||
+		    archive_id_number >= PAIR_ARCHIVE_IDS_MAX) {
+			LERROR("invalid archive ID [%s]\n", token);
+			return -EINVAL;
+		}
+		/* Archive ID 0 means all of them */
+		if (val == 0) {
+			archive_id_number = 0;
+			break;
+		}
+		archive_ids[archive_id_number++] = val;
+	}
+
+	rc = pair_add(loop, source, dest, archive_ids, archive_id_number);
+	if (rc == 0)
+		metrics_printf(reply, "added\n");
+	return rc;
+}
+
+/* Parameter of the copytool that can be changed at runtime */
+struct control_config {
+	const char		*ccf_name;
+	unsigned long long	(*ccf_get)(void);
+	/*
+	 * Return negative errno if the value is invalid. The pointer may be
+	 * NULL, then any value is valid.
+	 */
+	int			(*ccf_validate)(unsigned long long value);
+	/*
+	 * Only called with a value that has passed ccf_validate. Only the
+	 * parameters at the head of control_configs may fail to be set.
+	 */
+	int			(*ccf_set)(unsigned long long value);
+};
+
+static int config_validate_int(unsigned long long value)
+{
+	return value > INT_MAX ? -EINVAL : 0;
+}
+
+static int config_validate_positive(unsigned long long value)
+{
+	return value == 0 || value > INT_MAX ? -EINVAL : 0;
+}
+
+static unsigned long long config_get_read_bandwidth(void)
+{
+	return lond_token_bucket_get_rate(&read_bucket);
+}
+
+static int config_set_read_bandwidth(unsigned long long value)
+{
+	lond_token_bucket_set_rate(&read_bucket, value);
+	return 0;
+}
+
+static unsigned long long config_get_write_bandwidth(void)
+{
+	return lond_token_bucket_get_rate(&write_bucket);
+}
+
+static int config_set_write_bandwidth(unsigned long long value)
+{
+	lond_token_bucket_set_rate(&write_bucket, value);
+	return 0;
+}
+
+static unsigned long long config_get_threads(void)
+{
+	int threads;
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	threads = queue.cq_thread_limit;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return threads;
+}
+
+static int config_set_threads(unsigned long long value)
+{
+	return queue_set_threads(value);
+}
+
+static unsigned long long config_get_queue_depth(void)
+{
+	int depth;
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	depth = queue.cq_depth;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return depth;
+}
+
+static int config_set_queue_depth(unsigned long long value)
+{
+	pthread_mutex_lock(&queue.cq_mutex);
+	queue.cq_depth = value;
+	queue_signal_not_full();
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return 0;
+}
+
+/* The workers resolving the priorities read it with the queue lock held */
+static unsigned long long config_get_small_size(void)
+{
+	unsigned long long size;
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	size = opt.o_small_size;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return size;
+}
+
+static int config_set_small_size(unsigned long long value)
+{
+	pthread_mutex_lock(&queue.cq_mutex);
+	opt.o_small_size = value;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return 0;
+}
+
+/* The priority age and the OST streams are used with the queue lock held */
+static unsigned long long config_get_priority_age(void)
+{
+	int age;
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	age = opt.o_priority_age;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return age;
+}
+
+static int config_set_priority_age(unsigned long long value)
+{
+	pthread_mutex_lock(&queue.cq_mutex);
+	opt.o_priority_age = value;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return 0;
+}
+
+static unsigned long long config_get_ost_streams(void)
+{
+	int streams;
+
+	pthread_mutex_lock(&queue.cq_mutex);
+	streams = opt.o_ost_streams;
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return streams;
+}
+
+static int config_set_ost_streams(unsigned long long value)
+{
+	pthread_mutex_lock(&queue.cq_mutex);
+	opt.o_ost_streams = value;
+	/* Let the actions blocked by the old limit go */
+	pthread_cond_broadcast(&queue.cq_not_empty);
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return 0;
+}
+
+/*
+ * The parameters are set in this order. The threads might fail to be
+ * started, so they go first, and nothing is changed if that fails.
+ */
+static const struct control_config control_configs[] = {
+	{ "threads", config_get_threads, config_validate_positive,
+	  config_set_threads },
+	{ "read_bandwidth", config_get_read_bandwidth, NULL,
+	  config_set_read_bandwidth },
+	{ "write_bandwidth", config_get_write_bandwidth, NULL,
+	  config_set_write_bandwidth },
+	{ "queue_depth", config_get_queue_depth, config_validate_positive,
+	  config_set_queue_depth },
+	{ "small_size", config_get_small_size, NULL, config_set_small_size },
+	{ "priority_age", config_get_priority_age, config_validate_positive,
+	  config_set_priority_age },
+	{ "ost_streams", config_get_ost_streams, config_validate_int,
+	  config_set_ost_streams },
+};
+
+static const struct control_config *control_config_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(control_configs); i++) {
+		if (strcmp(control_configs[i].ccf_name, name) == 0)
+			return &control_configs[i];
+	}
+	return NULL;
+}
+
+/* Reply with "<name> <value>" lines */
+static int control_handle_get_config(struct copytool_loop *loop, char *args,
+				     struct metrics_buf *reply)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(control_configs); i++)
+		metrics_printf(reply, "%s %llu\n", control_configs[i].ccf_name,
+			       control_configs[i].ccf_get());
+	return 0;
+}
+
+/*
+ * set-config <name>=<value>... All the parameters are parsed and validated
+ * before any of them is changed. Then they are set in the order of
+ * control_configs, so a failure to set one leaves the parameters after it
+ * unchanged, while those before it, which can't fail, stay applied.
+ */
+static int control_handle_set_config(struct copytool_loop *loop, char *args,
+				     struct metrics_buf *reply)
+{
+	const struct control_config *config;
+	unsigned long long values[ARRAY_SIZE(control_configs)];
+	bool changed[ARRAY_SIZE(control_configs)] = { false };
+	char *token;
+	char *saveptr;
+	char *value;
+	char *end;
+	int rc;
+	int i;
+
+	for (token = strtok_r(args, " ", &saveptr); token != NULL;
+	     token = strtok_r(NULL, " ", &saveptr)) {
+		value = strchr(token, '=');
+		if (value == NULL) {
+			LERROR("invalid config [%s]\n", token);
+			return -EINVAL;
+		}
+		*value++ = '\0';
+		config = control_config_find(token);
+		if (config == NULL) {
+			LERROR("unknown config [%s]\n", token);
+			return -ENOENT;
+		}
+		i = config - control_configs;
+		values[i] = strtoull(value, &end, 10);
+		if (*value == '\0' || *end != '\0') {
+			LERROR("invalid value [%s] of config [%s]\n", value,
+			       token);
+			return -EINVAL;
+		}
+		if (config->ccf_validate != NULL) {
+			rc = config->ccf_validate(values[i]);
+			if (rc) {
+				LERROR("invalid value [%s] of config [%s]: %s\n",
+				       value, token, strerror(-rc));
+				return rc;
+			}
+		}
+		changed[i] = true;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(control_configs); i++) {
+		if (!changed[i])
+			continue;
+		config = &control_configs[i];
+		rc = config->ccf_set(values[i]);
+		if (rc) {
+			LERROR("failed to set config [%s] to [%llu]: %s\n",
+			       config->ccf_name, values[i], strerror(-rc));
+			return rc;
+		}
+		LINFO("set config [%s] to [%llu]\n", config->ccf_name,
+		      values[i]);
+	}
+	return control_handle_get_config(loop, args, reply);
+}
+
+static int control_handle_stats(struct copytool_loop *loop, char *args,
+				struct metrics_buf *reply)
+{
+	return control_metrics(reply, true);
+}
+
+static const struct control_command control_commands[] = {
+	{ "metrics",	control_handle_metrics },
+	{ "drain",	control_handle_drain },
+	{ "add-pair",	control_handle_add_pair },
+	{ "get-config",	control_handle_get_config },
+	{ "set-config",	control_handle_set_config },
+	{ "stats",	control_handle_stats },
+};
+
+/*
+ * Reply to a request of a control client. A request is a command with its
+ * arguments in one line. Any other request, including an empty one, gets
+ * the metrics, in JSON if it contains "json", otherwise in the text format
+ * of Prometheus. An HTTP GET request gets an HTTP reply, so that the socket
+ * can be scraped through a proxy.
+ */
+static void control_serve(struct copytool_loop *loop, int fd, char *request)
+{
+	const struct control_command *command = NULL;
+	struct metrics_buf reply = { 0 };
+	char header[128];
+	char *args;
+	size_t len;
+	bool http;
+	int rc;
+	int i;
+
+	http = strncmp(request, "GET ", 4) == 0;
+	len = strcspn(request, " \r\n");
+	for (i = 0; !http && i < ARRAY_SIZE(control_commands); i++) {
+		if (strlen(control_commands[i].cc_name) == len &&
+		    strncmp(request, control_commands[i].cc_name, len) == 0) {
+			command = &control_commands[i];
+			break;
+		}
+	}
+
+	if (command != NULL) {
+		args = request + len;
+		args += strspn(args, " ");
+		args[strcspn(args, "\r\n")] = '\0';
+		rc = command->cc_handler(loop, args, &reply);
+	} else {
+		rc = control_metrics(&reply, strstr(request, "json") != NULL);
+	}
+	if (rc) {
+		reply.mb_len = 0;
+		metrics_printf(&reply, "error: %s\n", strerror(-rc));
+	}
+	if (reply.mb_failed)
+		goto out;
+
+	if (http) {
+		snprintf(header, sizeof(header),
+			 "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+			 strstr(request, "json") != NULL ? "application/json" :
+			 "text/plain; version=0.0.4", reply.mb_len);
+		rc = metrics_send(fd, header, strlen(header));
+		if (rc)
+			goto out;
+	}
+	rc = metrics_send(fd, reply.mb_buf, reply.mb_len);
+out:
+	if (rc)
+		LDEBUG("failed to send reply to control client: %s\n",
+		       strerror(-rc));
+	free(reply.mb_buf);
+}
+
+static int loop_add(struct copytool_loop *loop, struct loop_source *source,
+		    int fd, enum loop_source_type type)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = source,
+	};
+	int rc;
+
+	source->ls_fd = fd;
+	source->ls_type = type;
+	rc = epoll_ctl(loop->cl_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	if (rc < 0) {
+		rc = -errno;
+		LERROR("failed to watch fd [%d]: %s\n", fd, strerror(-rc));
+		return rc;
+	}
+	return 0;
+}
+
+static void loop_del(struct copytool_loop *loop, struct loop_source *source)
+{
+	epoll_ctl(loop->cl_epoll_fd, EPOLL_CTL_DEL, source->ls_fd, NULL);
+}
+
+static void loop_client_fini(struct copytool_loop *loop,
+			     struct loop_source *client)
+{
+	loop_del(loop, client);
+	close(client->ls_fd);
+	lond_list_del(&client->ls_linkage);
+	free(client);
+}
+
+/* Read the request of a client, or serve it without one if it is slow */
+static void loop_handle_client(struct copytool_loop *loop,
+			       struct loop_source *client, bool timeout)
+{
+	char request[CONTROL_REQUEST_SIZE];
+	ssize_t len = 0;
+
+	if (!timeout) {
+		len = recv(client->ls_fd, request, sizeof(request) - 1,
+			   MSG_DONTWAIT);
+		if (len < 0 && errno == EAGAIN)
+			return;
+		if (len < 0)
+			len = 0;
+	}
+	request[len] = '\0';
+	control_serve(loop, client->ls_fd, request);
+	loop_client_fini(loop, client);
+}
+
+static void loop_handle_control(struct copytool_loop *loop)
+{
+	struct loop_source *client;
+	int fd;
+
+	fd = accept4(loop->cl_control.ls_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		LDEBUG("failed to accept control client: %s\n",
+		       strerror(errno));
+		return;
+	}
+
+	client = calloc(1, sizeof(*client));
+	if (client == NULL) {
+		LERROR("failed to allocate memory\n");
+		close(fd);
+		return;
+	}
+	client->ls_time = time(NULL);
+	if (loop_add(loop, client, fd, LS_CLIENT)) {
+		close(fd);
+		free(client);
+		return;
+	}
+	lond_list_add_tail(&client->ls_linkage, &loop->cl_clients);
+}
+
+static int loop_control_init(struct copytool_loop *loop)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+	int rc;
+
+	if (strlen(opt.o_control_socket) >= sizeof(addr.sun_path)) {
+		LERROR("path of control socket [%s] is too long\n",
+		       opt.o_control_socket);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, opt.o_control_socket);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		rc = -errno;
+		LERROR("failed to create control socket: %s\n", strerror(-rc));
+		return rc;
+	}
+
+	/* Remove the socket left by the last run */
+	unlink(opt.o_control_socket);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 16) < 0) {
+		rc = -errno;
+		LERROR("failed to listen on control socket [%s]: %s\n",
+		       opt.o_control_socket, strerror(-rc));
+		close(fd);
+		return rc;
+	}
+
+	rc = loop_add(loop, &loop->cl_control, fd, LS_CONTROL);
+	if (rc) {
+		close(fd);
+		unlink(opt.o_control_socket);
+		return rc;
+	}
+	LINFO("listening on control socket [%s]\n", opt.o_control_socket);
+	return 0;
+}
+
+static void loop_fini(struct copytool_loop *loop)
+{
+	struct loop_source *client, *n;
+
+	lond_list_for_each_entry_safe(client, n, &loop->cl_clients,
+				      ls_linkage)
+		loop_client_fini(loop, client);
+	if (loop->cl_control.ls_fd >= 0) {
+		close(loop->cl_control.ls_fd);
+		unlink(opt.o_control_socket);
+	}
+	if (loop->cl_queue.ls_fd >= 0) {
+		pthread_mutex_lock(&queue.cq_mutex);
+		queue.cq_not_full_fd = -1;
+		pthread_mutex_unlock(&queue.cq_mutex);
+		close(loop->cl_queue.ls_fd);
+	}
+	if (loop->cl_timer.ls_fd >= 0)
+		close(loop->cl_timer.ls_fd);
+	if (loop->cl_signal.ls_fd >= 0)
+		close(loop->cl_signal.ls_fd);
+	if (loop->cl_epoll_fd >= 0)
+		close(loop->cl_epoll_fd);
+}
+
+/* SIGINT and SIGTERM should have been blocked in all the threads */
+static int loop_init(struct copytool_loop *loop, sigset_t *signals)
+{
+	struct itimerspec tick = {
+		.it_interval = { .tv_sec = 1 },
+		.it_value = { .tv_sec = 1 },
+	};
+	int fd;
+	int rc;
+
+	memset(loop, 0, sizeof(*loop));
+	LOND_INIT_LIST_HEAD(&loop->cl_clients);
+	loop->cl_signal.ls_fd = -1;
+	loop->cl_timer.ls_fd = -1;
+	loop->cl_control.ls_fd = -1;
+	loop->cl_queue.ls_fd = -1;
+	loop->cl_status_time = time(NULL);
+
+	loop->cl_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->cl_epoll_fd < 0) {
+		rc = -errno;
+		LERROR("failed to create epoll: %s\n", strerror(-rc));
+		return rc;
+	}
+
+	fd = signalfd(-1, signals, SFD_CLOEXEC);
+	if (fd < 0) {
+		rc = -errno;
+		LERROR("failed to create signalfd: %s\n", strerror(-rc));
+		goto out_fini;
+	}
+	loop->cl_signal.ls_fd = fd;
+	rc = loop_add(loop, &loop->cl_signal, fd, LS_SIGNAL);
+	if (rc)
+		goto out_fini;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0) {
+		rc = -errno;
+		LERROR("failed to create timerfd: %s\n", strerror(-rc));
+		goto out_fini;
+	}
+	loop->cl_timer.ls_fd = fd;
+	rc = timerfd_settime(fd, 0, &tick, NULL);
+	if (rc < 0) {
+		rc = -errno;
+		LERROR("failed to set timerfd: %s\n", strerror(-rc));
+		goto out_fini;
+	}
+	rc = loop_add(loop, &loop->cl_timer, fd, LS_TIMER);
+	if (rc)
+		goto out_fini;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		rc = -errno;
+		LERROR("failed to create eventfd: %s\n", strerror(-rc));
+		goto out_fini;
+	}
+	loop->cl_queue.ls_fd = fd;
+	rc = loop_add(loop, &loop->cl_queue, fd, LS_QUEUE);
+	if (rc)
+		goto out_fini;
+	pthread_mutex_lock(&queue.cq_mutex);
+	queue.cq_not_full_fd = fd;
+	pthread_mutex_unlock(&queue.cq_mutex);
+
+	if (opt.o_control_socket != NULL) {
+		rc = loop_control_init(loop);
+		if (rc)
+			goto out_fini;
+	}
+	return 0;
+out_fini:
+	loop_fini(loop);
+	return rc;
+}
+
+/* Get the root path of a Lustre mount point or fsname */
+static int pair_root_path(char *path, const char *lustre)
+{
+	int rc;
+
+	if (lustre[0] == '/') {
+		if (strlen(lustre) >= PATH_MAX)
+			return -ENAMETOOLONG;
+		strcpy(path, lustre);
+		return 0;
+	}
+
+	rc = llapi_search_rootpath(path, lustre);
+	if (rc)
+		LERROR("failed to find root path of Lustre file system [%s]\n",
+		       lustre);
+	return rc;
+}
+
+static void pair_destroy(struct copytool_pair *pair)
+{
+	int rc;
+
+	/*
+	 * If we don't unregister, umount thinks there's a ref and doesn't
+	 * remove us from mtab (EINPROGRESS). The lustre client does
+	 * successfully unmount and the mount is actually gone, but the mtab
+	 * entry remains.
+	 */
+	if (pair->ctp_ctdata != NULL) {
+		rc = llapi_hsm_copytool_unregister(&pair->ctp_ctdata);
+		if (rc < 0)
+			LERROR("failed to unregister copytool on [%s]: %s\n",
+			       pair->ctp_mnt, strerror(-rc));
+	}
+	lond_hsm_batch_fini(&pair->ctp_readahead_batch);
+	pthread_mutex_destroy(&pair->ctp_readahead_mutex);
+	free(pair->ctp_pending);
+	if (pair->ctp_mnt_fd >= 0)
+		close(pair->ctp_mnt_fd);
+	free(pair->ctp_archive_ids);
+	free(pair);
+}
+
+static int pair_create(const char *source, const char *dest,
+		       const int *archive_ids, int archive_id_number,
+		       struct copytool_pair **ppair)
+{
+	struct copytool_pair *pair;
+	int rc;
+
+	pair = calloc(1, sizeof(*pair));
+	if (pair == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
+	}
+	pair->ctp_mnt_fd = -1;
+	pair->ctp_source.ls_fd = -1;
+	pthread_mutex_init(&pair->ctp_readahead_mutex, NULL);
+
+	rc = pair_root_path(pair->ctp_hsm_root, source);
+	if (rc)
+		goto out_destroy;
+	rc = pair_root_path(pair->ctp_mnt, dest);
+	if (rc)
+		goto out_destroy;
+
+	rc = llapi_search_fsname(pair->ctp_mnt, pair->ctp_fs_name);
+	if (rc < 0) {
+		LERROR("cannot find a Lustre filesystem mounted at [%s]\n",
+		       pair->ctp_mnt);
+		goto out_destroy;
+	}
+
+	pair->ctp_mnt_fd = open(pair->ctp_mnt, O_RDONLY);
+	if (pair->ctp_mnt_fd < 0) {
+		rc = -errno;
+		LERROR("cannot open mount point at [%s]: %s\n",
+		       pair->ctp_mnt, strerror(errno));
+		goto out_destroy;
+	}
+
+	if (archive_id_number > 0) {
+		pair->ctp_archive_ids = calloc(archive_id_number,
+					       sizeof(*archive_ids));
+		if (pair->ctp_archive_ids == NULL) {
+			LERROR("failed to allocate memory\n");
+			rc = -ENOMEM;
+			goto out_destroy;
+		}
+		memcpy(pair->ctp_archive_ids, archive_ids,
+		       archive_id_number * sizeof(*archive_ids));
+		pair->ctp_archive_id_number = archive_id_number;
+	}
+
+	if (opt.o_readahead_files > 0) {
+		rc = lond_hsm_batch_init(&pair->ctp_readahead_batch,
+					 pair->ctp_mnt, HUA_RESTORE, 0,
+					 LOND_HSM_DATA_BULK,
+					 opt.o_readahead_files, 0);
+		if (rc) {
+			LERROR("failed to init readahead requests\n");
+			goto out_destroy;
+		}
+	}
+	*ppair = pair;
+	return 0;
+out_destroy:
+	pair_destroy(pair);
+	return rc;
+}
+
+/* Register the copytool and receive the actions in the loop */
+static int pair_register(struct copytool_loop *loop,
+			 struct copytool_pair *pair)
+{
+	int fd;
+	int rc;
+
+	rc = llapi_hsm_copytool_register(&pair->ctp_ctdata, pair->ctp_mnt,
+					 pair->ctp_archive_id_number,
+					 pair->ctp_archive_ids, 0);
+	if (rc < 0) {
+		LERROR("failed to register copytool on [%s]: %s\n",
+		       pair->ctp_mnt, strerror(-rc));
+		if (rc == -ENXIO) {
+			/* HSM coordinator thread might not be running */
+			LERROR("HSM feature might not be enabled which can be started by running following command on all MDTs of this file system:\nlctl set_param mdt.%s-MDT${INDEX}.hsm_control=enabled\n",
+			       pair->ctp_fs_name);
+		}
+		pair->ctp_ctdata = NULL;
+		return rc;
+	}
+
+	fd = llapi_hsm_copytool_get_fd(pair->ctp_ctdata);
+	if (fd < 0) {
+		LERROR("failed to get fd of copytool on [%s]: %s\n",
+		       pair->ctp_mnt, strerror(-fd));
+		return fd;
+	}
+	rc = loop_add(loop, &pair->ctp_source, fd, LS_HSM);
+	if (rc)
+		return rc;
+	loop->cl_pair_number++;
+	LINFO("copying between [%s] and [%s]\n", pair->ctp_hsm_root,
+	      pair->ctp_mnt);
+	return 0;
+}
+
+/*
+ * Add a pair of source and dest Lustre. If @loop is NULL, the copytool is
+ * registered when the loop starts. Only one pair can be on a dest. Return
+ * -EALREADY if the same pair is added already, or -EEXIST if the dest is
+ * used by a pair from another source.
+ */
+static int pair_add(struct copytool_loop *loop, const char *source,
+		    const char *dest, const int *archive_ids,
+		    int archive_id_number)
+{
+	struct copytool_pair *pair;
+	struct copytool_pair *existing;
+	int rc;
+
+	if (loop != NULL && loop->cl_draining)
+		return -ESHUTDOWN;
+
+	rc = pair_create(source, dest, archive_ids, archive_id_number, &pair);
+	if (rc)
+		return rc;
+
+	lond_list_for_each_entry(existing, &copytool_pairs, ctp_linkage) {
+		if (strcmp(existing->ctp_fs_name, pair->ctp_fs_name) != 0)
+			continue;
+		/* The same pair is added again */
+		if (strcmp(existing->ctp_hsm_root, pair->ctp_hsm_root) == 0) {
+			LINFO("copytool from [%s] to [%s] is running already\n",
+			      existing->ctp_hsm_root, existing->ctp_mnt);
+			rc = -EALREADY;
+		} else {
+			LERROR("copytool is running on [%s] from [%s] already, not [%s]\n",
+			       existing->ctp_mnt, existing->ctp_hsm_root,
+			       pair->ctp_hsm_root);
+			rc = -EEXIST;
+		}
+		pair_destroy(pair);
+		return rc;
 	}
 
-	rc = copy_data(hcp, src, dst, src_fd, dst_fd, hai, hal_flags);
-	if (rc < 0) {
-		LERROR("cannot copy data from [%s] to [%s]",
-		       src, dst);
-		err_major++;
-		if (rc == -ETIMEDOUT)
-			hp_flags |= HP_FLAG_RETRY;
-		goto fini;
+	if (loop != NULL) {
+		rc = pair_register(loop, pair);
+		if (rc) {
+			pair_destroy(pair);
+			return rc;
+		}
 	}
+	lond_list_add_tail(&pair->ctp_linkage, &copytool_pairs);
+	return 0;
+}
 
-fini:
-	rc = action_fini(&hcp, hai, hp_flags, rc);
+/*
+ * Stop receiving actions and exit after the received ones are finished.
+ * The actions sent by the coordinator meanwhile are left unread.
+ */
+static int loop_drain(struct copytool_loop *loop)
+{
+	struct copytool_pair *pair;
 
-	/* object swaping is done by cdt at copy end, so close of volatile file
-	 * cannot be done before
-	 */
-	if (!(src_fd < 0))
-		close(src_fd);
+	if (loop->cl_draining)
+		return 0;
 
-	return rc;
+	lond_list_for_each_entry(pair, &copytool_pairs, ctp_linkage) {
+		if (pair->ctp_source.ls_fd >= 0)
+			loop_del(loop, &pair->ctp_source);
+	}
+	loop->cl_draining = true;
+	pthread_mutex_lock(&queue.cq_mutex);
+	LINFO("draining [%d] queued and [%d] active actions\n",
+	      queue.cq_count, queue.cq_active);
+	pthread_mutex_unlock(&queue.cq_mutex);
+	return 0;
 }
 
-static int process_remove(const struct hsm_action_item *hai,
-			  const long hal_flags)
+/* Finish the actions that are received but not queued as canceled */
+static void pair_cancel_pending(struct copytool_pair *pair)
 {
-	return -1;
+	struct hsm_action_list *hal = pair->ctp_pending;
+	struct hsm_action_item *hai;
+	int i;
+
+	if (hal == NULL)
+		return;
+
+	hai = (struct hsm_action_item *)((char *)hal +
+					 pair->ctp_pending_offset);
+	for (i = pair->ctp_pending_index; i <= hal->hal_count; i++) {
+		if ((char *)hai - (char *)hal > pair->ctp_pending_size)
+			break;
+		if (hai->hai_action != HSMA_CANCEL)
+			action_fini(pair, NULL, hai, 0, -ECANCELED);
+		hai = hai_next(hai);
+	}
+	free(hal);
+	pair->ctp_pending = NULL;
 }
 
-static int process_item(struct hsm_action_item *hai, const long hal_flags)
+/* Whether any pair has received actions that are not queued yet */
+static bool loop_pending(void)
 {
-	int rc;
+	struct copytool_pair *pair;
 
-	switch (hai->hai_action) {
-	/* set err_major, minor inside these functions */
-	case HSMA_ARCHIVE:
-		rc = process_archive(hai, hal_flags);
-		break;
-	case HSMA_RESTORE:
-		rc = process_restore(hai, hal_flags);
-		break;
-	case HSMA_REMOVE:
-		rc = process_remove(hai, hal_flags);
-		break;
-	case HSMA_CANCEL:
-		LERROR("cancel not implemented for file system [%s]\n",
-		      opt.o_mnt);
-		/* Don't report progress to coordinator for this cookie:
-		 * the copy function will get ECANCELED when reporting
-		 * progress.
-		 */
-		err_minor++;
-		return 0;
-	default:
-		rc = -EINVAL;
-		LERROR("unknown action [%d] on [%s]\n", hai->hai_action,
-		       opt.o_mnt);
-		err_minor++;
-		action_fini(NULL, hai, 0, rc);
+	lond_list_for_each_entry(pair, &copytool_pairs, ctp_linkage) {
+		if (pair->ctp_pending != NULL)
+			return true;
 	}
-
-	return 0;
+	return false;
 }
 
-struct thread_data {
-	long			 hal_flags;
-	struct hsm_action_item	*hai;
-};
-
-static void *process_thread(void *data)
+/* The first signal drains the actions, a second one cancels them */
+static void loop_handle_signal(struct copytool_loop *loop)
 {
-	struct thread_data *cttd = data;
-	int rc;
+	struct copytool_pair *pair;
+	struct signalfd_siginfo info;
+	ssize_t len;
 
-	rc = process_item(cttd->hai, cttd->hal_flags);
+	len = read(loop->cl_signal.ls_fd, &info, sizeof(info));
+	if (len != sizeof(info))
+		return;
 
-	free(cttd->hai);
-	free(cttd);
-	pthread_exit((void *)(intptr_t)rc);
+	if (!loop->cl_draining) {
+		LINFO("received signal [%s], draining\n",
+		      strsignal(info.ssi_signo));
+		loop_drain(loop);
+	} else {
+		LINFO("received signal [%s] again, canceling the actions\n",
+		      strsignal(info.ssi_signo));
+		queue_cancel_all();
+		lond_list_for_each_entry(pair, &copytool_pairs, ctp_linkage)
+			pair_cancel_pending(pair);
+	}
 }
 
-static int process_item_async(const struct hsm_action_item *hai,
-			      long hal_flags)
+/* Log the progress since the last time */
+static void loop_status(struct copytool_loop *loop, time_t now)
 {
-	pthread_attr_t		 attr;
-	pthread_t		 thread;
-	struct thread_data	*data;
-	int			 rc;
+	struct metrics_gauges gauges;
+	__u64 bytes = 0;
+	int i;
 
-	data = malloc(sizeof(*data));
-	if (data == NULL)
-		return -ENOMEM;
+	for (i = 0; i < metrics_slot_number; i++)
+		bytes += metrics_load(&metrics_slots[i].ms_bytes);
+	metrics_gauges(&gauges);
+	LINFO("[%d] queued and [%d] active actions, copied [%llu] bytes at [%llu] bytes/s\n",
+	      gauges.mg_queued, gauges.mg_active, bytes,
+	      (bytes - loop->cl_status_bytes) /
+	      (now - loop->cl_status_time));
+	loop->cl_status_time = now;
+	loop->cl_status_bytes = bytes;
+}
 
-	data->hai = malloc(hai->hai_len);
-	if (data->hai == NULL) {
-		free(data);
-		return -ENOMEM;
+/* Serve the clients that haven't sent their requests in time */
+static void loop_expire_clients(struct copytool_loop *loop)
+{
+	struct loop_source *client, *n;
+	time_t now = time(NULL);
+
+	lond_list_for_each_entry_safe(client, n, &loop->cl_clients,
+				      ls_linkage) {
+		if (now >= client->ls_time + CONTROL_REQUEST_TIMEOUT)
+			loop_handle_client(loop, client, true);
 	}
+}
 
-	memcpy(data->hai, hai, hai->hai_len);
-	data->hal_flags = hal_flags;
+static void loop_handle_timer(struct copytool_loop *loop)
+{
+	time_t now = time(NULL);
+	__u64 expirations;
 
-	rc = pthread_attr_init(&attr);
-	if (rc != 0) {
-		LERROR("pthread_attr_init failed for [%s] service\n",
-		       opt.o_mnt);
-		free(data->hai);
-		free(data);
-		return -rc;
+	if (read(loop->cl_timer.ls_fd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations))
+		return;
+
+	if (opt.o_status_interval > 0 &&
+	    now >= loop->cl_status_time + opt.o_status_interval)
+		loop_status(loop, now);
+
+	if (loop->cl_draining && !loop_pending() && queue_idle()) {
+		LINFO("all actions are finished, exiting\n");
+		loop->cl_exiting = true;
 	}
+}
 
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+/*
+ * Process the items of @hal from the @index th one at @hai. If the queue is
+ * full, return -EAGAIN with @index and @hai pointing to the item to retry.
+ */
+static int hsm_action_list_process(struct copytool_pair *pair,
+				   struct hsm_action_list *hal, int msgsize,
+				   int *index, struct hsm_action_item **hai)
+{
+	int rc;
 
-	rc = pthread_create(&thread, &attr, process_thread, data);
-	if (rc != 0)
-		LERROR("cannot create thread for [%s] service\n",
-		       opt.o_mnt);
+	for (; *index <= hal->hal_count; (*index)++) {
+		if ((char *)*hai - (char *)hal > msgsize) {
+			LERROR("item [%d] of file system [%s] past end of message!\n",
+			       *index, pair->ctp_mnt);
+			__atomic_add_fetch(&err_major, 1, __ATOMIC_RELAXED);
+			return -EPROTO;
+		}
+		rc = process_item_async(pair, *hai, hal->hal_flags,
+					hal->hal_archive_id);
+		if (rc == -EAGAIN)
+			return rc;
+		if (rc < 0)
+			LERROR("failed to process item [%d] of file system [%s]\n",
+			       *index, pair->ctp_mnt);
+		*hai = hai_next(*hai);
+	}
+	return 0;
+}
 
-	pthread_attr_destroy(&attr);
+/*
+ * Keep the items of the action list that are not queued yet, and stop
+ * receiving actions of the pair until a slot of the queue is freed.
+ */
+static int hsm_action_list_pend(struct copytool_loop *loop,
+				struct copytool_pair *pair,
+				struct hsm_action_list *hal, int msgsize,
+				int index, struct hsm_action_item *hai)
+{
+	pair->ctp_pending = malloc(msgsize);
+	if (pair->ctp_pending == NULL) {
+		LERROR("failed to allocate memory, dropping [%d] actions of file system [%s]\n",
+		       hal->hal_count - index + 1, pair->ctp_mnt);
+		__atomic_add_fetch(&err_major, 1, __ATOMIC_RELAXED);
+		return -ENOMEM;
+	}
+	memcpy(pair->ctp_pending, hal, msgsize);
+	pair->ctp_pending_size = msgsize;
+	pair->ctp_pending_index = index;
+	pair->ctp_pending_offset = (char *)hai - (char *)hal;
+	loop_del(loop, &pair->ctp_source);
+	LDEBUG("queue is full, pausing file system [%s]\n", pair->ctp_mnt);
 	return 0;
 }
 
-static int hsm_action_handle(void)
+static int hsm_action_handle(struct copytool_loop *loop,
+			     struct copytool_pair *pair)
 {
 	struct hsm_action_list *hal;
 	struct hsm_action_item *hai;
 	int msgsize;
-	int i = 0;
+	int i = 1;
 	int rc;
 
 	LDEBUG("waiting for message from kernel\n");
-	rc = llapi_hsm_copytool_recv(ctdata, &hal, &msgsize);
+	rc = llapi_hsm_copytool_recv(pair->ctp_ctdata, &hal, &msgsize);
 	if (rc == -ESHUTDOWN) {
 		return rc;
 	} else if (rc < 0) {
 		LERROR("cannot receive action list: %s\n", strerror(-rc));
-		err_major++;
+		__atomic_add_fetch(&err_major, 1, __ATOMIC_RELAXED);
 		return rc;
 	}
 
 	LDEBUG("copytool fs=%s archive#=%d item_count=%d",
 	       hal->hal_fsname, hal->hal_archive_id, hal->hal_count);
 
-	if (strcmp(hal->hal_fsname, fs_name) != 0) {
+	if (strcmp(hal->hal_fsname, pair->ctp_fs_name) != 0) {
 		rc = -EINVAL;
 		LERROR("invalid fs name [%s], expecting [%s]\n",
-		       hal->hal_fsname, fs_name);
-		err_major++;
+		       hal->hal_fsname, pair->ctp_fs_name);
+		__atomic_add_fetch(&err_major, 1, __ATOMIC_RELAXED);
 		return rc;
 	}
 
 	hai = hai_first(hal);
-	while (++i <= hal->hal_count) {
-		if ((char *)hai - (char *)hal > msgsize) {
-			rc = -EPROTO;
-			LERROR("item [%d] of file system [%s] past end of message!\n",
-			       i, opt.o_mnt);
-			err_major++;
-			return rc;
+	rc = hsm_action_list_process(pair, hal, msgsize, &i, &hai);
+	/* The list is reused by the next receive, so keep a copy */
+	if (rc == -EAGAIN)
+		rc = hsm_action_list_pend(loop, pair, hal, msgsize, i, hai);
+	return rc;
+}
+
+static void loop_handle_hsm(struct copytool_loop *loop,
+			    struct copytool_pair *pair)
+{
+	int rc;
+
+	rc = hsm_action_handle(loop, pair);
+	if (rc == -ESHUTDOWN) {
+		LINFO("copytool on [%s] is shut down\n", pair->ctp_mnt);
+		loop_del(loop, &pair->ctp_source);
+		pair->ctp_source.ls_fd = -1;
+		/* Exit with the last one */
+		if (--loop->cl_pair_number == 0) {
+			LINFO("shutting down\n");
+			loop->cl_exiting = true;
 		}
-		rc = process_item_async(hai, hal->hal_flags);
-		if (rc < 0)
-			LERROR("failed to process item [%d] of file system [%s]\n",
-			       i, opt.o_mnt);
-		hai = hai_next(hai);
+	} else if (rc < 0) {
+		LERROR("failed to handle action: %s\n", strerror(-rc));
+		if (opt.o_abort_on_error &&
+		    __atomic_load_n(&err_major, __ATOMIC_RELAXED))
+			loop->cl_exiting = true;
+	}
+}
+
+/*
+ * A slot of the queue is freed, queue the pending actions of the pairs and
+ * watch their HSM fds again. The actions received before draining are still
+ * queued, but no more is received when draining.
+ */
+static void loop_handle_queue(struct copytool_loop *loop)
+{
+	struct copytool_pair *pair;
+	struct hsm_action_list *hal;
+	struct hsm_action_item *hai;
+	__u64 value;
+	int index;
+	int rc;
+
+	if (read(loop->cl_queue.ls_fd, &value, sizeof(value)) !=
+	    sizeof(value))
+		return;
+
+	lond_list_for_each_entry(pair, &copytool_pairs, ctp_linkage) {
+		hal = pair->ctp_pending;
+		if (hal == NULL)
+			continue;
+
+		index = pair->ctp_pending_index;
+		hai = (struct hsm_action_item *)((char *)hal +
+						 pair->ctp_pending_offset);
+		rc = hsm_action_list_process(pair, hal,
+					     pair->ctp_pending_size, &index,
+					     &hai);
+		if (rc == -EAGAIN) {
+			pair->ctp_pending_index = index;
+			pair->ctp_pending_offset = (char *)hai - (char *)hal;
+			break;
+		}
+
+		free(hal);
+		pair->ctp_pending = NULL;
+		LDEBUG("resuming file system [%s]\n", pair->ctp_mnt);
+		if (loop->cl_draining)
+			continue;
+		rc = loop_add(loop, &pair->ctp_source, pair->ctp_source.ls_fd,
+			      LS_HSM);
+		if (rc) {
+			LERROR("failed to resume file system [%s]: %s\n",
+			       pair->ctp_mnt, strerror(-rc));
+			__atomic_add_fetch(&err_major, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static int loop_run(struct copytool_loop *loop)
+{
+	struct epoll_event events[16];
+	struct copytool_pair *pair;
+	struct loop_source *source;
+	int count;
+	int i;
+
+	while (!loop->cl_exiting) {
+		count = epoll_wait(loop->cl_epoll_fd, events,
+				   ARRAY_SIZE(events), -1);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0) {
+			LERROR("failed to wait for events: %s\n",
+			       strerror(errno));
+			return -errno;
+		}
+
+		for (i = 0; i < count && !loop->cl_exiting; i++) {
+			source = events[i].data.ptr;
+			switch (source->ls_type) {
+			case LS_HSM:
+				pair = lond_list_entry(source,
+						       struct copytool_pair,
+						       ctp_source);
+				/* Might be stopped by an earlier event */
+				if (!loop->cl_draining &&
+				    pair->ctp_pending == NULL &&
+				    pair->ctp_source.ls_fd >= 0)
+					loop_handle_hsm(loop, pair);
+				break;
+			case LS_SIGNAL:
+				loop_handle_signal(loop);
+				break;
+			case LS_TIMER:
+				loop_handle_timer(loop);
+				break;
+			case LS_CONTROL:
+				loop_handle_control(loop);
+				break;
+			case LS_CLIENT:
+				loop_handle_client(loop, source, false);
+				break;
+			case LS_QUEUE:
+				loop_handle_queue(loop);
+				break;
+			}
+		}
+		/* Not in the handlers, the clients might have events above */
+		loop_expire_clients(loop);
 	}
 	return 0;
 }
 
-static int setup(void)
+/* @paths are the source and dest of @pair_number pairs */
+static int setup(char *const *paths, int pair_number)
 {
 	int rc;
+	int i;
 
 	debug_level = DEBUG;
 
-	rc = llapi_search_fsname(opt.o_mnt, fs_name);
-	if (rc < 0) {
-		LERROR("cannot find a Lustre filesystem mounted at [%s]\n",
-		       opt.o_mnt);
-		return rc;
+	for (i = 0; i < pair_number; i++) {
+		rc = pair_add(NULL, paths[i * 2], paths[i * 2 + 1],
+			      opt.o_archive_id, opt.o_archive_id_used);
+		if (rc)
+			return rc;
 	}
 
-	opt.o_mnt_fd = open(opt.o_mnt, O_RDONLY);
-	if (opt.o_mnt_fd < 0) {
-		rc = -errno;
-		LERROR("cannot open mount point at [%s]\n", opt.o_mnt,
-		       strerror(errno));
+	/* One slot for each worker thread and slot 0 for the others */
+	metrics_slot_number = opt.o_thread_number + 1;
+	metrics_slots = calloc(metrics_slot_number, sizeof(*metrics_slots));
+	if (metrics_slots == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	tuner.ct_chunk_size = opt.o_chunk_size;
+	rc = lond_buf_pool_init(&buf_pool, copy_buf_size(),
+				opt.o_buffer_pool > 0 ? opt.o_buffer_pool :
+				opt.o_thread_number * opt.o_split_threads,
+				opt.o_hugepage);
+	if (rc) {
+		LERROR("failed to init buffer pool\n");
 		return rc;
 	}
 	return 0;
@@ -590,17 +4350,17 @@ static int setup(void)
 
 static int cleanup(void)
 {
-	int rc;
+	struct copytool_pair *pair, *n;
 
-	if (opt.o_mnt_fd >= 0) {
-		rc = close(opt.o_mnt_fd);
-		if (rc < 0) {
-			rc = -errno;
-			LERROR("cannot close mount point [%s]: %s\n",
-			       opt.o_mnt, strerror(errno));
-			return rc;
-		}
+	lond_list_for_each_entry_safe(pair, n, &copytool_pairs, ctp_linkage) {
+		lond_list_del(&pair->ctp_linkage);
+		pair_destroy(pair);
 	}
+	recent_fid_fini();
+	lond_buf_pool_fini(&buf_pool);
+	free(metrics_slots);
+	metrics_slots = NULL;
+	metrics_slot_number = 0;
 
 	if (opt.o_archive_id_cnt > 0) {
 		free(opt.o_archive_id);
@@ -613,7 +4373,9 @@ static int cleanup(void)
 
 static int start_copytool(void)
 {
-	struct sigaction cleanup_sigaction;
+	struct copytool_loop loop;
+	struct copytool_pair *pair;
+	sigset_t signals;
 	int rc;
 
 	if (opt.o_daemonize) {
@@ -625,64 +4387,82 @@ static int start_copytool(void)
 		}
 	}
 
-	rc = llapi_hsm_copytool_register(&ctdata, opt.o_mnt,
-					 opt.o_archive_id_used,
-					 opt.o_archive_id, 0);
-	if (rc < 0) {
-		LERROR("failed to register copytool: %s\n", strerror(-rc));
-		if (rc == -ENXIO) {
-			/* HSM coordinator thread might not be running */
-			LERROR("HSM feature might not be enabled which can be started by running following command on all MDTs of this file system:\nlctl set_param mdt.%s-MDT${INDEX}.hsm_control=enabled\n",
-			       fs_name);
-		}
+	/* Block the signals before creating the threads, they inherit it */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	rc = queue_start();
+	if (rc) {
+		LERROR("failed to start the worker threads\n");
 		return rc;
 	}
 
-	memset(&cleanup_sigaction, 0, sizeof(cleanup_sigaction));
-	cleanup_sigaction.sa_handler = handler;
-	sigemptyset(&cleanup_sigaction.sa_mask);
-	sigaction(SIGINT, &cleanup_sigaction, NULL);
-	sigaction(SIGTERM, &cleanup_sigaction, NULL);
-
-	while (1) {
-		rc = hsm_action_handle();
-		if (rc == -ESHUTDOWN) {
-			LINFO("shutting down\n");
-			break;
-		} else if (rc < 0) {
-			LERROR("failed to handle action: %s\n",
-			       strerror(-rc));
-			if (opt.o_abort_on_error && err_major)
-				break;
-		}
+	rc = loop_init(&loop, &signals);
+	if (rc)
+		goto out_stop;
 
-		if (exiting) {
-			LINFO("exiting\n");
-			return 0;
-		}
+	lond_list_for_each_entry(pair, &copytool_pairs, ctp_linkage) {
+		rc = pair_register(&loop, pair);
+		if (rc)
+			goto out_fini;
 	}
 
-	rc = llapi_hsm_copytool_unregister(&ctdata);
-	if (rc < 0) {
-		LERROR("failed to unregister copytool\n");
-		return rc;
-	}
+	rc = loop_run(&loop);
+out_fini:
+	loop_fini(&loop);
+out_stop:
+	/* The pairs are unregistered after the actions are finished */
+	queue_stop();
 	return rc;
 }
 
 static void usage(const char *prog, int rc)
 {
 	fprintf(stderr,
-		"Usage: %s [OPTION] <source> <dest>\n"
+		"Usage: %s [OPTION] [<source> <dest>]...\n"
 		"  options:\n"
 		"    -h|--help  print this help\n"
 		"    -i|--identity <archive_id>   set the ID(s)\n"
-		"    --daemon   daemonize this copytool\n"
+		"    -t|--threads <number>   number of threads to process the actions, default: %d\n"
+		"    -q|--queue-depth <number>   max number of actions waiting to be processed, default: %d times of thread number\n"
+		"    -u|--uring-depth <number>   copy with io_uring with number of chunks in flight per file, default: 0 (disabled)\n"
+		"    -p|--split-threads <number>   number of threads to copy a large file, default: %d\n"
+		"    -s|--split-size <bytes>   copy files not smaller than this with multiple threads, default: %llu\n"
+		"    -z|--small-size <bytes>   restores of files smaller than this have high priority, default: %llu\n"
+		"    -a|--priority-age <seconds>   promote an action by one priority class after waiting for this long, default: %d\n"
+		"    -o|--ost-streams <number>   max number of restores reading from the same OST, 0 for no limit, default: %d\n"
+		"    -e|--readahead-files <number>   restore this many released siblings after a restored file, default: 0 (disabled)\n"
+		"    -E|--readahead-bytes <bytes>   max bytes of the siblings to restore after a restored file, default: %llu\n"
+		"    -l|--willread-size <bytes>   advise the OSTs to read ahead this many bytes of the source, 0 to disable, default: %llu\n"
+		"    -C|--chunk-size <bytes>   max bytes to copy at a time, multiple of %d, default: %d\n"
+		"    -P|--buffer-pool <number>   max number of copy buffers, default: number of threads times split threads\n"
+		"    -H|--hugepage   back the copy buffers with huge pages\n"
+		"    -D|--direct   copy with O_DIRECT and keep the copied data out of the page cache\n"
+		"    -A|--autotune <seconds>   adjust the chunk size and the number of active streams with this interval, default: 0 (disabled)\n"
+		"    -m|--min-chunk-size <bytes>   min chunk size of the auto-tuner, default: %d\n"
+		"    -M|--max-chunk-size <bytes>   max chunk size of the auto-tuner, default: %d\n"
+		"    -n|--min-streams <number>   min number of active streams of the auto-tuner, the max is the thread number, default: 1\n"
+		"    -S|--control-socket <path>   serve commands on this Unix socket, the metrics are replied to other requests, in JSON if the request contains \"json\", otherwise in the text format of Prometheus\n"
+		"        commands: metrics [json], stats, get-config, set-config <name>=<value>..., add-pair <source> <dest> [<archive_id>...], drain\n"
+		"        configs: read_bandwidth, write_bandwidth, threads, queue_depth, small_size, priority_age, ost_streams\n"
+		"    -T|--status-interval <seconds>   log the progress with this interval, default: 0 (disabled)\n"
+		"    -b|--bandwidth <bytes>   limit both read and write bandwidth of all threads in bytes per second, default: 0 (unlimited)\n"
+		"    -r|--read-bandwidth <bytes>   limit the read bandwidth of all threads in bytes per second, default: 0 (unlimited)\n"
+		"    -w|--write-bandwidth <bytes>   limit the write bandwidth of all threads in bytes per second, default: 0 (unlimited)\n"
+		"    --daemon   daemonize this copytool, the first SIGINT or SIGTERM finishes the received actions before exiting, a second one cancels them\n"
 		"\n"
 		"  source: source Lustre mount point or fsname\n"
-		"  dest: target Lustre mount point or fsname\n"
+		"  dest: target Lustre mount point or fsname, the copytool registers on it with the archive IDs\n"
+		"  pairs can be added at runtime with command \"add-pair <source> <dest> [<archive_id>...]\" on the control socket\n"
 		"  archive_id: integer archive ID\n",
-		prog);
+		prog, THREAD_NUMBER_DEFAULT, QUEUE_DEPTH_FACTOR,
+		SPLIT_THREADS_DEFAULT, SPLIT_SIZE_DEFAULT, SMALL_SIZE_DEFAULT,
+		PRIORITY_AGE_DEFAULT, OST_STREAMS_DEFAULT,
+		READAHEAD_BYTES_DEFAULT, WILLREAD_SIZE_DEFAULT,
+		LOND_DIRECT_IO_ALIGN, CHUNK_SIZE_DEFAULT,
+		MIN_CHUNK_SIZE_DEFAULT, MAX_CHUNK_SIZE_DEFAULT);
 	exit(rc);
 }
 
@@ -722,7 +4502,8 @@ static int parse_option_archive(const char *opt_string)
 	if (opt.o_archive_id_used >= opt.o_archive_id_cnt) {
 		int *tmp;
 
-		opt.o_archive_id_cnt *= 2;
+		opt.o_archive_id_cnt = opt.o_archive_id_cnt > 0 ?
+			opt.o_archive_id_cnt * 2 : 4;
 		tmp = realloc(opt.o_archive_id, sizeof(*opt.o_archive_id) *
 							opt.o_archive_id_cnt);
 		if (tmp == NULL)
@@ -740,16 +4521,41 @@ int main(int argc, char *const argv[])
 	struct option long_opts[] = {
 		{"identity",	required_argument,	NULL,	'i'},
 		{"help",	no_argument,		NULL,	'h'},
+		{"threads",	required_argument,	NULL,	't'},
+		{"queue-depth",	required_argument,	NULL,	'q'},
+		{"uring-depth",	required_argument,	NULL,	'u'},
+		{"split-threads", required_argument,	NULL,	'p'},
+		{"split-size",	required_argument,	NULL,	's'},
+		{"small-size",	required_argument,	NULL,	'z'},
+		{"priority-age", required_argument,	NULL,	'a'},
+		{"ost-streams",	required_argument,	NULL,	'o'},
+		{"readahead-files", required_argument,	NULL,	'e'},
+		{"readahead-bytes", required_argument,	NULL,	'E'},
+		{"willread-size", required_argument,	NULL,	'l'},
+		{"chunk-size",	required_argument,	NULL,	'C'},
+		{"buffer-pool",	required_argument,	NULL,	'P'},
+		{"hugepage",	no_argument,		NULL,	'H'},
+		{"direct",	no_argument,		NULL,	'D'},
+		{"autotune",	required_argument,	NULL,	'A'},
+		{"min-chunk-size", required_argument,	NULL,	'm'},
+		{"max-chunk-size", required_argument,	NULL,	'M'},
+		{"min-streams",	required_argument,	NULL,	'n'},
+		{"control-socket", required_argument,	NULL,	'S'},
+		{"status-interval", required_argument,	NULL,	'T'},
+		{"bandwidth",	required_argument,	NULL,	'b'},
+		{"read-bandwidth", required_argument,	NULL,	'r'},
+		{"write-bandwidth", required_argument,	NULL,	'w'},
 		{"daemon",	no_argument, &opt.o_daemonize,	1},
 		{0, 0, 0, 0}
 	};
 	int rc;
 	int c;
-	char *lustre;
-	char hsm_buffer[PATH_MAX];
-	char buffer[PATH_MAX];
+	char *end;
+	unsigned long long bandwidth;
+	int val;
+	char short_opts[] = "a:A:b:C:De:E:hHi:l:m:M:n:o:p:P:q:r:s:S:t:T:u:w:z:";
 
-	while ((c = getopt_long(argc, argv, "hi:",
+	while ((c = getopt_long(argc, argv, short_opts,
 				long_opts, NULL)) != -1) {
 		switch (c) {
 		case 'i':
@@ -760,6 +4566,165 @@ int main(int argc, char *const argv[])
 				return rc;
 			}
 			break;
+		case 't':
+			opt.o_thread_number = atoi(optarg);
+			if (opt.o_thread_number <= 0) {
+				LERROR("invalid thread number [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'q':
+			opt.o_queue_depth = atoi(optarg);
+			if (opt.o_queue_depth <= 0) {
+				LERROR("invalid queue depth [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'u':
+			opt.o_uring_depth = atoi(optarg);
+			if (opt.o_uring_depth < 0) {
+				LERROR("invalid io_uring depth [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+#ifndef HAVE_LIBURING
+			if (opt.o_uring_depth > 0) {
+				LERROR("io_uring is not supported by this build\n");
+				usage(argv[0], -EOPNOTSUPP);
+			}
+#endif
+			break;
+		case 'p':
+			opt.o_split_threads = atoi(optarg);
+			if (opt.o_split_threads <= 0) {
+				LERROR("invalid split thread number [%s]\n",
+				       optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 's':
+			opt.o_split_size = strtoull(optarg, &end, 10);
+			if (*end != '\0' || opt.o_split_size == 0) {
+				LERROR("invalid split size [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'z':
+			opt.o_small_size = strtoull(optarg, &end, 10);
+			if (*end != '\0') {
+				LERROR("invalid small size [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'a':
+			opt.o_priority_age = atoi(optarg);
+			if (opt.o_priority_age <= 0) {
+				LERROR("invalid priority age [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'o':
+			opt.o_ost_streams = atoi(optarg);
+			if (opt.o_ost_streams < 0) {
+				LERROR("invalid OST streams [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'e':
+			opt.o_readahead_files = atoi(optarg);
+			if (opt.o_readahead_files < 0) {
+				LERROR("invalid readahead files [%s]\n",
+				       optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'E':
+			opt.o_readahead_bytes = strtoull(optarg, &end, 10);
+			if (*end != '\0') {
+				LERROR("invalid readahead bytes [%s]\n",
+				       optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'l':
+			opt.o_willread_size = strtoull(optarg, &end, 10);
+			if (*end != '\0') {
+				LERROR("invalid willread size [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'C':
+			opt.o_chunk_size = atoi(optarg);
+			if (opt.o_chunk_size <= 0 ||
+			    opt.o_chunk_size % LOND_DIRECT_IO_ALIGN != 0) {
+				LERROR("invalid chunk size [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'P':
+			opt.o_buffer_pool = atoi(optarg);
+			if (opt.o_buffer_pool <= 0) {
+				LERROR("invalid buffer pool size [%s]\n",
+				       optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'H':
+			opt.o_hugepage = true;
+			break;
+		case 'D':
+			opt.o_nocache = true;
+			break;
+		case 'A':
+			opt.o_autotune = atoi(optarg);
+			if (opt.o_autotune < 0) {
+				LERROR("invalid autotune interval [%s]\n",
+				       optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'm':
+		case 'M':
+			val = atoi(optarg);
+			if (val <= 0 || val % LOND_DIRECT_IO_ALIGN != 0) {
+				LERROR("invalid chunk size [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			if (c == 'm')
+				opt.o_min_chunk_size = val;
+			else
+				opt.o_max_chunk_size = val;
+			break;
+		case 'n':
+			opt.o_min_streams = atoi(optarg);
+			if (opt.o_min_streams <= 0) {
+				LERROR("invalid min streams [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'S':
+			opt.o_control_socket = optarg;
+			break;
+		case 'T':
+			opt.o_status_interval = atoi(optarg);
+			if (opt.o_status_interval < 0) {
+				LERROR("invalid status interval [%s]\n",
+				       optarg);
+				usage(argv[0], -EINVAL);
+			}
+			break;
+		case 'b':
+		case 'r':
+		case 'w':
+			bandwidth = strtoull(optarg, &end, 10);
+			if (*end != '\0') {
+				LERROR("invalid bandwidth [%s]\n", optarg);
+				usage(argv[0], -EINVAL);
+			}
+			if (c != 'w')
+				opt.o_read_bandwidth = bandwidth;
+			if (c != 'r')
+				opt.o_write_bandwidth = bandwidth;
+			break;
 		case 'h':
 			usage(argv[0], 0);
 		case 0:
@@ -770,48 +4735,30 @@ int main(int argc, char *const argv[])
 		}
 	}
 
-	if (argc != optind + 2) {
-		rc = -EINVAL;
-		LERROR("must specify source and dest Lustre file systems\n");
-		usage(argv[0], rc);
-	}
-
-	lustre = argv[optind];
-	if (lustre[0] == '/') {
-		opt.o_hsm_root = lustre;
-	} else {
-		opt.o_hsm_root = hsm_buffer;
-		rc = llapi_search_rootpath(hsm_buffer, lustre);
-		if (rc) {
-			LERROR("failed to find root path of Lustre file system [%s]",
-			       lustre);
-			return rc;
-		}
-	}
-	optind++;
-
-	lustre = argv[optind];
-	if (lustre[0] == '/') {
-		opt.o_mnt = lustre;
-	} else {
-		opt.o_mnt = buffer;
-		rc = llapi_search_rootpath(buffer, lustre);
-		if (rc) {
-			LERROR("failed to find root path of Lustre file system [%s]",
-			       lustre);
-			return rc;
+	if (opt.o_autotune > 0) {
+		if (opt.o_min_chunk_size > opt.o_max_chunk_size ||
+		    opt.o_min_streams > opt.o_thread_number) {
+			LERROR("invalid bounds of the auto-tuner\n");
+			usage(argv[0], -EINVAL);
 		}
+		/* Start from the given chunk size within the bounds */
+		if (opt.o_chunk_size < opt.o_min_chunk_size)
+			opt.o_chunk_size = opt.o_min_chunk_size;
+		else if (opt.o_chunk_size > opt.o_max_chunk_size)
+			opt.o_chunk_size = opt.o_max_chunk_size;
 	}
 
-	opt.o_mnt_fd = -1;
-
-	if (opt.o_hsm_root == NULL) {
-		LERROR("must specify a root directory for the backend using option [-b]\n");
+	if ((argc - optind) % 2 != 0 ||
+	    (argc == optind && opt.o_control_socket == NULL)) {
 		rc = -EINVAL;
+		LERROR("must specify source and dest Lustre file systems\n");
 		usage(argv[0], rc);
 	}
 
-	rc = setup();
+	lond_token_bucket_init(&read_bucket, opt.o_read_bandwidth);
+	lond_token_bucket_init(&write_bucket, opt.o_write_bandwidth);
+
+	rc = setup(argv + optind, (argc - optind) / 2);
 	if (rc) {
 		LERROR("failed to setup\n");
 		goto out_cleanup;
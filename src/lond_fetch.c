@@ -19,7 +19,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <ftw.h>
 #include <inttypes.h>
 #ifdef NEW_USER_HEADER
 #include <linux/lustre/lustre_user.h>
@@ -29,7 +28,6 @@
 #include <lustre/lustreapi.h>
 #include "definition.h"
 #include "debug.h"
-#include "cmd.h"
 #include "lond.h"
 
 static void usage(const char *prog)
@@ -38,8 +36,10 @@ static void usage(const char *prog)
 		"Usage: %s [option]... <source>... <dest>\n"
 		"  source: global Lustre directory tree to fetch from\n"
 		"  dest: local Lustre directory to fetch to\n"
-		"  -r|--rename: rename the source directory after finished fetching\n",
-		prog);
+		"  -p|--prefetch: request restores of the fetched files in the background\n"
+		"  -r|--rename: rename the source directory after finished fetching\n"
+		"  -t|--threads: number of threads to scan the source, default: %d\n",
+		prog, LOND_WALK_THREADS_DEFAULT);
 }
 
 static inline void fid2str(char *buf, const struct lu_fid *fid, int len)
@@ -47,8 +47,41 @@ static inline void fid2str(char *buf, const struct lu_fid *fid, int len)
 	snprintf(buf, len, DFID_NOBRACE, PFID(fid));
 }
 
-static int lond_write_local_xattr(char const *src_name, char const *dst_name,
-				  int dst_fd, struct lond_key *key,
+/* Private data of walking the source directory tree */
+struct fetch_walk_private {
+	/* The key to used to lock the global Lustre */
+	struct lond_key		*fwp_key;
+	/* The HSM archive ID */
+	__u32			 fwp_archive_id;
+	/* The dest directory to copy to */
+	char			 fwp_dest[PATH_MAX + 1];
+	/*
+	 * The source directory under the dest directory. This is genrated
+	 * when visiting the root of the walk, which is always visited before
+	 * any other inode. So there is no need to init it before walking.
+	 */
+	char			 fwp_dest_source_dir[PATH_MAX + 2];
+	/* Hash table to check whether the inode is already created before */
+	struct dest_entry	*fwp_dest_entry_table;
+	/* Restore requests of the fetched files, NULL if not prefetching */
+	struct lond_hsm_batch	*fwp_restore_batch;
+};
+
+/* Private data of creating a stub for a locked source inode */
+struct fetch_stub_private {
+	/* The key used to lock the global Lustre */
+	struct lond_key		*fsp_key;
+	/* The HSM archive ID */
+	__u32			 fsp_archive_id;
+	/* The FID of the source inode, got from the locked fd */
+	struct lu_fid		 fsp_global_fid;
+	/* Restore requests of the fetched files, NULL if not prefetching */
+	struct lond_hsm_batch	*fsp_restore_batch;
+};
+
+static int lond_write_local_xattr(char const *dst_name, int dst_fd,
+				  struct lond_key *key,
+				  const struct lu_fid *global_fid,
 				  bool is_root)
 {
 	int rc;
@@ -58,12 +91,8 @@ static int lond_write_local_xattr(char const *src_name, char const *dst_name,
 	disk.llx_is_root = is_root;
 	disk.llx_magic = LOND_MAGIC;
 	disk.llx_version = LOND_VERSION;
+	memcpy(&disk.llx_global_fid, global_fid, sizeof(*global_fid));
 
-	rc = llapi_path2fid(src_name, &disk.llx_global_fid);
-	if (rc) {
-		LERROR("failed to get fid of [%s]\n", src_name);
-		return rc;
-	}
 	if (dst_fd < 0)
 		rc = lsetxattr(dst_name, XATTR_NAME_LOND_LOCAL,
 			       &disk, sizeof(disk), 0);
@@ -78,69 +107,51 @@ static int lond_write_local_xattr(char const *src_name, char const *dst_name,
 	return rc;
 }
 
+/*
+ * Create a released file with the size, mode, owner and timestamps of the
+ * source in one import operation, so the stub has the correct size without
+ * being restored.
+ */
 static int create_stub_reg(char const *src_name, char const *dst_name,
 			   mode_t dst_mode, mode_t omitted_permissions,
 			   struct stat const *src_sb, void *private)
 {
 	int rc;
-	int dest_desc;
-	int open_flags = O_WRONLY | O_CREAT;
-	char cmd[PATH_MAX];
-	int cmdsz = sizeof(cmd);
-	struct lond_key *key = (struct lond_key *)private;
-
-	dest_desc = open(dst_name, open_flags | O_EXCL,
-			 dst_mode & ~omitted_permissions);
-	if (dest_desc < 0) {
-		LERROR("failed to create regular file [%s]: %s\n",
-		       dst_name, strerror(errno));
-		return -1;
-	}
-
-	rc = lond_write_local_xattr(src_name, dst_name, dest_desc, key, false);
+	struct stat import_sb;
+	struct lu_fid local_fid;
+	struct fetch_stub_private *stub = private;
+
+	memcpy(&import_sb, src_sb, sizeof(import_sb));
+	import_sb.st_mode = src_sb->st_mode & ~omitted_permissions;
+	rc = llapi_hsm_import(dst_name, stub->fsp_archive_id, &import_sb,
+			      0, -1, 0, LOV_PATTERN_RAID0, NULL, &local_fid);
 	if (rc) {
-		LERROR("failed to write local xattr of regular file [%s]: %s\n",
-		       dst_name, strerror(errno));
-		goto out_close;
+		LERROR("failed to import regular file [%s]: %s\n",
+		       dst_name, strerror(-rc));
+		return rc;
 	}
 
-	rc = llapi_hsm_state_set_fd(dest_desc, HS_EXISTS | HS_ARCHIVED, 0,
-				    nftw_private.u.np_fetch.npf_archive_id);
+	rc = lond_write_local_xattr(dst_name, -1, stub->fsp_key,
+				    &stub->fsp_global_fid, false);
 	if (rc) {
-		LERROR("failed to set the HSM state of file [%s]: %s\n",
-		       dst_name, strerror(errno));
-		goto out_close;
-	}
-
-	if (close(dest_desc) < 0) {
-		LERROR("failed to close regular file [%s]: %s\n",
+		LERROR("failed to write local xattr of regular file [%s]: %s\n",
 		       dst_name, strerror(errno));
-		return -1;
-	}
-
-	snprintf(cmd, cmdsz, "lfs hsm_release '%s'", dst_name);
-	rc = command_run(cmd, cmdsz);
-	if (rc) {
-		LERROR("failed to HSM release file [%s], rc = %d\n",
-		       dst_name, rc);
-		goto out_close;
+		return rc;
 	}
 
-	return rc;
-out_close:
-	if (close(dest_desc) < 0) {
-		LERROR("failed to close regular file [%s]: %s\n",
-		       dst_name, strerror(errno));
-		return -1;
-	}
-	return rc;
+	/* Prefetching is only an optimization, don't fail the fetch */
+	if (stub->fsp_restore_batch != NULL &&
+	    lond_hsm_batch_add(stub->fsp_restore_batch, &local_fid))
+		LERROR("failed to request restore of [%s]\n", dst_name);
+	return 0;
 }
 
-/* The function of nftw() to fetch files */
-static int nftw_fetch_fn(const char *fpath, const struct stat *sb,
-			 int tflag, struct FTW *ftwbuf)
+/* The visit function of lond_walk_tree() to fetch files */
+static int walk_fetch_fn(struct lond_walk_thread *thread,
+			 struct lond_walk_entry *entry)
 {
 	int rc;
+	int fd = -1;
 	char *cwd;
 	const char *base;
 	char cwd_buf[PATH_MAX];
@@ -148,16 +159,19 @@ static int nftw_fetch_fn(const char *fpath, const struct stat *sb,
 	char dest_dir[PATH_MAX + 3];
 	int dest_dir_size = sizeof(dest_dir);
 	char full_fpath[PATH_MAX];
+	struct fetch_walk_private *fetch = thread->lwt_walk->lw_private;
 	/* The dest directory that contains the source basename */
-	char *dest_source_dir = nftw_private.u.np_fetch.npf_dest_source_dir;
-	int dest_source_size;
-	char *dest = nftw_private.u.np_fetch.npf_dest;
-	struct dest_entry **head;
-	bool is_root = (strlen(fpath) == 1 && fpath[0] == '.');
-	struct lond_key *key = nftw_private.u.np_fetch.npf_key;
-
-	dest_source_size = sizeof(nftw_private.u.np_fetch.npf_dest_source_dir);
-	head = &nftw_private.u.np_fetch.npf_dest_entry_table;
+	char *dest_source_dir = fetch->fwp_dest_source_dir;
+	int dest_source_size = sizeof(fetch->fwp_dest_source_dir);
+	char *dest = fetch->fwp_dest;
+	struct dest_entry **head = &fetch->fwp_dest_entry_table;
+	const char *fpath = entry->lwe_path;
+	const struct stat *sb = &entry->lwe_stat;
+	bool is_root = (entry->lwe_level == 0);
+	struct lond_key *key = fetch->fwp_key;
+	struct fetch_stub_private stub;
+	struct stat locked_sb;
+	struct stat *src_sb = NULL;
 
 	rc = get_full_fpath(fpath, full_fpath, PATH_MAX);
 	if (rc) {
@@ -165,37 +179,67 @@ static int nftw_fetch_fn(const char *fpath, const struct stat *sb,
 		return rc;
 	}
 
-	LDEBUG("%-3s %2d %7lld   %-40s %d %s\n",
-	       (tflag == FTW_D) ?   "d"   : (tflag == FTW_DNR) ? "dnr" :
-	       (tflag == FTW_DP) ?  "dp"  : (tflag == FTW_F) ?   "f" :
-	       (tflag == FTW_NS) ?  "ns"  : (tflag == FTW_SL) ?  "sl" :
-	       (tflag == FTW_SLN) ? "sln" : "???",
-	       ftwbuf->level, (long long int)sb->st_size,
-	       full_fpath, ftwbuf->base, fpath + ftwbuf->base);
-
-	/* Only set directory and regular file to immutable */
+	LDEBUG("%-3s %2d %7lld   %-40s %s\n",
+	       S_ISDIR(sb->st_mode) ? "d" : S_ISLNK(sb->st_mode) ? "sl" : "f",
+	       entry->lwe_level, (long long int)sb->st_size,
+	       full_fpath, entry->lwe_name);
+
+	stub.fsp_key = key;
+	stub.fsp_archive_id = fetch->fwp_archive_id;
+	stub.fsp_restore_batch = fetch->fwp_restore_batch;
+	memset(&stub.fsp_global_fid, 0, sizeof(stub.fsp_global_fid));
+	/*
+	 * Only set directory and regular file to immutable. Lock, get the FID
+	 * and stat of the inode through the same fd, so that the source path
+	 * is only looked up once.
+	 */
 	if (S_ISREG(sb->st_mode) || S_ISDIR(sb->st_mode)) {
+		fd = lond_inode_flags_openat(entry->lwe_dirfd,
+					     entry->lwe_name, fpath);
+		if (fd < 0) {
+			LERROR("failed to open file [%s]\n", full_fpath);
+			return fd;
+		}
+
 		/* Lock the inode first before copying to dest */
-		rc = lond_inode_lock(fpath, key, is_root);
+		rc = lond_inode_lock_fd(fd, fpath, key, is_root);
 		if (rc) {
 			LERROR("failed to lock file [%s]\n", full_fpath);
-			return rc;
+			goto out_close;
 		}
-	}
 
-	cwd = getcwd(cwd_buf, cwdsz);
-	if (cwd == NULL) {
-		LERROR("failed to get cwd: %s\n", strerror(errno));
-		return -errno;
+		rc = llapi_fd2fid(fd, &stub.fsp_global_fid);
+		if (rc) {
+			LERROR("failed to get fid of [%s]: %s\n", full_fpath,
+			       strerror(-rc));
+			goto out_close;
+		}
+
+		rc = fstat(fd, &locked_sb);
+		if (rc) {
+			rc = -errno;
+			LERROR("failed to stat [%s]: %s\n", full_fpath,
+			       strerror(errno));
+			goto out_close;
+		}
+		src_sb = &locked_sb;
 	}
 
 	if (is_root) {
+		cwd = getcwd(cwd_buf, cwdsz);
+		if (cwd == NULL) {
+			rc = -errno;
+			LERROR("failed to get cwd: %s\n", strerror(errno));
+			goto out_close;
+		}
+
 		base = basename(cwd);
 		if (strlen(dest) == 1) {
 			if (dest[0] != '/') {
 				LERROR("unexpected dest [%s], expected [/]\n",
 				       dest);
-				return -EINVAL;
+				rc = -EINVAL;
+				goto out_close;
 			}
 			snprintf(dest_source_dir, dest_source_size, "/%s",
 				 base);
@@ -204,33 +248,36 @@ static int nftw_fetch_fn(const char *fpath, const struct stat *sb,
 				 dest, base);
 		}
 
-		rc = lond_copy_inode(head, fpath, dest_source_dir,
-				     create_stub_reg, key);
+		rc = lond_copy_inode(head, fpath, src_sb, dest_source_dir,
+				     create_stub_reg, &stub);
 		if (rc) {
 			LERROR("failed to create stub inode of [%s] in target [%s]\n",
 			       full_fpath, dest_source_dir);
-			return rc;
+			goto out_close;
 		}
 
-		rc = lond_write_local_xattr(fpath, dest_source_dir, -1, key,
-					    true);
+		rc = lond_write_local_xattr(dest_source_dir, -1, key,
+					    &stub.fsp_global_fid, true);
 		if (rc) {
 			LERROR("failed to set local xattr on [%s]\n",
 			       dest_source_dir);
-			return rc;
+			goto out_close;
 		}
 	} else {
 		snprintf(dest_dir, dest_dir_size, "%s/%s", dest_source_dir,
 			 fpath);
-		rc = lond_copy_inode(head, fpath, dest_dir, create_stub_reg,
-				     key);
+		rc = lond_copy_inode(head, fpath, src_sb, dest_dir,
+				     create_stub_reg, &stub);
 		if (rc) {
 			LERROR("failed to create stub inode of [%s] in target [%s]\n",
 			       full_fpath, dest_source_dir);
-			return rc;
+			goto out_close;
 		}
 	}
 
+out_close:
+	if (fd >= 0)
+		close(fd);
 	return rc;
 }
 
@@ -331,13 +378,15 @@ static int lond_rename(struct lond_key *key, const char *key_str)
 	return 0;
 }
 
-static int lond_fetch(const char *source, const char *dest,
-		      const char *dest_fsname, struct lond_key *key,
-		      const char *key_str, bool need_rename)
+static int lond_fetch(const char *source, struct fetch_walk_private *fetch,
+		      const char *dest_fsname, const char *key_str,
+		      bool need_rename, int thread_number)
 {
 	int rc;
 	int rc2;
-	int flags = FTW_PHYS;
+	struct lond_walk walk;
+	const char *dest = fetch->fwp_dest;
+	struct lond_key *key = fetch->fwp_key;
 	char source_fsname[MAX_OBD_NAME + 1];
 
 	rc = lustre_directory2fsname(source, source_fsname);
@@ -373,9 +422,13 @@ static int lond_fetch(const char *source, const char *dest,
 		return rc;
 	}
 
-	nftw_private.u.np_fetch.npf_dest_entry_table = NULL;
-	rc = nftw(".", nftw_fetch_fn, 32, flags);
-	free_dest_table(&nftw_private.u.np_fetch.npf_dest_entry_table);
+	memset(&walk, 0, sizeof(walk));
+	walk.lw_thread_number = thread_number;
+	walk.lw_private = fetch;
+	walk.lw_visit = walk_fetch_fn;
+	fetch->fwp_dest_entry_table = NULL;
+	rc = lond_walk_tree(".", &walk);
+	free_dest_table(&fetch->fwp_dest_entry_table);
 	if (rc) {
 		LERROR("failed to fetch directory tree [%s] to target [%s] with key [%s]\n",
 		       source, dest, key_str);
@@ -394,7 +447,7 @@ static int lond_fetch(const char *source, const char *dest,
 	}
 	return 0;
 out_unlock:
-	rc2 = lond_tree_unlock(".", false, key, true);
+	rc2 = lond_tree_unlock(".", false, key, true, thread_number);
 	if (rc2) {
 		LERROR("failed to unlcok, you might want to run [lond unlock -k %s %s] to cleanup\n",
 		       key_str, source);
@@ -422,11 +475,12 @@ int main(int argc, char *const argv[])
 	int rc;
 	int rc2 = 0;
 	const char *source;
-	char *dest = nftw_private.u.np_fetch.npf_dest;
-	int dest_size = sizeof(nftw_private.u.np_fetch.npf_dest);
+	struct fetch_walk_private fetch;
+	char *dest = fetch.fwp_dest;
+	int dest_size = sizeof(fetch.fwp_dest);
 	struct option long_opts[] = LOND_FETCH_OPTIONS;
 	char *progname;
-	char short_opts[] = "hr";
+	char short_opts[] = "hprt:";
 	char key_str[LOND_KEY_STRING_SIZE];
 	struct lond_key key;
 	char dest_fsname[MAX_OBD_NAME + 1];
@@ -434,6 +488,9 @@ int main(int argc, char *const argv[])
 	char cwd_buf[PATH_MAX + 1];
 	int cwdsz = sizeof(cwd_buf);
 	bool need_rename = false;
+	bool prefetch = false;
+	struct lond_hsm_batch restore_batch;
+	int thread_number = LOND_WALK_THREADS_DEFAULT;
 
 	progname = argv[0];
 	while ((c = getopt_long(argc, argv, short_opts,
@@ -445,9 +502,20 @@ int main(int argc, char *const argv[])
 		case 'h':
 			usage(progname);
 			exit(1);
+		case 'p':
+			prefetch = true;
+			break;
 		case 'r':
 			need_rename = true;
 			break;
+		case 't':
+			thread_number = atoi(optarg);
+			if (thread_number <= 0) {
+				LERROR("invalid thread number [%s]\n", optarg);
+				usage(progname);
+				exit(1);
+			}
+			break;
 		default:
 			LERROR("failed to parse option [%c]\n", c);
 			usage(progname);
@@ -489,12 +557,24 @@ int main(int argc, char *const argv[])
 		return -errno;
 	}
 
-	nftw_private.u.np_fetch.npf_key = &key;
-	nftw_private.u.np_fetch.npf_archive_id = 1;
+	fetch.fwp_key = &key;
+	fetch.fwp_archive_id = 1;
+	fetch.fwp_restore_batch = NULL;
+	if (prefetch) {
+		/* Low priority, so the restores by the jobs go first */
+		rc = lond_hsm_batch_init(&restore_batch, dest, HUA_RESTORE,
+					 fetch.fwp_archive_id,
+					 LOND_HSM_DATA_BULK, 0, 0);
+		if (rc) {
+			LERROR("failed to init restore requests\n");
+			return rc;
+		}
+		fetch.fwp_restore_batch = &restore_batch;
+	}
 	for (i = optind; i < argc - 1; i++) {
 		source = argv[i];
-		rc = lond_fetch(source, dest, dest_fsname, &key, key_str,
-				need_rename);
+		rc = lond_fetch(source, &fetch, dest_fsname, key_str,
+				need_rename, thread_number);
 		rc2 = rc2 ? rc2 : rc;
 
 		rc = chdir(cwd);
@@ -506,5 +586,11 @@ int main(int argc, char *const argv[])
 		}
 	}
 
+	if (prefetch) {
+		rc = lond_hsm_batch_fini(&restore_batch);
+		rc2 = rc2 ? rc2 : rc;
+		LINFO("requested restores of [%llu] files\n",
+		      (unsigned long long)restore_batch.lhb_submitted);
+	}
 	return rc2;
 }
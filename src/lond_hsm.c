@@ -0,0 +1,183 @@
+/*
+ *
+ * Batched HSM requests for Lustre On Demand.
+ *
+ * The FIDs are accumulated and sent to the coordinator in one
+ * llapi_hsm_request() with many items, instead of one request, or even one
+ * lfs process, per file.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lustre/lustreapi.h>
+#include "debug.h"
+#include "lond.h"
+
+/*
+ * @path is any path on the Lustre file system that the FIDs belong to.
+ * @data is attached to the requests, e.g. LOND_HSM_DATA_BULK, NULL if none.
+ * If @max_items or @flush_interval is not positive, use the default values.
+ */
+int lond_hsm_batch_init(struct lond_hsm_batch *batch, const char *path,
+			enum hsm_user_action action, int archive_id,
+			const char *data, int max_items, int flush_interval)
+{
+	int data_len = data == NULL ? 0 : strlen(data) + 1;
+
+	memset(batch, 0, sizeof(*batch));
+	if (strlen(path) >= sizeof(batch->lhb_path)) {
+		LERROR("path [%s] is too long\n", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(batch->lhb_path, path);
+	batch->lhb_action = action;
+	batch->lhb_archive_id = archive_id;
+	batch->lhb_max_items = max_items > 0 ? max_items :
+		LOND_HSM_BATCH_ITEMS_DEFAULT;
+	batch->lhb_flush_interval = flush_interval > 0 ? flush_interval :
+		LOND_HSM_BATCH_INTERVAL_DEFAULT;
+	batch->lhb_data_len = data_len;
+
+	batch->lhb_hur = llapi_hsm_user_request_alloc(batch->lhb_max_items,
+						      data_len);
+	if (batch->lhb_hur == NULL) {
+		LERROR("failed to allocate HSM request\n");
+		return -ENOMEM;
+	}
+	if (data_len > 0) {
+		batch->lhb_data = strdup(data);
+		if (batch->lhb_data == NULL) {
+			LERROR("failed to allocate memory\n");
+			free(batch->lhb_hur);
+			batch->lhb_hur = NULL;
+			return -ENOMEM;
+		}
+	}
+	pthread_mutex_init(&batch->lhb_mutex, NULL);
+	return 0;
+}
+
+/*
+ * Send the accumulated items with batch->lhb_mutex held. The full request
+ * is replaced with the spare one and the lock is released during the RPC,
+ * so the other threads can keep adding items meanwhile. Only if the spare
+ * can't be allocated, the request is sent with the lock held.
+ */
+static int hsm_batch_flush_locked(struct lond_hsm_batch *batch)
+{
+	int rc;
+	struct hsm_user_request *hur = batch->lhb_hur;
+	struct hsm_user_request *spare = batch->lhb_spare;
+	int count = batch->lhb_count;
+
+	if (count == 0)
+		return 0;
+
+	/* Another thread is sending the spare */
+	if (spare == NULL)
+		spare = llapi_hsm_user_request_alloc(batch->lhb_max_items,
+						     batch->lhb_data_len);
+	batch->lhb_spare = NULL;
+
+	hur->hur_request.hr_action = batch->lhb_action;
+	hur->hur_request.hr_archive_id = batch->lhb_archive_id;
+	hur->hur_request.hr_flags = 0;
+	hur->hur_request.hr_itemcount = count;
+	hur->hur_request.hr_data_len = batch->lhb_data_len;
+	/* The data follows the items, so copy after setting the count */
+	if (batch->lhb_data_len > 0)
+		memcpy(hur_data(hur), batch->lhb_data, batch->lhb_data_len);
+
+	batch->lhb_count = 0;
+	if (spare != NULL) {
+		batch->lhb_hur = spare;
+		pthread_mutex_unlock(&batch->lhb_mutex);
+	}
+
+	rc = llapi_hsm_request(batch->lhb_path, hur);
+
+	if (spare != NULL) {
+		pthread_mutex_lock(&batch->lhb_mutex);
+		if (batch->lhb_spare == NULL)
+			batch->lhb_spare = hur;
+		else
+			free(hur);
+	}
+	if (rc) {
+		LERROR("failed to send HSM request with [%d] items on [%s]: %s\n",
+		       count, batch->lhb_path, strerror(-rc));
+		batch->lhb_failed += count;
+		return rc;
+	}
+	LDEBUG("sent HSM request with [%d] items on [%s]\n", count,
+	       batch->lhb_path);
+	batch->lhb_submitted += count;
+	return 0;
+}
+
+/* Add a FID to the batch, send the batch if it is full or too old */
+int lond_hsm_batch_add(struct lond_hsm_batch *batch, const struct lu_fid *fid)
+{
+	int rc = 0;
+	time_t now = time(NULL);
+	struct hsm_user_item *hui;
+
+	pthread_mutex_lock(&batch->lhb_mutex);
+	if (batch->lhb_count == 0)
+		batch->lhb_first_time = now;
+	hui = &batch->lhb_hur->hur_user_item[batch->lhb_count++];
+	hui->hui_fid = *fid;
+	hui->hui_extent.offset = 0;
+	hui->hui_extent.length = -1;
+
+	if (batch->lhb_count >= batch->lhb_max_items ||
+	    now >= batch->lhb_first_time + batch->lhb_flush_interval)
+		rc = hsm_batch_flush_locked(batch);
+	pthread_mutex_unlock(&batch->lhb_mutex);
+	return rc;
+}
+
+/* Send the batch if the oldest item has waited for the flush interval */
+int lond_hsm_batch_poll(struct lond_hsm_batch *batch)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&batch->lhb_mutex);
+	if (batch->lhb_count > 0 &&
+	    time(NULL) >= batch->lhb_first_time + batch->lhb_flush_interval)
+		rc = hsm_batch_flush_locked(batch);
+	pthread_mutex_unlock(&batch->lhb_mutex);
+	return rc;
+}
+
+int lond_hsm_batch_flush(struct lond_hsm_batch *batch)
+{
+	int rc;
+
+	pthread_mutex_lock(&batch->lhb_mutex);
+	rc = hsm_batch_flush_locked(batch);
+	pthread_mutex_unlock(&batch->lhb_mutex);
+	return rc;
+}
+
+/* Send the remaining items and free the batch */
+int lond_hsm_batch_fini(struct lond_hsm_batch *batch)
+{
+	int rc;
+
+	if (batch->lhb_hur == NULL)
+		return 0;
+
+	rc = lond_hsm_batch_flush(batch);
+	pthread_mutex_destroy(&batch->lhb_mutex);
+	free(batch->lhb_hur);
+	batch->lhb_hur = NULL;
+	free(batch->lhb_spare);
+	batch->lhb_spare = NULL;
+	free(batch->lhb_data);
+	batch->lhb_data = NULL;
+	return rc;
+}
@@ -0,0 +1,135 @@
+/*
+ *
+ * Send HSM requests of many files on Lustre in batches.
+ *
+ * The FIDs of the files are added to a lond_hsm_batch, so that at most
+ * LOND_HSM_BATCH_ITEMS_DEFAULT files are sent in one HSM request. This is
+ * the helper used by the Python tools instead of "lfs hsm_*", so that the
+ * paths are never parsed by a shell.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lustre/lustreapi.h>
+#include "definition.h"
+#include "debug.h"
+#include "lond.h"
+
+struct hsm_request_action {
+	const char		*hra_name;
+	enum hsm_user_action	 hra_action;
+};
+
+static struct hsm_request_action hsm_request_actions[] = {
+	{ "archive", HUA_ARCHIVE },
+	{ "restore", HUA_RESTORE },
+	{ "release", HUA_RELEASE },
+	{ "remove", HUA_REMOVE },
+	{ "cancel", HUA_CANCEL },
+	{ NULL, HUA_NONE },
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [option]... <action> <file>...\n"
+		"  action: archive, restore, release, remove or cancel\n"
+		"  file: Lustre file to send the HSM request for, all files should be on the same file system\n"
+		"  -a|--archive <id>: archive ID of the request, default: 0\n"
+		"  -d|--data <data>: data attached to the request\n",
+		prog);
+}
+
+int main(int argc, char *const argv[])
+{
+	int i;
+	int c;
+	int rc;
+	int rc2 = 0;
+	char *end;
+	char *progname;
+	const char *data = NULL;
+	int archive_id = 0;
+	struct lu_fid fid;
+	struct lond_hsm_batch batch;
+	struct hsm_request_action *action;
+	struct option long_opts[] = LOND_HSM_REQUEST_OPTIONS;
+	char short_opts[] = "a:d:h";
+
+	progname = argv[0];
+	while ((c = getopt_long(argc, argv, short_opts,
+				long_opts, NULL)) != -1) {
+		switch (c) {
+		case OPT_PROGNAME:
+			progname = optarg;
+			break;
+		case 'a':
+			archive_id = strtol(optarg, &end, 10);
+			if (*end != '\0' || archive_id < 0) {
+				LERROR("invalid archive ID [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
+		case 'd':
+			data = optarg;
+			break;
+		case 'h':
+			usage(progname);
+			return 0;
+		default:
+			LERROR("failed to parse option [%c]\n", c);
+			usage(progname);
+			return -EINVAL;
+		}
+	}
+
+	if (argc < optind + 2) {
+		LERROR("need an action and one or more Lustre files\n");
+		usage(progname);
+		return -EINVAL;
+	}
+
+	for (action = hsm_request_actions; action->hra_name != NULL;
+	     action++) {
+		if (strcmp(action->hra_name, argv[optind]) == 0)
+			break;
+	}
+	if (action->hra_name == NULL) {
+		LERROR("invalid action [%s]\n", argv[optind]);
+		usage(progname);
+		return -EINVAL;
+	}
+	optind++;
+
+	/* Requests can be sent through any file on the file system */
+	rc = lond_hsm_batch_init(&batch, argv[optind], action->hra_action,
+				 archive_id, data, 0, 0);
+	if (rc) {
+		LERROR("failed to init HSM requests\n");
+		return rc;
+	}
+
+	for (i = optind; i < argc; i++) {
+		rc = llapi_path2fid(argv[i], &fid);
+		if (rc) {
+			LERROR("failed to get FID of [%s]: %s\n", argv[i],
+			       strerror(-rc));
+			rc2 = rc2 ? rc2 : rc;
+			continue;
+		}
+
+		rc = lond_hsm_batch_add(&batch, &fid);
+		rc2 = rc2 ? rc2 : rc;
+	}
+
+	rc = lond_hsm_batch_fini(&batch);
+	rc2 = rc2 ? rc2 : rc;
+	return rc2;
+}
@@ -0,0 +1,92 @@
+/*
+ *
+ * Latency histograms for the metrics of Lustre On Demand.
+ *
+ * The buckets are log-linear like HDR histograms: values are grouped by
+ * their highest bit, and each group is split into 2^LOND_HISTOGRAM_SUB_BITS
+ * linear buckets, so the relative error is bounded by 1/8 at any scale.
+ * Recording is lock-free, so each thread can own a histogram and the
+ * reader merges them.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#include <string.h>
+#include "lond.h"
+
+#define LOND_HISTOGRAM_SUB_BUCKETS	(1 << LOND_HISTOGRAM_SUB_BITS)
+
+static int histogram_index(__u64 value)
+{
+	int bit;
+
+	if (value < 2 * LOND_HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	bit = 63 - __builtin_clzll(value);
+	if (bit >= LOND_HISTOGRAM_MAX_BITS)
+		return LOND_HISTOGRAM_BUCKETS - 1;
+	return (bit - LOND_HISTOGRAM_SUB_BITS) * LOND_HISTOGRAM_SUB_BUCKETS +
+		(value >> (bit - LOND_HISTOGRAM_SUB_BITS));
+}
+
+/* The largest value that falls into the bucket */
+static __u64 histogram_bucket_max(int index)
+{
+	int shift;
+	__u64 mantissa;
+
+	if (index < 2 * LOND_HISTOGRAM_SUB_BUCKETS)
+		return index;
+
+	shift = index / LOND_HISTOGRAM_SUB_BUCKETS - 1;
+	mantissa = index % LOND_HISTOGRAM_SUB_BUCKETS +
+		LOND_HISTOGRAM_SUB_BUCKETS;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void lond_histogram_record(struct lond_histogram *histogram, __u64 value)
+{
+	__atomic_add_fetch(&histogram->lh_buckets[histogram_index(value)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&histogram->lh_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&histogram->lh_sum, value, __ATOMIC_RELAXED);
+}
+
+/* Add @src, which might be being recorded, to @dst */
+void lond_histogram_merge(struct lond_histogram *dst,
+			  struct lond_histogram *src)
+{
+	int i;
+
+	for (i = 0; i < LOND_HISTOGRAM_BUCKETS; i++)
+		dst->lh_buckets[i] += __atomic_load_n(&src->lh_buckets[i],
+						      __ATOMIC_RELAXED);
+	dst->lh_count += __atomic_load_n(&src->lh_count, __ATOMIC_RELAXED);
+	dst->lh_sum += __atomic_load_n(&src->lh_sum, __ATOMIC_RELAXED);
+}
+
+/* Return the value below which @percentile percent of the values fall */
+__u64 lond_histogram_percentile(const struct lond_histogram *histogram,
+				double percentile)
+{
+	int i;
+	__u64 seen = 0;
+	__u64 total = 0;
+	__u64 rank;
+
+	/* The count might not match the buckets when merged on the fly */
+	for (i = 0; i < LOND_HISTOGRAM_BUCKETS; i++)
+		total += histogram->lh_buckets[i];
+	if (total == 0)
+		return 0;
+
+	rank = total * percentile / 100;
+	if (rank >= total)
+		rank = total - 1;
+	for (i = 0; i < LOND_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->lh_buckets[i];
+		if (seen > rank)
+			break;
+	}
+	return histogram_bucket_max(i);
+}
@@ -0,0 +1,186 @@
+/*
+ *
+ * Pool of copy buffers for Lustre On Demand.
+ *
+ * The buffers are mapped when first needed and kept until the pool is
+ * destroyed, so copying many small files doesn't allocate and fault in a
+ * new buffer for each file. A buffer is populated by the thread that
+ * borrows it first, so its pages are on the NUMA node of that thread, and
+ * it is preferably lent to threads running on the same node afterwards.
+ * The buffers are page aligned, thus usable for O_DIRECT.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "debug.h"
+#include "lond.h"
+
+/* Size of the huge pages that the buffers are rounded up to */
+#define LOND_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+/* NUMA node of the CPU this thread is running on */
+static int buf_pool_node(void)
+{
+	unsigned int cpu;
+	unsigned int node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL))
+		return 0;
+	return node;
+}
+
+/*
+ * Up to @max_bufs buffers of @buf_size bytes will be mapped. If @hugepage
+ * is set, huge pages are used if possible.
+ */
+int lond_buf_pool_init(struct lond_buf_pool *pool, size_t buf_size,
+		       int max_bufs, bool hugepage)
+{
+	size_t align = hugepage ? LOND_HUGEPAGE_SIZE : LOND_DIRECT_IO_ALIGN;
+
+	memset(pool, 0, sizeof(*pool));
+	if (buf_size == 0 || max_bufs <= 0) {
+		LERROR("invalid buffer size [%zu] or number [%d]\n",
+		       buf_size, max_bufs);
+		return -EINVAL;
+	}
+	pool->lbp_buf_size = buf_size;
+	pool->lbp_map_size = (buf_size + align - 1) / align * align;
+	pool->lbp_max_bufs = max_bufs;
+	pool->lbp_hugepage = hugepage;
+
+	pool->lbp_bufs = calloc(max_bufs, sizeof(*pool->lbp_bufs));
+	pool->lbp_nodes = calloc(max_bufs, sizeof(*pool->lbp_nodes));
+	pool->lbp_free = calloc(max_bufs, sizeof(*pool->lbp_free));
+	if (pool->lbp_bufs == NULL || pool->lbp_nodes == NULL ||
+	    pool->lbp_free == NULL) {
+		LERROR("failed to allocate memory\n");
+		free(pool->lbp_bufs);
+		free(pool->lbp_nodes);
+		free(pool->lbp_free);
+		memset(pool, 0, sizeof(*pool));
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&pool->lbp_mutex, NULL);
+	return 0;
+}
+
+/* Map a new buffer and fault it in on the node of this thread */
+static char *buf_pool_map(struct lond_buf_pool *pool)
+{
+	char *buf;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+
+	if (pool->lbp_hugepage) {
+		buf = mmap(NULL, pool->lbp_map_size, PROT_READ | PROT_WRITE,
+			   flags | MAP_HUGETLB, -1, 0);
+		if (buf != MAP_FAILED)
+			return buf;
+		LDEBUG("failed to map huge pages, using transparent huge pages: %s\n",
+		       strerror(errno));
+	}
+
+	buf = mmap(NULL, pool->lbp_map_size, PROT_READ | PROT_WRITE, flags,
+		   -1, 0);
+	if (buf == MAP_FAILED) {
+		LERROR("failed to map buffer of [%zu] bytes: %s\n",
+		       pool->lbp_map_size, strerror(errno));
+		return NULL;
+	}
+	if (pool->lbp_hugepage)
+		madvise(buf, pool->lbp_map_size, MADV_HUGEPAGE);
+	return buf;
+}
+
+/*
+ * Borrow a buffer of lbp_buf_size bytes. Return NULL if all the buffers are
+ * in use, the caller should allocate one itself rather than wait, since it
+ * might hold another buffer that others are waiting for.
+ */
+char *lond_buf_pool_get(struct lond_buf_pool *pool)
+{
+	int i;
+	int index;
+	int found = -1;
+	int node = buf_pool_node();
+	char *buf = NULL;
+
+	pthread_mutex_lock(&pool->lbp_mutex);
+	for (i = pool->lbp_free_count - 1; i >= 0; i--) {
+		if (pool->lbp_nodes[pool->lbp_free[i]] == node) {
+			found = i;
+			break;
+		}
+	}
+
+	/* Map a new buffer on this node rather than use a remote one */
+	if (found < 0 && pool->lbp_allocated < pool->lbp_max_bufs) {
+		buf = buf_pool_map(pool);
+		if (buf != NULL) {
+			index = pool->lbp_allocated++;
+			pool->lbp_bufs[index] = buf;
+			pool->lbp_nodes[index] = node;
+			goto out;
+		}
+	}
+
+	if (found < 0 && pool->lbp_free_count > 0)
+		found = pool->lbp_free_count - 1;
+	if (found >= 0) {
+		index = pool->lbp_free[found];
+		pool->lbp_free[found] =
+			pool->lbp_free[--pool->lbp_free_count];
+		buf = pool->lbp_bufs[index];
+	}
+out:
+	pthread_mutex_unlock(&pool->lbp_mutex);
+	return buf;
+}
+
+void lond_buf_pool_put(struct lond_buf_pool *pool, char *buf)
+{
+	int i;
+	bool found = false;
+
+	pthread_mutex_lock(&pool->lbp_mutex);
+	for (i = 0; i < pool->lbp_allocated; i++) {
+		if (pool->lbp_bufs[i] == buf) {
+			pool->lbp_free[pool->lbp_free_count++] = i;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lbp_mutex);
+	if (!found)
+		LERROR("buffer [%p] doesn't belong to the pool\n", buf);
+}
+
+/* All the buffers should have been returned */
+void lond_buf_pool_fini(struct lond_buf_pool *pool)
+{
+	int i;
+
+	if (pool->lbp_bufs == NULL)
+		return;
+
+	if (pool->lbp_free_count != pool->lbp_allocated)
+		LERROR("[%d] buffers are still in use\n",
+		       pool->lbp_allocated - pool->lbp_free_count);
+	for (i = 0; i < pool->lbp_allocated; i++)
+		munmap(pool->lbp_bufs[i], pool->lbp_map_size);
+	free(pool->lbp_bufs);
+	pool->lbp_bufs = NULL;
+	free(pool->lbp_nodes);
+	pool->lbp_nodes = NULL;
+	free(pool->lbp_free);
+	pool->lbp_free = NULL;
+	pthread_mutex_destroy(&pool->lbp_mutex);
+}
@@ -0,0 +1,452 @@
+/*
+ *
+ * Restore the fetched files on on-demand Lustre in advance.
+ *
+ * The released files are collected by walking the directory trees or
+ * reading a file list. Then restore requests of them are sent in batches
+ * and the restores are polled until finished, with at most a given number
+ * of files being restored at the same time.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lustre/lustreapi.h>
+#include "definition.h"
+#include "debug.h"
+#include "lond.h"
+
+/* Default max number of files being restored at the same time */
+#define PREFETCH_CONCURRENCY_DEFAULT	1000
+/* Seconds between the progress reports */
+#define PREFETCH_REPORT_INTERVAL	5
+/* Seconds between the polls of the restores */
+#define PREFETCH_POLL_INTERVAL		1
+
+struct prefetch_file {
+	/* Linked into pp_queued or pp_running */
+	struct lond_list_head	 pf_linkage;
+	struct lu_fid		 pf_fid;
+	off_t			 pf_size;
+	char			 pf_path[0];
+};
+
+struct prefetch_private {
+	/* Only restore files not smaller than this */
+	unsigned long long	 pp_min_size;
+	/* Only restore files not larger than this, 0 means no limit */
+	unsigned long long	 pp_max_size;
+	/* Only restore files with name matching this pattern */
+	const char		*pp_pattern;
+	/* Max number of files being restored at the same time */
+	int			 pp_concurrency;
+	/* Protects pp_queued when walking with multiple threads */
+	pthread_mutex_t		 pp_mutex;
+	/* Files to restore */
+	struct lond_list_head	 pp_queued;
+	/* Files that restore requests have been sent for */
+	struct lond_list_head	 pp_running;
+	int			 pp_running_count;
+	/* Statistics */
+	__u64			 pp_total_files;
+	__u64			 pp_total_bytes;
+	__u64			 pp_restored_files;
+	__u64			 pp_restored_bytes;
+	__u64			 pp_failed_files;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [option]... <file>...\n"
+		"  file: fetched local Lustre directory tree or regular file to restore\n"
+		"  -c|--concurrency <number>: max number of files being restored at the same time, default: %d\n"
+		"  -f|--file-list <file>: read the paths of the files to restore from the file, - for stdin\n"
+		"  -n|--name <pattern>: only restore files with name matching the shell pattern\n"
+		"  -s|--min-size <bytes>: only restore files not smaller than this\n"
+		"  -S|--max-size <bytes>: only restore files not larger than this\n"
+		"  -t|--threads: number of threads to scan the directory trees, default: %d\n",
+		prog, PREFETCH_CONCURRENCY_DEFAULT, LOND_WALK_THREADS_DEFAULT);
+}
+
+/*
+ * Queue the file if it is released, fetched by lond, and matches the
+ * filters. @name is the base name of the file.
+ */
+static int prefetch_check(struct prefetch_private *prefetch,
+			  const char *path, const char *name,
+			  const struct stat *sb)
+{
+	int rc;
+	size_t path_size;
+	struct prefetch_file *file;
+	struct hsm_user_state hus;
+	struct lond_xattr lond_xattr;
+
+	if (!S_ISREG(sb->st_mode))
+		return 0;
+	if ((unsigned long long)sb->st_size < prefetch->pp_min_size)
+		return 0;
+	if (prefetch->pp_max_size != 0 &&
+	    (unsigned long long)sb->st_size > prefetch->pp_max_size)
+		return 0;
+	if (prefetch->pp_pattern != NULL &&
+	    fnmatch(prefetch->pp_pattern, name, 0) != 0)
+		return 0;
+
+	rc = llapi_hsm_state_get(path, &hus);
+	if (rc) {
+		LERROR("failed to get HSM state of [%s]: %s\n", path,
+		       strerror(-rc));
+		return rc;
+	}
+	if (!(hus.hus_states & HS_RELEASED))
+		return 0;
+
+	rc = lond_read_local_xattr(path, &lond_xattr);
+	if (rc) {
+		LERROR("failed to read local xattr of [%s]\n", path);
+		return rc;
+	}
+	if (!lond_xattr.lx_is_valid) {
+		LDEBUG("skipping [%s] which is not fetched by lond: %s\n",
+		       path, lond_xattr.lx_invalid_reason);
+		return 0;
+	}
+
+	path_size = strlen(path) + 1;
+	file = malloc(sizeof(*file) + path_size);
+	if (file == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
+	}
+	memcpy(file->pf_path, path, path_size);
+	file->pf_size = sb->st_size;
+	rc = llapi_path2fid(path, &file->pf_fid);
+	if (rc) {
+		LERROR("failed to get FID of [%s]: %s\n", path,
+		       strerror(-rc));
+		free(file);
+		return rc;
+	}
+
+	pthread_mutex_lock(&prefetch->pp_mutex);
+	lond_list_add_tail(&file->pf_linkage, &prefetch->pp_queued);
+	prefetch->pp_total_files++;
+	prefetch->pp_total_bytes += file->pf_size;
+	pthread_mutex_unlock(&prefetch->pp_mutex);
+	return 0;
+}
+
+/* The visit function of lond_walk_tree() to collect the files */
+static int walk_prefetch_fn(struct lond_walk_thread *thread,
+			    struct lond_walk_entry *entry)
+{
+	return prefetch_check(thread->lwt_walk->lw_private, entry->lwe_path,
+			      entry->lwe_name, &entry->lwe_stat);
+}
+
+static int prefetch_collect_path(struct prefetch_private *prefetch,
+				 const char *path, int thread_number)
+{
+	int rc;
+	struct lond_walk walk;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.lw_thread_number = thread_number;
+	walk.lw_ignore_error = true;
+	walk.lw_private = prefetch;
+	walk.lw_visit = walk_prefetch_fn;
+	rc = lond_walk_tree(path, &walk);
+	if (rc)
+		LERROR("failed to scan [%s]\n", path);
+	return rc;
+}
+
+static int prefetch_collect_list(struct prefetch_private *prefetch,
+				 const char *list)
+{
+	int rc;
+	int rc2 = 0;
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	const char *name;
+	struct stat sb;
+
+	if (strcmp(list, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen(list, "r");
+		if (fp == NULL) {
+			rc = -errno;
+			LERROR("failed to open file list [%s]: %s\n", list,
+			       strerror(errno));
+			return rc;
+		}
+	}
+
+	while ((length = getline(&line, &line_size, fp)) != -1) {
+		if (length > 0 && line[length - 1] == '\n')
+			line[--length] = '\0';
+		if (length == 0)
+			continue;
+
+		if (lstat(line, &sb)) {
+			rc = -errno;
+			LERROR("failed to stat [%s]: %s\n", line,
+			       strerror(errno));
+			rc2 = rc2 ? rc2 : rc;
+			continue;
+		}
+
+		name = strrchr(line, '/');
+		name = name == NULL ? line : name + 1;
+		rc = prefetch_check(prefetch, line, name, &sb);
+		rc2 = rc2 ? rc2 : rc;
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return rc2;
+}
+
+/* Move finished restores out of pp_running */
+static void prefetch_poll(struct prefetch_private *prefetch)
+{
+	int rc;
+	struct prefetch_file *file;
+	struct prefetch_file *tmp;
+	struct hsm_user_state hus;
+	struct hsm_current_action hca;
+
+	lond_list_for_each_entry_safe(file, tmp, &prefetch->pp_running,
+				      pf_linkage) {
+		rc = llapi_hsm_state_get(file->pf_path, &hus);
+		if (rc == 0 && (hus.hus_states & HS_RELEASED)) {
+			rc = llapi_hsm_current_action(file->pf_path, &hca);
+			/* Still waiting or running */
+			if (rc == 0 && hca.hca_action != HUA_NONE)
+				continue;
+		}
+
+		if (rc == 0 && !(hus.hus_states & HS_RELEASED)) {
+			prefetch->pp_restored_files++;
+			prefetch->pp_restored_bytes += file->pf_size;
+		} else {
+			if (rc)
+				LERROR("failed to get HSM state of [%s]: %s\n",
+				       file->pf_path, strerror(-rc));
+			else
+				LERROR("failed to restore [%s]\n",
+				       file->pf_path);
+			prefetch->pp_failed_files++;
+		}
+		lond_list_del(&file->pf_linkage);
+		prefetch->pp_running_count--;
+		free(file);
+	}
+}
+
+static void prefetch_report(struct prefetch_private *prefetch)
+{
+	LINFO("restored [%llu/%llu] files, [%llu/%llu] MiB, [%llu] failed\n",
+	      (unsigned long long)prefetch->pp_restored_files,
+	      (unsigned long long)prefetch->pp_total_files,
+	      (unsigned long long)(prefetch->pp_restored_bytes >> 20),
+	      (unsigned long long)(prefetch->pp_total_bytes >> 20),
+	      (unsigned long long)prefetch->pp_failed_files);
+}
+
+/* Restore the queued files with at most pp_concurrency at the same time */
+static int prefetch_restore(struct prefetch_private *prefetch,
+			    const char *mnt)
+{
+	int rc;
+	time_t now;
+	time_t last_report = 0;
+	struct prefetch_file *file;
+	struct lond_hsm_batch batch;
+
+	/* Low priority, so the restores by the jobs go first */
+	rc = lond_hsm_batch_init(&batch, mnt, HUA_RESTORE, 0,
+				 LOND_HSM_DATA_BULK, 0, 0);
+	if (rc) {
+		LERROR("failed to init restore requests\n");
+		return rc;
+	}
+
+	while (!lond_list_empty(&prefetch->pp_queued) ||
+	       !lond_list_empty(&prefetch->pp_running)) {
+		while (prefetch->pp_running_count < prefetch->pp_concurrency &&
+		       !lond_list_empty(&prefetch->pp_queued)) {
+			file = lond_list_entry(prefetch->pp_queued.next,
+					       struct prefetch_file,
+					       pf_linkage);
+			lond_list_move_tail(&file->pf_linkage,
+					    &prefetch->pp_running);
+			prefetch->pp_running_count++;
+			rc = lond_hsm_batch_add(&batch, &file->pf_fid);
+			if (rc)
+				break;
+		}
+
+		/* Don't wait for more files to fill the batch */
+		if (rc == 0)
+			rc = lond_hsm_batch_flush(&batch);
+		if (rc) {
+			LERROR("failed to send restore requests\n");
+			break;
+		}
+
+		now = time(NULL);
+		if (now >= last_report + PREFETCH_REPORT_INTERVAL) {
+			prefetch_report(prefetch);
+			last_report = now;
+		}
+		sleep(PREFETCH_POLL_INTERVAL);
+		prefetch_poll(prefetch);
+	}
+	prefetch_report(prefetch);
+	lond_hsm_batch_fini(&batch);
+
+	if (rc == 0 && prefetch->pp_failed_files > 0)
+		rc = -EIO;
+	return rc;
+}
+
+static void prefetch_files_free(struct lond_list_head *head)
+{
+	struct prefetch_file *file;
+	struct prefetch_file *tmp;
+
+	lond_list_for_each_entry_safe(file, tmp, head, pf_linkage) {
+		lond_list_del(&file->pf_linkage);
+		free(file);
+	}
+}
+
+/*
+ * Assumptions:
+ * 1) Files are all on the same on-demand Lustre.
+ * 2) The copytool is running to restore the files.
+ */
+int main(int argc, char *const argv[])
+{
+	int i;
+	int c;
+	int rc;
+	int rc2 = 0;
+	char *end;
+	char *progname;
+	const char *list = NULL;
+	const char *mnt = NULL;
+	struct prefetch_private prefetch;
+	struct option long_opts[] = LOND_PREFETCH_OPTIONS;
+	char short_opts[] = "c:f:hn:s:S:t:";
+	int thread_number = LOND_WALK_THREADS_DEFAULT;
+
+	memset(&prefetch, 0, sizeof(prefetch));
+	prefetch.pp_concurrency = PREFETCH_CONCURRENCY_DEFAULT;
+	pthread_mutex_init(&prefetch.pp_mutex, NULL);
+	LOND_INIT_LIST_HEAD(&prefetch.pp_queued);
+	LOND_INIT_LIST_HEAD(&prefetch.pp_running);
+
+	progname = argv[0];
+	while ((c = getopt_long(argc, argv, short_opts,
+				long_opts, NULL)) != -1) {
+		switch (c) {
+		case OPT_PROGNAME:
+			progname = optarg;
+			break;
+		case 'c':
+			prefetch.pp_concurrency = atoi(optarg);
+			if (prefetch.pp_concurrency <= 0) {
+				LERROR("invalid concurrency [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
+		case 'f':
+			list = optarg;
+			break;
+		case 'h':
+			usage(progname);
+			return 0;
+		case 'n':
+			prefetch.pp_pattern = optarg;
+			break;
+		case 's':
+			prefetch.pp_min_size = strtoull(optarg, &end, 10);
+			if (*end != '\0') {
+				LERROR("invalid min size [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
+		case 'S':
+			prefetch.pp_max_size = strtoull(optarg, &end, 10);
+			if (*end != '\0') {
+				LERROR("invalid max size [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
+		case 't':
+			thread_number = atoi(optarg);
+			if (thread_number <= 0) {
+				LERROR("invalid thread number [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
+		default:
+			LERROR("failed to parse option [%c]\n", c);
+			usage(progname);
+			return -EINVAL;
+		}
+	}
+
+	if (argc < optind + 1 && list == NULL) {
+		LERROR("need one or more Lustre files/directories or a file list\n");
+		usage(progname);
+		return -EINVAL;
+	}
+
+	if (list != NULL) {
+		rc = prefetch_collect_list(&prefetch, list);
+		rc2 = rc2 ? rc2 : rc;
+	}
+
+	for (i = optind; i < argc; i++) {
+		rc = prefetch_collect_path(&prefetch, argv[i], thread_number);
+		rc2 = rc2 ? rc2 : rc;
+	}
+
+	if (lond_list_empty(&prefetch.pp_queued)) {
+		LINFO("no released file to restore\n");
+		return rc2;
+	}
+
+	/* Requests can be sent through any file on the file system */
+	mnt = lond_list_entry(prefetch.pp_queued.next, struct prefetch_file,
+			      pf_linkage)->pf_path;
+	rc = prefetch_restore(&prefetch, mnt);
+	rc2 = rc2 ? rc2 : rc;
+
+	prefetch_files_free(&prefetch.pp_queued);
+	prefetch_files_free(&prefetch.pp_running);
+	pthread_mutex_destroy(&prefetch.pp_mutex);
+	return rc2;
+}
@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <attr/xattr.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <lustre/lustreapi.h>
 #include "definition.h"
@@ -25,8 +26,9 @@ static void usage(const char *prog)
 	fprintf(stderr,
 		"Usage: %s [-d] <file>...\n"
 		"  file: Lustre directory tree or regular file to stat\n"
-		"  -d: only unlock directory itslef, not its sub-tree recursively\n",
-		prog);
+		"  -d: only unlock directory itslef, not its sub-tree recursively\n"
+		"  -t: number of threads to scan the sub-tree, default: %d\n",
+		prog, LOND_WALK_THREADS_DEFAULT);
 }
 
 /*
@@ -45,11 +47,12 @@ int main(int argc, char *const argv[])
 	const char *file;
 	struct option long_opts[] = LOND_STAT_OPTIONS;
 	char *progname;
-	char short_opts[] = "dh";
+	char short_opts[] = "dht:";
 	struct stat file_sb;
 	bool recursive = true;
 	char fsname[MAX_OBD_NAME + 1];
 	int c;
+	int thread_number = LOND_WALK_THREADS_DEFAULT;
 
 	progname = argv[0];
 	while ((c = getopt_long(argc, argv, short_opts,
@@ -64,6 +67,14 @@ int main(int argc, char *const argv[])
 		case 'd':
 			recursive = false;
 			break;
+		case 't':
+			thread_number = atoi(optarg);
+			if (thread_number <= 0) {
+				LERROR("invalid thread number [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
 		default:
 			LERROR("failed to parse option [%c]\n", c);
 			usage(progname);
@@ -98,7 +109,7 @@ int main(int argc, char *const argv[])
 		}
 
 		if (!recursive || S_ISREG(file_sb.st_mode)) {
-			rc = lond_inode_stat(file, NULL, file_sb.st_mode);
+			rc = lond_inode_stat(file, file_sb.st_mode);
 			if (rc) {
 				LERROR("failed to lond stat file [%s]: %s\n",
 				       file, strerror(errno));
@@ -114,7 +125,7 @@ int main(int argc, char *const argv[])
 				continue;
 			}
 
-			rc = lond_tree_stat(".", true);
+			rc = lond_tree_stat(".", true, thread_number);
 			if (rc) {
 				LERROR("failed to lond stat tree [%s]: %s\n",
 				       file, strerror(errno));
@@ -16,7 +16,7 @@
 #include <attr/xattr.h>
 #include <unistd.h>
 #include <string.h>
-#include <ftw.h>
+#include <stdlib.h>
 #include <lustre/lustreapi.h>
 #include "definition.h"
 #include "debug.h"
@@ -25,13 +25,49 @@
 
 struct dest_entry *dest_entry_table;
 
+/* Private data of walking the source directory tree */
+struct sync_walk_private {
+	/* The dest directory to copy to */
+	char			 swp_dest[PATH_MAX + 1];
+	/*
+	 * The source directory under the dest directory. This is genrated
+	 * when visiting the root of the walk, which is always visited before
+	 * any other inode. So there is no need to init it before walking.
+	 */
+	char			 swp_dest_source_dir[PATH_MAX + 2];
+	/* Hash table to check whether the inode is already created before */
+	struct dest_entry	*swp_dest_entry_table;
+	/* Mount point of dest */
+	char			 swp_dest_mnt[PATH_MAX + 1];
+	/* Mount point of source */
+	char			 swp_source_mnt[PATH_MAX + 1];
+	/* Number of threads to walk the tree */
+	int			 swp_thread_number;
+	/* Max bytes to copy at a time, also the size of the copy buffers */
+	int			 swp_chunk_size;
+	/* Whether to back the copy buffers with huge pages */
+	bool			 swp_hugepage;
+	/* Copy with O_DIRECT and keep the data out of the page cache */
+	bool			 swp_nocache;
+	/* Copy buffers shared by the walk threads */
+	struct lond_buf_pool	 swp_buf_pool;
+};
+
+/* Default size of the copy buffers */
+#define LOND_SYNC_CHUNK_SIZE_DEFAULT	(16 * 1024 * 1024)
+
 static void usage(const char *prog)
 {
 	fprintf(stderr,
-		"Usage: %s <source>... <dest>\n"
+		"Usage: %s [option]... <source>... <dest>\n"
 		"  source: local Lustre directory to sync from\n"
-		"  dest: global Lustre directory to sync to\n",
-		prog);
+		"  dest: global Lustre directory to sync to\n"
+		"  -t|--threads: number of threads to scan the source, default: %d\n"
+		"  -C|--chunk-size: max bytes to copy at a time, multiple of %d, default: %d\n"
+		"  -D|--direct: copy with O_DIRECT and keep the copied data out of the page cache\n"
+		"  -H|--hugepage: back the copy buffers with huge pages\n",
+		prog, LOND_WALK_THREADS_DEFAULT, LOND_DIRECT_IO_ALIGN,
+		LOND_SYNC_CHUNK_SIZE_DEFAULT);
 }
 
 static int lond_copy(const char *source, const char *dest)
@@ -68,12 +104,13 @@ static int lond_copy(const char *source, const char *dest)
 
 static int copy_data(char const *src_name, int src_desc, char const *dst_name,
 		     mode_t dst_mode, mode_t omitted_permissions,
-		     char *buf, int buf_size)
+		     struct sync_walk_private *sync)
 {
 	int rc = 0;
 	int dest_desc;
-	ssize_t n_read;
-	ssize_t n_write;
+	off_t offset = 0;
+	ssize_t n_copied;
+	struct lond_copy_engine engine;
 
 	dest_desc = open(dst_name, O_WRONLY | O_CREAT | O_EXCL,
 			 dst_mode & ~omitted_permissions);
@@ -83,34 +120,39 @@ static int copy_data(char const *src_name, int src_desc, char const *dst_name,
 		return -errno;
 	}
 
+	/* The dest is newly created, so the holes of source can be skipped */
+	lond_copy_engine_init(&engine, NULL, sync->swp_chunk_size);
+	engine.lce_pool = &sync->swp_buf_pool;
+	engine.lce_sparse = true;
+	engine.lce_nocache = sync->swp_nocache;
+	engine.lce_direct = sync->swp_nocache;
 	while (1) {
-		n_read = read(src_desc, buf, buf_size);
-		if (n_read < 0) {
-			if (errno == EINTR)
-				continue;
-			LERROR("failed to read [%s]: %s\n", src_name,
-			       strerror(errno));
-			rc = -errno;
+		n_copied = lond_copy_chunk(&engine, src_desc, dest_desc,
+					   offset, sync->swp_chunk_size);
+		if (n_copied < 0) {
+			rc = n_copied;
+			LERROR("failed to copy from [%s] to [%s] with %s: %s\n",
+			       src_name, dst_name,
+			       lond_copy_method_name(engine.lce_method),
+			       strerror(-rc));
 			goto out_close;
 		}
-		if (n_read == 0)
+		if (n_copied == 0)
 			break;
+		offset += n_copied;
+	}
 
-		n_write = write(dest_desc, buf, n_read);
-		if (n_write < 0) {
-			LERROR("failed to write [%s]: %s\n", dst_name,
-			       strerror(errno));
-			rc = -errno;
-			goto out_close;
-		} else if (n_write != n_read) {
-			LERROR("short write of [%s], trying to write [%llu], written [%llu]\n",
-			       dst_name, n_read, n_write);
-			rc = -errno;
-			goto out_close;
-		}
+	/* The source might end with a hole which is not written */
+	rc = ftruncate(dest_desc, offset);
+	if (rc) {
+		rc = -errno;
+		LERROR("failed to truncate [%s] to size [%llu]: %s\n",
+		       dst_name, (unsigned long long)offset,
+		       strerror(errno));
 	}
 
 out_close:
+	lond_copy_engine_fini(&engine);
 	if (close(dest_desc) < 0) {
 		LERROR("failed to close regular file [%s]: %s\n",
 		       dst_name, strerror(errno));
@@ -175,6 +217,51 @@ int lond_link(const char *source, const char *dest, struct lond_key *key,
 	return rc;
 }
 
+/*
+ * If the data of the source file has been archived by the copytool to
+ * LOND_ARCHIVE_DIR, move it to the dest. Return -ENOENT if not archived
+ * there.
+ */
+static int sync_archived(int src_desc, const char *src_name,
+			 const char *dst_name, const char *dst_mnt)
+{
+	int rc;
+	struct lu_fid fid;
+	struct hsm_user_state hus;
+	char archive_path[PATH_MAX + 1];
+
+	rc = llapi_hsm_state_get_fd(src_desc, &hus);
+	if (rc) {
+		LERROR("failed to get HSM state of source file [%s]: %s\n",
+		       src_name, strerror(-rc));
+		return rc;
+	}
+
+	if (!(hus.hus_states & HS_ARCHIVED) || (hus.hus_states & HS_DIRTY))
+		return -ENOENT;
+
+	rc = llapi_fd2fid(src_desc, &fid);
+	if (rc) {
+		LERROR("failed to get FID of [%s]: %s\n", src_name,
+		       strerror(-rc));
+		return rc;
+	}
+
+	lond_archive_path(archive_path, sizeof(archive_path), dst_mnt, &fid);
+	rc = rename(archive_path, dst_name);
+	if (rc) {
+		if (errno == ENOENT)
+			return -ENOENT;
+		rc = -errno;
+		LERROR("failed to rename [%s] to [%s]: %s\n", archive_path,
+		       dst_name, strerror(errno));
+		return rc;
+	}
+	LDEBUG("moved archived data [%s] of [%s] to [%s]\n", archive_path,
+	       src_name, dst_name);
+	return 0;
+}
+
 static int sync_reg(char const *src_name, char const *dst_name,
 		    mode_t dst_mode, mode_t omitted_permissions,
 		    struct stat const *src_sb, void *private)
@@ -187,10 +274,9 @@ static int sync_reg(char const *src_name, char const *dst_name,
 	struct lu_fid *global_fid;
 	struct lond_xattr lond_xattr;
 	char origin_source[PATH_MAX + 1];
-	struct nftw_private *nprivate = (struct nftw_private *)private;
-	const char *dst_mnt = nprivate->u.np_sync.nps_dest_mnt;
-	char *copy_buf = nprivate->u.np_sync.nps_copy_buf;
-	int buf_size = nprivate->u.np_sync.nps_copy_buf_size;
+	struct lond_walk_thread *thread = private;
+	struct sync_walk_private *sync = thread->lwt_walk->lw_private;
+	const char *dst_mnt = sync->swp_dest_mnt;
 
 	src_desc = open(src_name, O_RDONLY | O_NONBLOCK);
 	if (src_desc < 0) {
@@ -199,6 +285,10 @@ static int sync_reg(char const *src_name, char const *dst_name,
 		return -errno;
 	}
 
+	rc = sync_archived(src_desc, src_name, dst_name, dst_mnt);
+	if (rc != -ENOENT)
+		goto out_close;
+
 	rc = lond_read_local_xattr(src_name, &lond_xattr);
 	if (rc) {
 		LERROR("failed to read local xattr of [%s]\n", src_name);
@@ -252,7 +342,7 @@ static int sync_reg(char const *src_name, char const *dst_name,
 
 out_copy:
 	rc = copy_data(src_name, src_desc, dst_name, dst_mode,
-		       omitted_permissions, copy_buf, buf_size);
+		       omitted_permissions, sync);
 	if (rc)
 		LERROR("failed to copy data from [%s] to [%s]\n",
 		       src_name, dst_name);
@@ -261,9 +351,9 @@ out_close:
 	return rc;
 }
 
-/* The function of nftw() to sync files */
-static int nftw_sync_fn(const char *fpath, const struct stat *sb,
-			int tflag, struct FTW *ftwbuf)
+/* The visit function of lond_walk_tree() to sync files */
+static int walk_sync_fn(struct lond_walk_thread *thread,
+			struct lond_walk_entry *entry)
 {
 	int rc;
 	char *cwd;
@@ -273,15 +363,14 @@ static int nftw_sync_fn(const char *fpath, const struct stat *sb,
 	char dest_dir[PATH_MAX + 3];
 	int dest_dir_size = sizeof(dest_dir);
 	char full_fpath[PATH_MAX];
+	struct sync_walk_private *sync = thread->lwt_walk->lw_private;
 	/* The dest directory that contains the source basename */
-	char *dest_source_dir = nftw_private.u.np_sync.nps_dest_source_dir;
-	int dest_source_size;
-	char *dest = nftw_private.u.np_sync.nps_dest;
-	struct dest_entry **head;
-	bool is_root = (strlen(fpath) == 1 && fpath[0] == '.');
-
-	dest_source_size = sizeof(nftw_private.u.np_sync.nps_dest_source_dir);
-	head = &nftw_private.u.np_sync.nps_dest_entry_table;
+	char *dest_source_dir = sync->swp_dest_source_dir;
+	int dest_source_size = sizeof(sync->swp_dest_source_dir);
+	char *dest = sync->swp_dest;
+	struct dest_entry **head = &sync->swp_dest_entry_table;
+	const char *fpath = entry->lwe_path;
+	const struct stat *sb = &entry->lwe_stat;
 
 	rc = get_full_fpath(fpath, full_fpath, PATH_MAX);
 	if (rc) {
@@ -289,21 +378,18 @@ static int nftw_sync_fn(const char *fpath, const struct stat *sb,
 		return rc;
 	}
 
-	LDEBUG("%-3s %2d %7lld   %-40s %d %s\n",
-	       (tflag == FTW_D) ?   "d"   : (tflag == FTW_DNR) ? "dnr" :
-	       (tflag == FTW_DP) ?  "dp"  : (tflag == FTW_F) ?   "f" :
-	       (tflag == FTW_NS) ?  "ns"  : (tflag == FTW_SL) ?  "sl" :
-	       (tflag == FTW_SLN) ? "sln" : "???",
-	       ftwbuf->level, (long long int)sb->st_size,
-	       full_fpath, ftwbuf->base, fpath + ftwbuf->base);
+	LDEBUG("%-3s %2d %7lld   %-40s %s\n",
+	       S_ISDIR(sb->st_mode) ? "d" : S_ISLNK(sb->st_mode) ? "sl" : "f",
+	       entry->lwe_level, (long long int)sb->st_size,
+	       full_fpath, entry->lwe_name);
 
-	cwd = getcwd(cwd_buf, cwdsz);
-	if (cwd == NULL) {
-		LERROR("failed to get cwd: %s\n", strerror(errno));
-		return -errno;
-	}
+	if (entry->lwe_level == 0) {
+		cwd = getcwd(cwd_buf, cwdsz);
+		if (cwd == NULL) {
+			LERROR("failed to get cwd: %s\n", strerror(errno));
+			return -errno;
+		}
 
-	if (is_root) {
 		base = basename(cwd);
 		if (strlen(dest) == 1) {
 			if (dest[0] != '/') {
@@ -317,13 +403,13 @@ static int nftw_sync_fn(const char *fpath, const struct stat *sb,
 			snprintf(dest_source_dir, dest_source_size, "%s/%s",
 				 dest, base);
 		}
-		rc = lond_copy_inode(head, fpath, dest_source_dir, sync_reg,
-				     &nftw_private);
+		rc = lond_copy_inode(head, fpath, NULL, dest_source_dir,
+				     sync_reg, thread);
 	} else {
 		snprintf(dest_dir, dest_dir_size, "%s/%s", dest_source_dir,
 			 fpath);
-		rc = lond_copy_inode(head, fpath, dest_dir, sync_reg,
-				     &nftw_private);
+		rc = lond_copy_inode(head, fpath, NULL, dest_dir, sync_reg,
+				     thread);
 	}
 
 	if (rc) {
@@ -335,43 +421,18 @@ static int nftw_sync_fn(const char *fpath, const struct stat *sb,
 	return rc;
 }
 
-static void lond_sync_nfwt_dir_init(struct nftw_private *nftwp)
-{
-	nftwp->u.np_sync.nps_dest_entry_table = NULL;
-}
-
-static void lond_sync_nfwt_dir_fini(struct nftw_private *nftwp)
-{
-	free_dest_table(&nftw_private.u.np_sync.nps_dest_entry_table);
-}
-
-static int lond_sync_nfwt_init(struct nftw_private *nftwp)
-{
-	int size = 1048576 * 16;
-	char *buf;
-
-	buf = malloc(size);
-	nftwp->u.np_sync.nps_copy_buf = buf;
-	nftwp->u.np_sync.nps_copy_buf_size = size;
-	return -ENOMEM;
-}
-
-static void lond_sync_nfwt_fini(struct nftw_private *nftwp)
-{
-	free(nftwp->u.np_sync.nps_copy_buf);
-}
-
 static int lond_quick_sync(const char *source, const char *source_fsname,
-			   const char *dest, const char *dest_fsname)
+			   const char *dest, const char *dest_fsname,
+			   struct sync_walk_private *sync)
 {
 	int rc;
 	const char *base;
 	char dest_source_dir[PATH_MAX + 2];
-	int flags = FTW_PHYS;
-	char *dest_buffer = nftw_private.u.np_sync.nps_dest;
-	int dest_size = sizeof(nftw_private.u.np_sync.nps_dest);
-	char *dest_mnt = nftw_private.u.np_sync.nps_dest_mnt;
-	char *source_mnt = nftw_private.u.np_sync.nps_source_mnt;
+	struct lond_walk walk;
+	char *dest_buffer = sync->swp_dest;
+	int dest_size = sizeof(sync->swp_dest);
+	char *dest_mnt = sync->swp_dest_mnt;
+	char *source_mnt = sync->swp_source_mnt;
 
 	rc = llapi_search_rootpath(source_mnt, source_fsname);
 	if (rc) {
@@ -409,9 +470,13 @@ static int lond_quick_sync(const char *source, const char *source_fsname,
 	}
 
 	strncpy(dest_buffer, dest, dest_size);
-	lond_sync_nfwt_dir_init(&nftw_private);
-	rc = nftw(".", nftw_sync_fn, 32, flags);
-	lond_sync_nfwt_dir_fini(&nftw_private);
+	memset(&walk, 0, sizeof(walk));
+	walk.lw_thread_number = sync->swp_thread_number;
+	walk.lw_private = sync;
+	walk.lw_visit = walk_sync_fn;
+	sync->swp_dest_entry_table = NULL;
+	rc = lond_walk_tree(".", &walk);
+	free_dest_table(&sync->swp_dest_entry_table);
 	if (rc) {
 		LERROR("failed to sync directory tree [%s] to target [%s]\n",
 		       source, dest);
@@ -420,7 +485,8 @@ static int lond_quick_sync(const char *source, const char *source_fsname,
 	return 0;
 }
 
-static int lond_sync(const char *source, const char *dest, bool copy)
+static int lond_sync(const char *source, const char *dest, bool copy,
+		     struct sync_walk_private *sync)
 {
 	int rc;
 	struct lond_xattr lond_xattr;
@@ -483,7 +549,8 @@ static int lond_sync(const char *source, const char *dest, bool copy)
 			return rc;
 		}
 	} else {
-		rc = lond_quick_sync(source, source_fsname, dest, dest_fsname);
+		rc = lond_quick_sync(source, source_fsname, dest, dest_fsname,
+				     sync);
 		if (rc) {
 			LERROR("failed to sync quickly from [%s] to [%s]\n",
 			       source, dest);
@@ -512,8 +579,13 @@ int main(int argc, char *const argv[])
 	const char *progname;
 	char dest[PATH_MAX + 1];
 	char source[PATH_MAX + 1];
-	char short_opts[] = "ch";
+	char short_opts[] = "cC:DhHt:";
 	struct option long_opts[] = LOND_SYNC_OPTIONS;
+	struct sync_walk_private sync;
+
+	memset(&sync, 0, sizeof(sync));
+	sync.swp_thread_number = LOND_WALK_THREADS_DEFAULT;
+	sync.swp_chunk_size = LOND_SYNC_CHUNK_SIZE_DEFAULT;
 
 	progname = argv[0];
 	while ((c = getopt_long(argc, argv, short_opts,
@@ -525,9 +597,32 @@ int main(int argc, char *const argv[])
 		case 'c':
 			copy = true;
 			break;
+		case 'C':
+			sync.swp_chunk_size = atoi(optarg);
+			if (sync.swp_chunk_size <= 0 ||
+			    sync.swp_chunk_size % LOND_DIRECT_IO_ALIGN != 0) {
+				LERROR("invalid chunk size [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
+		case 'D':
+			sync.swp_nocache = true;
+			break;
 		case 'h':
 			usage(progname);
 			return 0;
+		case 'H':
+			sync.swp_hugepage = true;
+			break;
+		case 't':
+			sync.swp_thread_number = atoi(optarg);
+			if (sync.swp_thread_number <= 0) {
+				LERROR("invalid thread number [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
 		default:
 			LERROR("failed to parse option [%c]\n", c);
 			usage(progname);
@@ -545,19 +640,25 @@ int main(int argc, char *const argv[])
 	dest[sizeof(dest) - 1] = '\0';
 	remove_slash_tail(dest);
 
-	lond_sync_nfwt_init(&nftw_private);
+	/* Each walk thread copies one file at a time */
+	rc = lond_buf_pool_init(&sync.swp_buf_pool, sync.swp_chunk_size,
+				sync.swp_thread_number, sync.swp_hugepage);
+	if (rc) {
+		LERROR("failed to init buffer pool\n");
+		return rc;
+	}
+
 	for (i = optind; i < argc - 1; i++) {
 		strncpy(source, argv[i], sizeof(source) - 1);
 		source[sizeof(source) - 1] = '\0';
 		remove_slash_tail(source);
-		rc = lond_sync(source, dest, copy);
+		rc = lond_sync(source, dest, copy, &sync);
 		if (rc) {
 			LERROR("failed to sync from [%s] to [%s]\n", source,
 			       dest);
 			rc2 = rc2 ? rc2 : rc;
 		}
 	}
-	lond_sync_nfwt_fini(&nftw_private);
-
+	lond_buf_pool_fini(&sync.swp_buf_pool);
 	return rc2;
 }
@@ -0,0 +1,148 @@
+/*
+ *
+ * Token bucket to limit the bandwidth for Lustre On Demand.
+ *
+ * The bucket is shared by all threads without any lock. Instead of the
+ * number of tokens, it records the time when all the consumed tokens will
+ * have been refilled. Consuming tokens moves that time forward with a
+ * compare-and-swap, and the caller sleeps if the time is too far ahead of
+ * now, i.e. the tokens are used up.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "debug.h"
+#include "lond.h"
+
+#ifndef NSEC_PER_SEC
+# define NSEC_PER_SEC 1000000000ULL
+#endif
+
+/* Max time to sleep before checking whether the rate is changed */
+#define THROTTLE_SLICE_NS	(NSEC_PER_SEC / 10)
+
+static __u64 throttle_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void lond_token_bucket_init(struct lond_token_bucket *bucket, __u64 rate)
+{
+	bucket->ltb_rate = rate;
+	bucket->ltb_refill_time = 0;
+	bucket->ltb_generation = 0;
+}
+
+/*
+ * Change the rate, 0 means unlimited. Can be called during the consuming.
+ * The tokens consumed under the old rate are forgotten, and the sleepers
+ * consume their bytes again under the new rate.
+ */
+void lond_token_bucket_set_rate(struct lond_token_bucket *bucket, __u64 rate)
+{
+	__atomic_store_n(&bucket->ltb_rate, rate, __ATOMIC_RELAXED);
+	__atomic_store_n(&bucket->ltb_refill_time, 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bucket->ltb_generation, 1, __ATOMIC_RELEASE);
+}
+
+__u64 lond_token_bucket_get_rate(struct lond_token_bucket *bucket)
+{
+	return __atomic_load_n(&bucket->ltb_rate, __ATOMIC_RELAXED);
+}
+
+/* Return the nanoseconds to wait before @bytes can be used */
+__u64 lond_token_bucket_consume(struct lond_token_bucket *bucket,
+				__u64 bytes)
+{
+	__u64 rate = lond_token_bucket_get_rate(bucket);
+	__u64 now;
+	__u64 cost;
+	__u64 old;
+	__u64 new;
+
+	if (rate == 0 || bytes == 0)
+		return 0;
+
+	/* Avoid overflow of bytes * NSEC_PER_SEC */
+	cost = bytes / rate * NSEC_PER_SEC +
+		bytes % rate * NSEC_PER_SEC / rate;
+	now = throttle_now();
+	old = __atomic_load_n(&bucket->ltb_refill_time, __ATOMIC_RELAXED);
+	do {
+		/* Tokens are not accumulated while nobody is consuming */
+		new = (old > now ? old : now) + cost;
+	} while (!__atomic_compare_exchange_n(&bucket->ltb_refill_time, &old,
+					      new, true, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	/* Allow a burst of LOND_TOKEN_BUCKET_BURST_NS */
+	if (new <= now + LOND_TOKEN_BUCKET_BURST_NS)
+		return 0;
+	return new - now - LOND_TOKEN_BUCKET_BURST_NS;
+}
+
+static int throttle_sleep(__u64 wait)
+{
+	int rc;
+	struct timespec delay;
+
+	delay.tv_sec = wait / NSEC_PER_SEC;
+	delay.tv_nsec = wait % NSEC_PER_SEC;
+	do {
+		rc = nanosleep(&delay, &delay);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) {
+		rc = -errno;
+		LERROR("failed to sleep for bandwidth control: %s\n",
+		       strerror(errno));
+		return rc;
+	}
+	return 0;
+}
+
+/*
+ * Consume @bytes from the bucket, and sleep until they are available. The
+ * sleep is cut into slices of THROTTLE_SLICE_NS, and if the rate is changed
+ * meanwhile, the bytes are consumed again under the new rate.
+ */
+int lond_token_bucket_throttle(struct lond_token_bucket *bucket, __u64 bytes)
+{
+	int rc;
+	__u64 generation;
+	__u64 deadline;
+	__u64 wait;
+	__u64 now;
+	bool changed;
+
+	do {
+		changed = false;
+		generation = __atomic_load_n(&bucket->ltb_generation,
+					     __ATOMIC_ACQUIRE);
+		wait = lond_token_bucket_consume(bucket, bytes);
+		if (wait == 0)
+			return 0;
+
+		now = throttle_now();
+		deadline = now + wait;
+		while (now < deadline) {
+			wait = deadline - now;
+			if (wait > THROTTLE_SLICE_NS)
+				wait = THROTTLE_SLICE_NS;
+			rc = throttle_sleep(wait);
+			if (rc)
+				return rc;
+			if (__atomic_load_n(&bucket->ltb_generation,
+					    __ATOMIC_ACQUIRE) != generation) {
+				changed = true;
+				break;
+			}
+			now = throttle_now();
+		}
+	} while (changed);
+	return 0;
+}
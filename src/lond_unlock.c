@@ -19,7 +19,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <ftw.h>
 #include <uthash.h>
 #include <inttypes.h>
 #ifdef NEW_USER_HEADER
@@ -41,8 +40,9 @@ static void usage(const char *prog)
 		"Usage: %s [-d] -k <key> <file>...\n"
 		"  file: Lustre directory tree or regular file to unlock\n"
 		"  key: lock key, use \"%s\" to unlock without checking key\n"
-		"  -d: only unlock directory itslef, not its sub-tree recursively\n",
-		prog, LOND_KEY_ANY);
+		"  -d: only unlock directory itslef, not its sub-tree recursively\n"
+		"  -t: number of threads to scan the sub-tree, default: %d\n",
+		prog, LOND_KEY_ANY, LOND_WALK_THREADS_DEFAULT);
 }
 
 static int hex_char2int(char c)
@@ -104,7 +104,7 @@ int main(int argc, char *const argv[])
 	const char *file;
 	struct option long_opts[] = LOND_UNLOCK_OPTIONS;
 	char *progname;
-	char short_opts[] = "dhk:";
+	char short_opts[] = "dhk:t:";
 	struct stat file_sb;
 	bool recursive = true;
 	struct lond_key key;
@@ -113,6 +113,7 @@ int main(int argc, char *const argv[])
 	char *cwd;
 	char cwd_buf[PATH_MAX + 1];
 	int cwdsz = sizeof(cwd_buf);
+	int thread_number = LOND_WALK_THREADS_DEFAULT;
 
 	progname = argv[0];
 	while ((c = getopt_long(argc, argv, short_opts,
@@ -130,6 +131,14 @@ int main(int argc, char *const argv[])
 		case 'd':
 			recursive = false;
 			break;
+		case 't':
+			thread_number = atoi(optarg);
+			if (thread_number <= 0) {
+				LERROR("invalid thread number [%s]\n", optarg);
+				usage(progname);
+				return -EINVAL;
+			}
+			break;
 		default:
 			LERROR("failed to parse option [%c]\n", c);
 			usage(progname);
@@ -198,7 +207,8 @@ int main(int argc, char *const argv[])
 				continue;
 			}
 
-			rc = lond_tree_unlock(".", any_key, &key, true);
+			rc = lond_tree_unlock(".", any_key, &key, true,
+					      thread_number);
 			if (rc) {
 				LERROR("failed to unlock tree [%s] with key [%s]: %s\n",
 				       file, key_str, strerror(errno));
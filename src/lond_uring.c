@@ -0,0 +1,289 @@
+/*
+ *
+ * io_uring based data copy for Lustre On Demand.
+ *
+ * A file is copied with several chunks in flight. Each slot owns one fixed
+ * buffer registered to the ring, and goes through read and write requests
+ * until its chunk is copied, then it is reused for the next chunk.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifdef HAVE_LIBURING
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <liburing.h>
+#include "debug.h"
+#include "lond.h"
+
+#define LOND_URING_ALIGN	4096
+
+enum lond_uring_slot_state {
+	LOND_URING_SLOT_IDLE = 0,
+	LOND_URING_SLOT_READING,
+	LOND_URING_SLOT_WRITING,
+};
+
+struct lond_uring_slot {
+	enum lond_uring_slot_state	 lus_state;
+	/* Fixed buffer of this slot */
+	char				*lus_buf;
+	/* Start offset of the chunk */
+	off_t				 lus_offset;
+	/* Length of the chunk */
+	size_t				 lus_length;
+	/* Bytes of the chunk that have been written */
+	size_t				 lus_done;
+	/* Bytes in the buffer got by the last read */
+	size_t				 lus_nread;
+	/* Bytes of lus_nread that have been written */
+	size_t				 lus_written;
+};
+
+int lond_uring_init(struct lond_uring *uring, int depth, size_t buf_size)
+{
+	int i;
+	int rc;
+	struct iovec *iovs;
+
+	memset(uring, 0, sizeof(*uring));
+	uring->lu_depth = depth;
+	uring->lu_buf_size = buf_size;
+
+	uring->lu_slots = calloc(depth, sizeof(*uring->lu_slots));
+	iovs = calloc(depth, sizeof(*iovs));
+	if (uring->lu_slots == NULL || iovs == NULL) {
+		LERROR("failed to allocate memory\n");
+		rc = -ENOMEM;
+		goto out_free;
+	}
+
+	rc = posix_memalign((void **)&uring->lu_bufs, LOND_URING_ALIGN,
+			    buf_size * depth);
+	if (rc) {
+		LERROR("failed to allocate buffer of io_uring\n");
+		uring->lu_bufs = NULL;
+		rc = -rc;
+		goto out_free;
+	}
+
+	for (i = 0; i < depth; i++) {
+		uring->lu_slots[i].lus_buf = uring->lu_bufs + buf_size * i;
+		iovs[i].iov_base = uring->lu_slots[i].lus_buf;
+		iovs[i].iov_len = buf_size;
+	}
+
+	/* Each slot has at most one request in flight */
+	rc = io_uring_queue_init(depth, &uring->lu_ring, 0);
+	if (rc) {
+		LERROR("failed to init io_uring: %s\n", strerror(-rc));
+		goto out_free;
+	}
+
+	rc = io_uring_register_buffers(&uring->lu_ring, iovs, depth);
+	if (rc) {
+		LERROR("failed to register buffers of io_uring: %s\n",
+		       strerror(-rc));
+		io_uring_queue_exit(&uring->lu_ring);
+		goto out_free;
+	}
+	free(iovs);
+	return 0;
+out_free:
+	free(iovs);
+	free(uring->lu_bufs);
+	free(uring->lu_slots);
+	uring->lu_bufs = NULL;
+	uring->lu_slots = NULL;
+	return rc;
+}
+
+void lond_uring_fini(struct lond_uring *uring)
+{
+	/* The ring teardown releases the buffers of the pending requests */
+	if (!uring->lu_broken)
+		io_uring_unregister_buffers(&uring->lu_ring);
+	io_uring_queue_exit(&uring->lu_ring);
+	free(uring->lu_bufs);
+	free(uring->lu_slots);
+	uring->lu_bufs = NULL;
+	uring->lu_slots = NULL;
+}
+
+/* Queue the read of the remaining part of the chunk */
+static void uring_prep_read(struct lond_uring *uring, int index, int src_fd)
+{
+	struct io_uring_sqe *sqe;
+	struct lond_uring_slot *slot = &uring->lu_slots[index];
+
+	/* Never fails since each slot has at most one request in flight */
+	sqe = io_uring_get_sqe(&uring->lu_ring);
+	io_uring_prep_read_fixed(sqe, src_fd, slot->lus_buf,
+				 slot->lus_length - slot->lus_done,
+				 slot->lus_offset + slot->lus_done, index);
+	io_uring_sqe_set_data(sqe, (void *)(uintptr_t)index);
+	slot->lus_state = LOND_URING_SLOT_READING;
+}
+
+/* Queue the write of the data in the buffer which is not written yet */
+static void uring_prep_write(struct lond_uring *uring, int index, int dst_fd)
+{
+	struct io_uring_sqe *sqe;
+	struct lond_uring_slot *slot = &uring->lu_slots[index];
+
+	sqe = io_uring_get_sqe(&uring->lu_ring);
+	io_uring_prep_write_fixed(sqe, dst_fd,
+				  slot->lus_buf + slot->lus_written,
+				  slot->lus_nread - slot->lus_written,
+				  slot->lus_offset + slot->lus_done +
+				  slot->lus_written, index);
+	io_uring_sqe_set_data(sqe, (void *)(uintptr_t)index);
+	slot->lus_state = LOND_URING_SLOT_WRITING;
+}
+
+/*
+ * Copy [@offset, @offset + @length) from @src_fd to @dst_fd. @progress_fn
+ * is called with the total bytes copied each time a chunk is written, and
+ * the copy is aborted if it returns a negative value. The number of bytes
+ * copied is saved to @copied, which might be less than @length if the
+ * source is shorter. If the copy fails before all of its requests have
+ * completed, @uring is marked as broken and has to be finalized.
+ */
+int lond_uring_copy(struct lond_uring *uring, int src_fd, int dst_fd,
+		    off_t offset, size_t length,
+		    lond_uring_progress_fn progress_fn, void *private,
+		    __u64 *copied)
+{
+	int i;
+	int rc = 0;
+	int ret;
+	int inflight = 0;
+	struct io_uring_cqe *cqe;
+	struct lond_uring_slot *slot;
+	off_t next = offset;
+	off_t end = offset + length;
+	__u64 total = 0;
+
+	*copied = 0;
+	if (uring->lu_broken)
+		return -EIO;
+
+	for (i = 0; i < uring->lu_depth && next < end; i++) {
+		slot = &uring->lu_slots[i];
+		slot->lus_offset = next;
+		slot->lus_length = end - next;
+		if (slot->lus_length > uring->lu_buf_size)
+			slot->lus_length = uring->lu_buf_size;
+		slot->lus_done = 0;
+		next += slot->lus_length;
+		uring_prep_read(uring, i, src_fd);
+		inflight++;
+	}
+
+	while (inflight > 0) {
+		ret = io_uring_submit_and_wait(&uring->lu_ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			LERROR("failed to submit io_uring requests: %s\n",
+			       strerror(-ret));
+			/* Nothing can be reaped if submission is broken */
+			rc = ret;
+			break;
+		}
+
+		while (io_uring_peek_cqe(&uring->lu_ring, &cqe) == 0) {
+			i = (int)(uintptr_t)io_uring_cqe_get_data(cqe);
+			ret = cqe->res;
+			io_uring_cqe_seen(&uring->lu_ring, cqe);
+			slot = &uring->lu_slots[i];
+
+			if (ret < 0 || rc) {
+				/* Drain the requests in flight after failure */
+				if (rc == 0)
+					rc = ret;
+				slot->lus_state = LOND_URING_SLOT_IDLE;
+				inflight--;
+				continue;
+			}
+
+			if (slot->lus_state == LOND_URING_SLOT_READING) {
+				if (ret == 0) {
+					/* EOF, no more chunks after this */
+					if (end > slot->lus_offset +
+					    slot->lus_done)
+						end = slot->lus_offset +
+						      slot->lus_done;
+					slot->lus_state =
+						LOND_URING_SLOT_IDLE;
+					inflight--;
+					continue;
+				}
+				slot->lus_nread = ret;
+				slot->lus_written = 0;
+				uring_prep_write(uring, i, dst_fd);
+				continue;
+			}
+
+			if (ret == 0) {
+				/* Should never happen for regular files */
+				rc = -EIO;
+				slot->lus_state = LOND_URING_SLOT_IDLE;
+				inflight--;
+				continue;
+			}
+
+			slot->lus_written += ret;
+			if (slot->lus_written < slot->lus_nread) {
+				uring_prep_write(uring, i, dst_fd);
+				continue;
+			}
+
+			slot->lus_done += slot->lus_nread;
+			total += slot->lus_nread;
+			if (progress_fn != NULL) {
+				rc = progress_fn(private, total);
+				if (rc < 0) {
+					slot->lus_state = LOND_URING_SLOT_IDLE;
+					inflight--;
+					continue;
+				}
+			}
+
+			/* Short read, read the rest of the chunk */
+			if (slot->lus_done < slot->lus_length &&
+			    slot->lus_offset + slot->lus_done < end) {
+				uring_prep_read(uring, i, src_fd);
+				continue;
+			}
+
+			if (next >= end) {
+				slot->lus_state = LOND_URING_SLOT_IDLE;
+				inflight--;
+				continue;
+			}
+
+			slot->lus_offset = next;
+			slot->lus_length = end - next;
+			if (slot->lus_length > uring->lu_buf_size)
+				slot->lus_length = uring->lu_buf_size;
+			slot->lus_done = 0;
+			next += slot->lus_length;
+			uring_prep_read(uring, i, src_fd);
+		}
+	}
+
+	if (inflight > 0) {
+		LERROR("%d io_uring requests are still in flight, ring is broken\n",
+		       inflight);
+		uring->lu_broken = true;
+	}
+
+	*copied = total;
+	return rc;
+}
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,512 @@
+/*
+ *
+ * Parallel directory tree walker for Lustre On Demand.
+ *
+ * Each thread has a deque of directories to scan. A thread pushes the
+ * subdirectories it finds to the head of its own deque and pops from the
+ * head too, so it walks its part of the tree in depth-first order. Idle
+ * threads steal from the tail of the deques of other threads, which are
+ * usually the directories closest to the root with the largest sub-trees.
+ *
+ * Author: Li Xi <lixi@ddn.com>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <linux/limits.h>
+#include "debug.h"
+#include "lond.h"
+#include "list.h"
+
+/* Size of the buffer to read directory entries */
+#define LOND_WALK_DIRENT_BUF_SIZE	(64 * 1024)
+
+struct linux_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+
+/* A directory that has been visited, but its entries are not scanned yet */
+struct lond_walk_dir {
+	/* Linked into lwt_deque */
+	struct lond_list_head	 lwd_linkage;
+	/* Opened fd of the directory, -1 if not opened yet */
+	int			 lwd_fd;
+	/* Level of the directory */
+	int			 lwd_level;
+	/* Private data attached by the callback when visiting the directory */
+	void			*lwd_private;
+	/* Path of the directory */
+	char			 lwd_path[0];
+};
+
+static void walk_private_free(struct lond_walk *walk, void *private)
+{
+	if (private != NULL && walk->lw_dir_private_free != NULL)
+		walk->lw_dir_private_free(private);
+}
+
+static void walk_dir_free(struct lond_walk *walk, struct lond_walk_dir *dir)
+{
+	if (dir->lwd_fd >= 0) {
+		close(dir->lwd_fd);
+		__sync_fetch_and_sub(&walk->lw_open_fds, 1);
+	}
+	walk_private_free(walk, dir->lwd_private);
+	free(dir);
+}
+
+/* Update the counters of the walk with walk->lw_mutex held */
+static void walk_queued_update(struct lond_walk *walk, int queued_delta,
+			       int pending_delta)
+{
+	pthread_mutex_lock(&walk->lw_mutex);
+	walk->lw_queued += queued_delta;
+	walk->lw_pending += pending_delta;
+	if (walk->lw_pending == 0)
+		pthread_cond_broadcast(&walk->lw_cond);
+	else if (queued_delta > 0 && walk->lw_idle > 0)
+		pthread_cond_signal(&walk->lw_cond);
+	pthread_mutex_unlock(&walk->lw_mutex);
+}
+
+static void walk_abort(struct lond_walk *walk, int rc)
+{
+	pthread_mutex_lock(&walk->lw_mutex);
+	if (walk->lw_errno == 0)
+		walk->lw_errno = rc;
+	__atomic_store_n(&walk->lw_aborted, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&walk->lw_cond);
+	pthread_mutex_unlock(&walk->lw_mutex);
+}
+
+/* Record the error, return true if the walk should go on */
+static bool walk_error(struct lond_walk *walk, int rc)
+{
+	if (!walk->lw_ignore_error) {
+		walk_abort(walk, rc);
+		return false;
+	}
+
+	pthread_mutex_lock(&walk->lw_mutex);
+	if (walk->lw_errno == 0)
+		walk->lw_errno = rc;
+	pthread_mutex_unlock(&walk->lw_mutex);
+	return true;
+}
+
+static void walk_push(struct lond_walk_thread *thread,
+		      struct lond_walk_dir *dir)
+{
+	pthread_mutex_lock(&thread->lwt_deque_mutex);
+	lond_list_add(&dir->lwd_linkage, &thread->lwt_deque);
+	pthread_mutex_unlock(&thread->lwt_deque_mutex);
+	walk_queued_update(thread->lwt_walk, 1, 1);
+}
+
+/* Pop from the head if @steal is false, otherwise from the tail */
+static struct lond_walk_dir *walk_pop(struct lond_walk_thread *thread,
+				      bool steal)
+{
+	struct lond_walk_dir *dir = NULL;
+	struct lond_list_head *head = &thread->lwt_deque;
+
+	pthread_mutex_lock(&thread->lwt_deque_mutex);
+	if (!lond_list_empty(head)) {
+		if (steal)
+			dir = lond_list_entry(head->prev, struct lond_walk_dir,
+					      lwd_linkage);
+		else
+			dir = lond_list_entry(head->next, struct lond_walk_dir,
+					      lwd_linkage);
+		lond_list_del(&dir->lwd_linkage);
+	}
+	pthread_mutex_unlock(&thread->lwt_deque_mutex);
+
+	if (dir != NULL)
+		walk_queued_update(thread->lwt_walk, -1, 0);
+	return dir;
+}
+
+/* Get a directory to scan, wait if none, return NULL if the walk is done */
+static struct lond_walk_dir *walk_get(struct lond_walk_thread *thread)
+{
+	int i;
+	int victim;
+	struct lond_walk_dir *dir;
+	struct lond_walk *walk = thread->lwt_walk;
+	int thread_number = walk->lw_thread_number;
+
+	while (1) {
+		if (__atomic_load_n(&walk->lw_aborted, __ATOMIC_RELAXED))
+			return NULL;
+
+		dir = walk_pop(thread, false);
+		if (dir != NULL)
+			return dir;
+
+		for (i = 1; i < thread_number; i++) {
+			victim = (thread->lwt_index + i) % thread_number;
+			dir = walk_pop(&walk->lw_threads[victim], true);
+			if (dir != NULL)
+				return dir;
+		}
+
+		pthread_mutex_lock(&walk->lw_mutex);
+		walk->lw_idle++;
+		while (walk->lw_queued == 0 && walk->lw_pending > 0 &&
+		       !walk->lw_aborted)
+			pthread_cond_wait(&walk->lw_cond, &walk->lw_mutex);
+		walk->lw_idle--;
+		if (walk->lw_pending == 0 || walk->lw_aborted) {
+			pthread_mutex_unlock(&walk->lw_mutex);
+			return NULL;
+		}
+		pthread_mutex_unlock(&walk->lw_mutex);
+	}
+}
+
+static struct lond_walk_dir *walk_dir_alloc(const char *path, int level,
+					    void *private)
+{
+	struct lond_walk_dir *dir;
+	size_t path_size = strlen(path) + 1;
+
+	dir = malloc(sizeof(*dir) + path_size);
+	if (dir == NULL)
+		return NULL;
+
+	dir->lwd_fd = -1;
+	dir->lwd_level = level;
+	dir->lwd_private = private;
+	memcpy(dir->lwd_path, path, path_size);
+	return dir;
+}
+
+/*
+ * Queue a subdirectory that has been visited. Open it now if the fd budget
+ * allows, so that it doesn't need to be looked up by path again.
+ */
+static int walk_queue_subdir(struct lond_walk_thread *thread, int dirfd,
+			     struct lond_walk_entry *entry)
+{
+	struct lond_walk_dir *dir;
+	struct lond_walk *walk = thread->lwt_walk;
+
+	dir = walk_dir_alloc(entry->lwe_path, entry->lwe_level,
+			     entry->lwe_private);
+	if (dir == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	if (__sync_add_and_fetch(&walk->lw_open_fds, 1) <=
+	    walk->lw_max_open_fds) {
+		dir->lwd_fd = openat(dirfd, entry->lwe_name,
+				     O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+				     O_CLOEXEC);
+		if (dir->lwd_fd < 0)
+			/* Will try again by path and report error then */
+			__sync_fetch_and_sub(&walk->lw_open_fds, 1);
+	} else {
+		__sync_fetch_and_sub(&walk->lw_open_fds, 1);
+	}
+
+	walk_push(thread, dir);
+	return 0;
+}
+
+/* Read the entries of a directory and visit them */
+static int walk_scan_dir(struct lond_walk_thread *thread,
+			 struct lond_walk_dir *dir)
+{
+	int rc = 0;
+	int fd = dir->lwd_fd;
+	long nread;
+	long pos;
+	struct linux_dirent64 *dent;
+	struct lond_walk_entry entry;
+	struct lond_walk *walk = thread->lwt_walk;
+	char path[PATH_MAX];
+	size_t dir_length = strlen(dir->lwd_path);
+
+	if (fd < 0) {
+		fd = open(dir->lwd_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			  O_CLOEXEC);
+		if (fd < 0) {
+			rc = -errno;
+			LERROR("failed to open directory [%s]: %s\n",
+			       dir->lwd_path, strerror(errno));
+			return rc;
+		}
+	}
+
+	if (dir_length + 2 > sizeof(path)) {
+		LERROR("path [%s] is too long\n", dir->lwd_path);
+		rc = -ENAMETOOLONG;
+		goto out;
+	}
+	memcpy(path, dir->lwd_path, dir_length);
+	path[dir_length] = '/';
+
+	while (!__atomic_load_n(&walk->lw_aborted, __ATOMIC_RELAXED)) {
+		nread = syscall(SYS_getdents64, fd, thread->lwt_dirent_buf,
+				LOND_WALK_DIRENT_BUF_SIZE);
+		if (nread < 0) {
+			rc = -errno;
+			LERROR("failed to read directory [%s]: %s\n",
+			       dir->lwd_path, strerror(errno));
+			break;
+		}
+		if (nread == 0)
+			break;
+
+		for (pos = 0; pos < nread; pos += dent->d_reclen) {
+			dent = (struct linux_dirent64 *)
+				(thread->lwt_dirent_buf + pos);
+			if (strcmp(dent->d_name, ".") == 0 ||
+			    strcmp(dent->d_name, "..") == 0)
+				continue;
+
+			if (dir_length + 1 + strlen(dent->d_name) + 1 >
+			    sizeof(path)) {
+				LERROR("path [%s/%s] is too long\n",
+				       dir->lwd_path, dent->d_name);
+				rc = -ENAMETOOLONG;
+				if (!walk_error(walk, rc))
+					goto out;
+				rc = 0;
+				continue;
+			}
+			strcpy(path + dir_length + 1, dent->d_name);
+
+			memset(&entry, 0, sizeof(entry));
+			entry.lwe_dirfd = fd;
+			entry.lwe_name = dent->d_name;
+			entry.lwe_path = path;
+			entry.lwe_level = dir->lwd_level + 1;
+			entry.lwe_parent_private = dir->lwd_private;
+			if (fstatat(fd, dent->d_name, &entry.lwe_stat,
+				    AT_SYMLINK_NOFOLLOW)) {
+				rc = -errno;
+				LERROR("failed to stat [%s]: %s\n", path,
+				       strerror(errno));
+				if (!walk_error(walk, rc))
+					goto out;
+				rc = 0;
+				continue;
+			}
+
+			rc = walk->lw_visit(thread, &entry);
+			if (rc) {
+				if (!walk_error(walk, rc)) {
+					walk_private_free(walk,
+							  entry.lwe_private);
+					goto out;
+				}
+				/* Ignore the error and go on like nftw() */
+				rc = 0;
+			}
+
+			if (!S_ISDIR(entry.lwe_stat.st_mode)) {
+				walk_private_free(walk, entry.lwe_private);
+				continue;
+			}
+
+			rc = walk_queue_subdir(thread, fd, &entry);
+			if (rc) {
+				walk_private_free(walk, entry.lwe_private);
+				walk_abort(walk, rc);
+				goto out;
+			}
+		}
+	}
+out:
+	if (dir->lwd_fd < 0)
+		close(fd);
+	return rc;
+}
+
+static void *walk_thread_main(void *data)
+{
+	int rc;
+	struct lond_walk_dir *dir;
+	struct lond_walk_thread *thread = data;
+	struct lond_walk *walk = thread->lwt_walk;
+
+	while ((dir = walk_get(thread)) != NULL) {
+		rc = walk_scan_dir(thread, dir);
+		if (rc)
+			walk_error(walk, rc);
+		walk_dir_free(walk, dir);
+		walk_queued_update(walk, 0, -1);
+	}
+	return NULL;
+}
+
+/* Set the upper limit of the fds that are opened for the queued dirs */
+static void walk_fd_budget_init(struct lond_walk *walk)
+{
+	struct rlimit rlim;
+	long budget = 1024;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+	    rlim.rlim_cur != RLIM_INFINITY)
+		budget = rlim.rlim_cur;
+
+	/* Leave half of the fds for the callbacks and the scanning */
+	budget = budget / 2 - walk->lw_thread_number * 4;
+	if (budget < 0)
+		budget = 0;
+	walk->lw_max_open_fds = budget;
+	walk->lw_open_fds = 0;
+}
+
+/*
+ * Walk the tree under @root in parallel. The walk->lw_visit callback is
+ * called for every inode, including @root itself. A directory is always
+ * visited before the inodes under it. For a directory, the callback can set
+ * entry->lwe_private, which will be passed to the callbacks of its children
+ * as entry->lwe_parent_private.
+ *
+ * The callback can be called from multiple threads at the same time. It
+ * can use thread->lwt_private which is prepared by walk->lw_thread_init.
+ */
+int lond_walk_tree(const char *root, struct lond_walk *walk)
+{
+	int i;
+	int rc;
+	struct lond_walk_entry entry;
+	struct lond_walk_dir *dir;
+	struct lond_walk_thread *thread;
+	int started = 0;
+
+	if (walk->lw_thread_number <= 0)
+		walk->lw_thread_number = 1;
+	walk->lw_errno = 0;
+	walk->lw_aborted = false;
+	walk->lw_queued = 0;
+	walk->lw_pending = 0;
+	walk->lw_idle = 0;
+	walk_fd_budget_init(walk);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.lwe_dirfd = AT_FDCWD;
+	entry.lwe_name = root;
+	entry.lwe_path = root;
+	entry.lwe_level = 0;
+	if (lstat(root, &entry.lwe_stat)) {
+		rc = -errno;
+		LERROR("failed to stat [%s]: %s\n", root, strerror(errno));
+		return rc;
+	}
+
+	walk->lw_threads = calloc(walk->lw_thread_number,
+				  sizeof(*walk->lw_threads));
+	if (walk->lw_threads == NULL) {
+		LERROR("failed to allocate memory\n");
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&walk->lw_mutex, NULL);
+	pthread_cond_init(&walk->lw_cond, NULL);
+
+	for (i = 0; i < walk->lw_thread_number; i++) {
+		thread = &walk->lw_threads[i];
+		thread->lwt_walk = walk;
+		thread->lwt_index = i;
+		LOND_INIT_LIST_HEAD(&thread->lwt_deque);
+		pthread_mutex_init(&thread->lwt_deque_mutex, NULL);
+	}
+
+	for (i = 0; i < walk->lw_thread_number; i++) {
+		thread = &walk->lw_threads[i];
+		thread->lwt_dirent_buf = malloc(LOND_WALK_DIRENT_BUF_SIZE);
+		if (thread->lwt_dirent_buf == NULL) {
+			LERROR("failed to allocate memory\n");
+			rc = -ENOMEM;
+			goto out_fini;
+		}
+		if (walk->lw_thread_init != NULL) {
+			rc = walk->lw_thread_init(thread);
+			if (rc) {
+				LERROR("failed to init walk thread [%d]\n", i);
+				free(thread->lwt_dirent_buf);
+				thread->lwt_dirent_buf = NULL;
+				goto out_fini;
+			}
+		}
+	}
+
+	/* Visit the root in the first thread context */
+	thread = &walk->lw_threads[0];
+	rc = walk->lw_visit(thread, &entry);
+	if (rc) {
+		walk_private_free(walk, entry.lwe_private);
+		goto out_fini;
+	}
+
+	if (!S_ISDIR(entry.lwe_stat.st_mode)) {
+		walk_private_free(walk, entry.lwe_private);
+		goto out_fini;
+	}
+
+	dir = walk_dir_alloc(root, 0, entry.lwe_private);
+	if (dir == NULL) {
+		walk_private_free(walk, entry.lwe_private);
+		LERROR("failed to allocate memory\n");
+		rc = -ENOMEM;
+		goto out_fini;
+	}
+	walk_push(thread, dir);
+
+	for (started = 0; started < walk->lw_thread_number; started++) {
+		thread = &walk->lw_threads[started];
+		rc = pthread_create(&thread->lwt_thread, NULL,
+				    walk_thread_main, thread);
+		if (rc) {
+			LERROR("failed to create walk thread: %s\n",
+			       strerror(rc));
+			rc = -rc;
+			walk_abort(walk, rc);
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(walk->lw_threads[i].lwt_thread, NULL);
+out_fini:
+	for (i = 0; i < walk->lw_thread_number; i++) {
+		thread = &walk->lw_threads[i];
+		/* Aborted, cleanup the remaining dirs */
+		while ((dir = walk_pop(thread, false)) != NULL)
+			walk_dir_free(walk, dir);
+		pthread_mutex_destroy(&thread->lwt_deque_mutex);
+		if (thread->lwt_dirent_buf == NULL)
+			continue;
+		if (walk->lw_thread_fini != NULL)
+			walk->lw_thread_fini(thread);
+		free(thread->lwt_dirent_buf);
+	}
+	pthread_cond_destroy(&walk->lw_cond);
+	pthread_mutex_destroy(&walk->lw_mutex);
+	free(walk->lw_threads);
+	walk->lw_threads = NULL;
+
+	if (rc == 0)
+		rc = walk->lw_errno;
+	return rc;
+}